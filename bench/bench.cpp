@@ -0,0 +1,461 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Throughput benchmarks for the qsim callback layer. Each configuration of
+// callbacks is run on 1, 2, 4, ... up to N CPUs, by default on the synthetic
+// backend (libqemu-qsim-synth.so), so that the numbers reflect qsim and its
+// consumers rather than a guest. Results are printed as CSV, one line per
+// configuration and CPU count, and may be compared against a baseline file
+// written by an earlier run; the exit status is 1 if any configuration lost
+// more than the tolerated fraction of its MIPS.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <map>
+#include <thread>
+#include <atomic>
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include <qsim.h>
+#include <qsim-prof.h>
+#include <qsim-runner.h>
+#include <qsim-pipeline.h>
+
+#include <qcache.h>
+#include <qcache-moesi.h>
+#include <qcache-repl.h>
+#include <qcache-l0.h>
+#include <qcpu.h>
+
+using Qsim::OSDomain;
+
+using std::string; using std::vector; using std::ostream;
+
+// The hierarchy of qcache's own driver, trimmed to what the adaptor feeds.
+typedef Qcache::CacheGrp< 0, Qcache::CPNull,     4, 7, 6, Qcache::ReplLRU>
+        l1i_t;
+typedef Qcache::CacheGrp< 0, Qcache::CPDirMoesi, 8, 6, 6, Qcache::ReplLRU>
+        l1d_t;
+typedef Qcache::CacheGrp<10, Qcache::CPNull,     8, 8, 6, Qcache::ReplLRU>
+        l2_t;
+typedef Qcache::Cache   <20, Qcache::CPNull,    16, 9, 6, Qcache::ReplLRU,
+                         true, true> l3_t;
+typedef Qcache::FuncDram<200, 100, 3, Qcache::Dim4GB2Rank,
+                         Qcache::AddrMappingA> mc_t;
+typedef Qcache::L0Grp<6, 0> l0_t;
+typedef Qcache::CPUTimer<Qcache::InstLatencyForward, 2> CPUTimer_t;
+
+static inline double seconds() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec/1e6;
+}
+
+// Counts the events a configuration consumes. Each CPU's counters are only
+// touched by the thread running it, and are padded apart.
+class Consumer {
+public:
+  Consumer(OSDomain &osd): osd(osd), counts(osd.get_n()) {}
+  virtual ~Consumer() {}
+
+  // Called on the thread that ran CPU c, after each of its quanta.
+  virtual void drain(int c, uint64_t q) {}
+
+  virtual void reset() {
+    for (unsigned i = 0; i < counts.size(); ++i) counts[i].events = 0;
+  }
+
+  virtual uint64_t events() const {
+    uint64_t n = 0;
+    for (unsigned i = 0; i < counts.size(); ++i) n += counts[i].events;
+    return n;
+  }
+
+  void inst_cb(int c, uint64_t v, uint64_t p, uint8_t l, const uint8_t *b,
+               enum inst_type t)
+  {
+    ++counts[c].events;
+  }
+
+  void mem_cb(int c, uint64_t v, uint64_t p, uint8_t s, int w) {
+    ++counts[c].events;
+  }
+
+  void reg_cb(int c, int r, uint8_t s, int w) { ++counts[c].events; }
+
+  void dep_cb(int c, const OSDomain::reg_deps &d) { ++counts[c].events; }
+
+protected:
+  struct count {
+    count(): events(0) {}
+    uint64_t events;
+    unsigned char pad[64 - sizeof(uint64_t)];
+  };
+
+  OSDomain &osd;
+  vector<count> counts;
+};
+
+// One Qsim::Queue per CPU, emptied after every quantum.
+class QueueConsumer : public Consumer {
+public:
+  QueueConsumer(OSDomain &osd, bool filtered): Consumer(osd) {
+    for (int i = 0; i < osd.get_n(); ++i) {
+      queues.push_back(new Qsim::Queue(osd, i, false));
+      // Everything the synthetic backend runs passes this filter, so only
+      // the cost of filtering is measured.
+      if (filtered) queues[i]->set_filt(true, false, true, false);
+    }
+  }
+
+  ~QueueConsumer() {
+    for (unsigned i = 0; i < queues.size(); ++i) delete queues[i];
+  }
+
+  void drain(int c, uint64_t q) {
+    Qsim::Queue &qu(*queues[c]);
+    while (!qu.empty()) {
+      qu.pop();
+      ++counts[c].events;
+    }
+  }
+
+private:
+  vector<Qsim::Queue*> queues;
+};
+
+// A Qsim::Pipeline carrying instruction and memory events to one consumer
+// thread, which empties every CPU's ring in turn. Measures what handing the
+// stream to another host thread costs the emulation.
+class PipelineConsumer : public Consumer {
+public:
+  PipelineConsumer(OSDomain &osd):
+    Consumer(osd), pipe(osd, 4096, Qsim::Pipeline::INST|Qsim::Pipeline::MEM),
+    consumed(0), empty_passes(0),
+    thread(&PipelineConsumer::consume, this) {}
+
+  ~PipelineConsumer() {
+    pipe.close();
+    thread.join();
+  }
+
+  // Both are called between runs, so the consumer is let to catch up first.
+  void reset() {
+    settle();
+    consumed.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t events() const {
+    settle();
+    return consumed.load(std::memory_order_relaxed);
+  }
+
+private:
+  Qsim::Pipeline pipe;
+  std::atomic<uint64_t> consumed, empty_passes;
+  std::thread thread;
+
+  // Wait for a pass that starts after this call and finds every ring empty.
+  void settle() const {
+    uint64_t p(empty_passes.load(std::memory_order_acquire));
+    while (empty_passes.load(std::memory_order_acquire) < p + 2)
+      std::this_thread::yield();
+  }
+
+  void consume() {
+    Qsim::QueueItem items[256];
+
+    for (;;) {
+      bool closed(pipe.is_closed());
+      unsigned n(0);
+      for (int i = 0; i < osd.get_n(); ++i)
+        n += pipe.pop_bulk(i, items, 256);
+      consumed.fetch_add(n, std::memory_order_relaxed);
+
+      // A ring may have been filled after it was looked at, so only stop
+      // once a whole pass after close() comes up empty.
+      if (n == 0) {
+        empty_passes.fetch_add(1, std::memory_order_release);
+        if (closed) break;
+        std::this_thread::yield();
+      }
+    }
+  }
+};
+
+// The timing model of qcache's driver: a CPUTimer per CPU over a three-level
+// hierarchy, fed with user-mode instruction, memory and register events.
+// With l0, the CPUs access the L1s through same-line filters.
+class QcacheConsumer : public Consumer {
+public:
+  QcacheConsumer(OSDomain &osd, bool l0):
+    Consumer(osd), l3(mc, "L3"), l2(osd.get_n(), l3, "L2"),
+    l1i(osd.get_n(), l2, "L1i"), l1d(osd.get_n(), l2, "L1d"),
+    l0i(osd.get_n(), l1i, "L0i"), l0d(osd.get_n(), l1d, "L0d")
+  {
+    OSDomain::cb_filter user;
+    user.prot(OSDomain::PROT_USER);
+
+    osd.set_inst_cb(this, &QcacheConsumer::inst_cb);
+    osd.set_mem_cb_ex(user, this, &QcacheConsumer::mem_cb);
+    osd.set_reg_cb(user, this, &QcacheConsumer::reg_cb);
+
+    for (int i = 0; i < osd.get_n(); ++i) {
+      if (l0)
+        cpu.push_back(CPUTimer_t(i, l0d.getMemSysDev(i), l0i.getMemSysDev(i)));
+      else
+        cpu.push_back(CPUTimer_t(i, l1d.getCache(i), l1i.getCache(i)));
+    }
+  }
+
+  void inst_cb(int c, uint64_t v, uint64_t p, uint8_t l, const uint8_t *b,
+               enum inst_type t)
+  {
+    cpu[c].instCallback(p, t);
+    ++counts[c].events;
+  }
+
+  void mem_cb(int c, const OSDomain::mem_access &a) {
+    cpu[c].memCallback(a.paddr, a.pc, a.type);
+    ++counts[c].events;
+  }
+
+  void reg_cb(int c, int r, uint8_t size, int wr) {
+    cpu[c].regCallback(size == 0 ? QSIM_X86_RFLAGS : r, wr);
+    ++counts[c].events;
+  }
+
+private:
+  mc_t mc;
+  l3_t l3;
+  l2_t l2;
+  l1i_t l1i;
+  l1d_t l1d;
+  l0_t l0i, l0d;
+  vector<CPUTimer_t> cpu;
+};
+
+static const char *const configs[] = {
+  "none", "inst", "inst_mem", "inst_mem_reg", "inst_mem_dep", "queue",
+  "queue_flt", "pipeline", "qcache", "qcache_l0", "prof", NULL
+};
+
+static Consumer *make_consumer(OSDomain &osd, const string &config) {
+  Consumer *c;
+
+  if (config == "queue") return new QueueConsumer(osd, false);
+  if (config == "queue_flt") return new QueueConsumer(osd, true);
+  if (config == "pipeline") return new PipelineConsumer(osd);
+  if (config == "qcache") return new QcacheConsumer(osd, false);
+  if (config == "qcache_l0") return new QcacheConsumer(osd, true);
+
+  c = new Consumer(osd);
+  if (config != "none") osd.set_inst_cb(c, &Consumer::inst_cb);
+  if (config.compare(0, 8, "inst_mem") == 0)
+    osd.set_mem_cb(c, &Consumer::mem_cb);
+  if (config == "inst_mem_reg") osd.set_reg_cb(c, &Consumer::reg_cb);
+  if (config == "inst_mem_dep") osd.set_dep_cb(c, &Consumer::dep_cb);
+  if (config == "prof") Qsim::start_prof(osd, "/dev/null", 100000, 100);
+
+  return c;
+}
+
+struct result {
+  string config;
+  unsigned cpus, threads;
+  uint64_t insts, events;
+  double secs;
+
+  double mips() const { return insts / secs / 1e6; }
+  double mevents() const { return events / secs / 1e6; }
+};
+
+static ostream &operator<<(ostream &os, const result &r) {
+  std::ostringstream s;
+  s << r.config << ',' << r.cpus << ',' << r.threads << ',' << r.insts << ','
+    << r.events << ',' << std::fixed << std::setprecision(4) << r.secs << ','
+    << std::setprecision(3) << r.mips() << ',' << r.mevents();
+  return os << s.str();
+}
+
+struct options {
+  options(): max_cpus(4), threads(1), insts(1000000), quantum(100000),
+             tolerance(0.1), ram_mb(1024) {}
+
+  unsigned max_cpus, threads;
+  uint64_t insts, quantum;
+  double tolerance;
+  unsigned ram_mb;
+  string synth, state, only, out, baseline;
+};
+
+static result run_one(const options &o, const string &config, unsigned n) {
+  OSDomain *osd = o.state.empty() ?
+    new OSDomain(n, o.synth, "synth", QSIM_HEADLESS, o.ram_mb) :
+    new OSDomain(o.state.c_str());
+  n = osd->get_n();
+
+  Consumer *c = make_consumer(*osd, config);
+
+  Qsim::ParallelRunner runner(*osd, o.threads);
+  runner.set_quantum(o.quantum);
+  runner.set_step(o.quantum);
+  runner.set_timer(0);
+  runner.set_cpu_cb(c, &Consumer::drain);
+
+  // One quantum to bring up the CPUs and warm the caches.
+  runner.run(1);
+  c->reset();
+
+  uint64_t start_insts = 0;
+  for (unsigned i = 0; i < n; ++i) start_insts += osd->get_icount(i);
+
+  double start = seconds();
+  runner.run((o.insts + o.quantum - 1) / o.quantum);
+  double end = seconds();
+
+  result r;
+  r.config = config;
+  r.cpus = n;
+  r.threads = runner.get_threads();
+  r.insts = 0;
+  for (unsigned i = 0; i < n; ++i) r.insts += osd->get_icount(i);
+  r.insts -= start_insts;
+  r.events = c->events();
+  r.secs = end - start;
+
+  if (config == "prof") Qsim::end_prof(*osd);
+  delete c;
+  delete osd;
+
+  return r;
+}
+
+// Baseline files are earlier results; MIPS keyed by "config,cpus".
+static std::map<string, double> read_baseline(const string &file) {
+  std::map<string, double> b;
+  std::ifstream in(file.c_str());
+  string line;
+
+  while (std::getline(in, line)) {
+    if (line.empty() || line[0] == '#') continue;
+    vector<string> f;
+    std::istringstream s(line);
+    string field;
+    while (std::getline(s, field, ',')) f.push_back(field);
+    if (f.size() < 7) continue;
+    b[f[0] + ',' + f[1]] = atof(f[6].c_str());
+  }
+
+  return b;
+}
+
+static void usage(const char *name) {
+  std::cerr << "Usage: " << name << " [options]\n"
+    "  -c <n>     run 1, 2, 4, ... up to n CPUs (default 4)\n"
+    "  -t <n>     host threads (default 1)\n"
+    "  -n <n>     instructions per CPU (default 1000000)\n"
+    "  -q <n>     instructions per quantum (default 100000)\n"
+    "  -s <spec>  synthetic stream settings (see qsim-synth.cpp)\n"
+    "  -f <file>  run from a state file instead of the synthetic backend\n"
+    "  -r <name>  run only this configuration\n"
+    "  -o <file>  also write the results to file\n"
+    "  -b <file>  compare against a baseline written with -o\n"
+    "  -x <frac>  tolerated MIPS loss against the baseline (default 0.1)\n";
+  exit(1);
+}
+
+int main(int argc, char **argv) {
+  options o;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "c:t:n:q:s:f:r:o:b:x:")) != -1) {
+    switch (opt) {
+    case 'c': o.max_cpus = atoi(optarg); break;
+    case 't': o.threads = atoi(optarg); break;
+    case 'n': o.insts = strtoull(optarg, NULL, 0); break;
+    case 'q': o.quantum = strtoull(optarg, NULL, 0); break;
+    case 's': o.synth = optarg; break;
+    case 'f': o.state = optarg; break;
+    case 'r': o.only = optarg; break;
+    case 'o': o.out = optarg; break;
+    case 'b': o.baseline = optarg; break;
+    case 'x': o.tolerance = atof(optarg); break;
+    default: usage(argv[0]);
+    }
+  }
+  if (o.max_cpus == 0 || o.threads == 0 || o.quantum == 0) usage(argv[0]);
+
+  // A state file fixes the CPU count.
+  vector<unsigned> cpus;
+  if (!o.state.empty()) {
+    cpus.push_back(0);
+  } else {
+    for (unsigned n = 1; n < o.max_cpus; n *= 2) cpus.push_back(n);
+    cpus.push_back(o.max_cpus);
+  }
+
+  const string header("config,cpus,threads,insts,events,seconds,mips,"
+                      "mevents_per_sec");
+  std::ofstream out;
+  if (!o.out.empty()) {
+    out.open(o.out.c_str());
+    out << header << '\n';
+  }
+  std::cout << header << '\n';
+
+  vector<result> results;
+  for (unsigned i = 0; configs[i]; ++i) {
+    if (!o.only.empty() && o.only != configs[i]) continue;
+    for (unsigned j = 0; j < cpus.size(); ++j) {
+      result r(run_one(o, configs[i], cpus[j]));
+      std::cout << r << std::endl;
+      if (out.is_open()) out << r << std::endl;
+      results.push_back(r);
+    }
+  }
+
+  if (o.baseline.empty()) return 0;
+
+  std::map<string, double> base(read_baseline(o.baseline));
+  bool regressed = false;
+
+  std::cout << "\nAgainst " << o.baseline << ":\n";
+  for (unsigned i = 0; i < results.size(); ++i) {
+    const result &r(results[i]);
+    std::ostringstream key;
+    key << r.config << ',' << r.cpus;
+    std::map<string, double>::const_iterator b = base.find(key.str());
+
+    std::cout << std::left << std::setw(14) << r.config << std::right
+              << std::setw(4) << r.cpus << std::fixed << std::setprecision(3)
+              << std::setw(10) << r.mips() << " MIPS";
+    if (b == base.end() || b->second <= 0) {
+      std::cout << "   (no baseline)\n";
+      continue;
+    }
+
+    double ratio = r.mips() / b->second;
+    std::cout << std::setw(10) << b->second << " base " << std::setw(7)
+              << std::setprecision(1) << (ratio - 1) * 100 << '%';
+    if (ratio < 1 - o.tolerance) {
+      std::cout << "  REGRESSION";
+      regressed = true;
+    }
+    std::cout << '\n';
+  }
+
+  return regressed ? 1 : 0;
+}
@@ -23,6 +23,7 @@
 #include "distorm.h"
 #include <qsim.h>
 #include <qsim-load.h>
+#include <qsim-runner.h>
 
 using std::cout; using std::vector; using std::ofstream; using std::string;
 using Qsim::OSDomain; using std::map;
@@ -31,20 +32,10 @@ const unsigned BRS_PER_MILN = 1  ;
 const unsigned MAX_CPUS     = 16;
 
 pthread_mutex_t   output_mutex      = PTHREAD_MUTEX_INITIALIZER;
-pthread_mutex_t   running_mutex      = PTHREAD_MUTEX_INITIALIZER;
-pthread_barrier_t cpu_barrier1;
-pthread_barrier_t cpu_barrier2;
 
 ofstream tout;
 
-struct thread_arg_t {
-  int       cpu   ;
-  OSDomain  *cd    ;
-  uint64_t  icount;
-};
-
-vector<thread_arg_t*> thread_args(MAX_CPUS);
-vector<pthread_t   *> threads    (MAX_CPUS);
+OSDomain *cdp = NULL;
 
 static inline unsigned long long utime() {
   struct timeval tv;
@@ -52,58 +43,9 @@ static inline unsigned long long utime() {
   return 1000000l*tv.tv_sec + tv.tv_usec;
 }
 
-bool app_finished = false, do_exit = false;
+bool app_finished = false;
 unsigned long long start_time, end_time;
 
-void *cpu_thread_main(void* thread_arg) {
-  void mem_cb(int cpu, uint64_t vaddr, uint64_t paddr, uint8_t size, int type);
-  thread_arg_t *arg = (thread_arg_t*)thread_arg;
-  
-  // The first barrier. Wait for all of the threads to get initialized.
-  pthread_barrier_wait(&cpu_barrier1);
-
-  if (arg->cpu == 0) cout << "QTM threads ready.\n";
-
-  // Run until app finished.
-  unsigned i = 0;
-  while (!do_exit)
-  {
-    pthread_mutex_lock(&running_mutex);
-    arg->cd->run(arg->cpu, 1000000/BRS_PER_MILN);
-    pthread_mutex_unlock(&running_mutex);
-    arg->icount += 1000000/BRS_PER_MILN;
-      
-    uint64_t last_rip = arg->cd->get_reg(arg->cpu, QSIM_X86_RIP);
-    uint16_t last_tid = arg->cd->get_tid(arg->cpu);
-    bool     kernel   = arg->cd->get_prot(arg->cpu) == OSDomain::PROT_KERN;
-    if (i % BRS_PER_MILN == (BRS_PER_MILN - 1)) {
-      pthread_mutex_lock(&output_mutex);
-      tout << "Ran CPU " <<std::dec<<arg->cpu<<" for "<< 1000000/BRS_PER_MILN
-           << " insts, stopping at 0x" << std::hex << std::setfill('0') 
-           << std::setw(8) << last_rip << "(TID=" << std::dec << last_tid
-           << ')' << (kernel?"-kernel\n":"\n");
-      tout << std::hex << arg->cd->get_reg(arg->cpu, QSIM_X86_RAX) << ", "
-           << std::hex << arg->cd->get_reg(arg->cpu, QSIM_X86_RCX) << ", "
-           << std::hex << arg->cd->get_reg(arg->cpu, QSIM_X86_RBX) << ", "
-           << std::hex << arg->cd->get_reg(arg->cpu, QSIM_X86_RDX) << '\n';
-      pthread_mutex_unlock(&output_mutex);
-    }
-
-    // We call the timer interrupt in one thread, while no others are running.
-    pthread_barrier_wait(&cpu_barrier1);
-    if (arg->cpu == 0) {
-      if (i % BRS_PER_MILN == (BRS_PER_MILN - 1)) {
-	arg->cd->timer_interrupt();
-      }
-
-      if (app_finished) do_exit = true;
-    }
-    pthread_barrier_wait(&cpu_barrier2);
-    ++i;
-  }
-
-  return NULL;
-}
 struct cb_struct {
 void inst_cb(int            cpu_id, 
 	     uint64_t       vaddr,
@@ -149,7 +91,7 @@ int int_cb(int cpu_id, uint8_t vec)
 
 void mem_cb(int cpu_id, uint64_t vaddr, uint64_t paddr, uint8_t size, int type)
 {
-  uint16_t tid = thread_args[cpu_id]->cd->get_tid(cpu_id);
+  uint16_t tid = cdp->get_tid(cpu_id);
 
   pthread_mutex_lock(&output_mutex);
   tout << "CPU " << std::dec << cpu_id << ": mem op at 0x" << std::hex 
@@ -160,6 +102,31 @@ void mem_cb(int cpu_id, uint64_t vaddr, uint64_t paddr, uint8_t size, int type)
 
 int end_cb(int c) { app_finished = true; return 1; }
 
+// Runs on the host thread that ran the CPU, at the end of each quantum.
+void cpu_cb(int cpu, uint64_t q) {
+  if (q % BRS_PER_MILN != (BRS_PER_MILN - 1)) return;
+
+  uint64_t last_rip = cdp->get_reg(cpu, QSIM_X86_RIP);
+  uint16_t last_tid = cdp->get_tid(cpu);
+  bool     kernel   = cdp->get_prot(cpu) == OSDomain::PROT_KERN;
+
+  pthread_mutex_lock(&output_mutex);
+  tout << "Ran CPU " << std::dec << cpu << " for " << 1000000/BRS_PER_MILN
+       << " insts, stopping at 0x" << std::hex << std::setfill('0')
+       << std::setw(8) << last_rip << "(TID=" << std::dec << last_tid
+       << ')' << (kernel?"-kernel\n":"\n");
+  static const int regs[] = { QSIM_X86_RAX, QSIM_X86_RCX, QSIM_X86_RBX,
+                              QSIM_X86_RDX };
+  uint64_t v[4];
+  cdp->get_regs(cpu, regs, 4, v);
+  tout << std::hex << v[0] << ", " << std::hex << v[1] << ", "
+       << std::hex << v[2] << ", " << std::hex << v[3] << '\n';
+  pthread_mutex_unlock(&output_mutex);
+}
+
+// Runs between quanta, while no CPU is running.
+bool quantum_cb(uint64_t q) { return !app_finished; }
+
 } cb_obj;
 
 int main(int argc, char** argv) {
@@ -169,7 +136,6 @@ int main(int argc, char** argv) {
   if (!tout) { cout << "Could not open EXEC_TRACE for writing.\n"; exit(1); }
 
   // Create a runnable OSDomain.
-  OSDomain *cdp = NULL;
   if (argc < 3) {
     cdp = new OSDomain(MAX_CPUS, qsim_prefix + "/../x86_64_images/vmlinuz", "x86");
     //cd.connect_console(cout);
@@ -185,43 +151,27 @@ int main(int argc, char** argv) {
   cd.set_int_cb(&cb_obj, &cb_struct::int_cb);
   cd.set_app_end_cb(&cb_obj, &cb_struct::end_cb);
 
-  // Init. sync objects 
-  pthread_barrier_init(&cpu_barrier1, NULL, cd.get_n());
-  pthread_barrier_init(&cpu_barrier2, NULL, cd.get_n());
+  // One host thread per guest CPU. The timer interrupt is delivered every
+  // million instructions, between quanta.
+  Qsim::ParallelRunner runner(cd);
+  runner.set_quantum(1000000/BRS_PER_MILN);
+  runner.set_timer(BRS_PER_MILN);
+  runner.set_cpu_cb(&cb_obj, &cb_struct::cpu_cb);
+  runner.set_quantum_cb(&cb_obj, &cb_struct::quantum_cb);
 
+  cout << "QTM threads ready.\n";
 
-  // Launch threads
   start_time = utime();
-  for (int i = 0; i < cd.get_n(); i++) {
-    threads[i]     = new pthread_t    ;
-    thread_args[i] = new thread_arg_t ;
-
-    thread_args[i]->cpu    = i;
-    thread_args[i]->cd     = &cd;
-    thread_args[i]->icount = 0;
-
-    pthread_create(threads[i], NULL, cpu_thread_main, thread_args[i]);
-  }
-
-  // Wait for threads to end
-  for (int i = 0; i < cd.get_n(); i++) pthread_join(*threads[i], NULL);
+  runner.run();
   end_time = utime();
 
   // Print stats.
   for (int i = 0; i < cd.get_n(); i++) {
-    cout << "CPU " << i << ": " << thread_args[i]->icount 
+    cout << "CPU " << i << ": " << runner.get_icount(i)
          << " instructions.\n";
   }
   cout << end_time - start_time << "us\n";
 
-  // Clean up.
-  pthread_barrier_destroy(&cpu_barrier1);
-  pthread_barrier_destroy(&cpu_barrier2);
-  for (int i = 0; i < cd.get_n(); i++) { 
-    delete threads[i]; 
-    delete thread_args[i];
-  }
-
   tout.close();
 
   return 0;
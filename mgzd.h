@@ -8,16 +8,24 @@
 * This work is licensed under the terms of the GNU GPL, version 2. See the    *
 * COPYING file in the top-level directory.                                    *
 \*****************************************************************************/
+#include <atomic>
 #include <iostream>
 #include <iomanip>
 #include <sstream>
 #include <string>
+#include <vector>
 
 #include <dlfcn.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
 
 static const char* TMP_DIR = "/tmp/";
 static const char* TMP_PFX = "qsim_XXXXXX";
@@ -28,53 +36,164 @@ namespace Mgzd {
     std::string file;
   };
 
-  static lib_t __attribute__((unused)) open(const char *libfile) {
-    lib_t lib;
+  static double __attribute__((unused)) now_ms() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1e3 + t.tv_nsec / 1e6;
+  }
 
-    // Use $QSIM_TMP, if it's set.
-    const char* tmpdir = getenv("QSIM_TMP");
-    if (tmpdir) TMP_DIR = tmpdir;
+  // Copy len bytes from in to out inside the kernel where possible:
+  // copy_file_range (which can reflink), then sendfile, then read/write.
+  // Returns false on failure.
+  static bool __attribute__((unused)) copy_fd(int out, int in, size_t len) {
+    size_t done = 0;
+
+#ifdef SYS_copy_file_range
+    while (done < len) {
+      ssize_t n = syscall(SYS_copy_file_range, in, NULL, out, NULL,
+                          len - done, 0);
+      if (n <= 0) break;
+      done += n;
+    }
+    if (done == len) return true;
+#endif
 
-    const int buf_size = 1024; // 1KB
-    char tmpfile[buf_size], buf[buf_size];
+    off_t off = done;
+    while (done < len) {
+      ssize_t n = sendfile(out, in, &off, len - done);
+      if (n <= 0) break;
+      done += n;
+    }
+    if (done == len) return true;
+
+    char buf[1 << 16];
+    if (lseek(in, done, SEEK_SET) < 0 || lseek(out, done, SEEK_SET) < 0)
+      return false;
+    while (done < len) {
+      ssize_t n = read(in, buf, sizeof(buf));
+      if (n <= 0) return false;
+      if (write(out, buf, n) != n) return false;
+      done += n;
+    }
+    return true;
+  }
 
-    size_t size = strlen(TMP_DIR);
-    strncpy(tmpfile, TMP_DIR, size);
-    tmpfile[size] = '\0';
-    strcat(tmpfile, TMP_PFX);
+  // Anonymous in-memory file, or -1 if the kernel does not support them.
+  static int __attribute__((unused)) anon_file(const char *name) {
+#ifdef SYS_memfd_create
+    return syscall(SYS_memfd_create, name, 0);
+#else
+    errno = ENOSYS;
+    return -1;
+#endif
+  }
 
-    int fd = mkstemp(tmpfile);
-    FILE* fp = fdopen(fd, "wb");
+  // Number of the next private copy, counted across the whole process.
+  inline unsigned next_copy() {
+    static std::atomic<unsigned> n(0);
+    return ++n;
+  }
 
-    if (!fp) {
-      std::cerr << "Cannot open tmp file " << tmpfile << std::endl;
-      exit(1);
-    }
+  // dlopen() hands back the object already loaded under a name instead of
+  // loading the file again, and descriptor numbers are reused once closed,
+  // so /proc/self/fd/N alone may name an earlier copy. Each copy's path is
+  // spelled differently instead: the bits of its number, from the highest
+  // set one down, add "../fd/" for a one and "./" for a zero, both of which
+  // lead back to the same directory.
+  static std::string __attribute__((unused)) fd_path(int fd, unsigned copy) {
+    std::string path("/proc/self/fd/");
+    int b = 31;
+    while (b > 0 && !(copy >> b & 1)) --b;
+    for (; b >= 0; --b) path += (copy >> b & 1) ? "../fd/" : "./";
+
+    std::ostringstream s;
+    s << path << fd;
+    return s.str();
+  }
 
-    FILE* libfp = fopen(libfile, "r");
+  // Whether to report each load and its timing on stderr: set
+  // QSIM_LOAD_REPORT to anything but 0.
+  static bool __attribute__((unused)) load_report() {
+    const char *e = getenv("QSIM_LOAD_REPORT");
+    return e && *e && strcmp(e, "0");
+  }
 
-    if (!libfp) {
+  // Load a private copy of libfile, so opening multiple copies of the same
+  // file results in independent copies of global variables. The copy is an
+  // anonymous memory file named qsim-<copy number>, opened through
+  // /proc/self/fd, so nothing is left behind if the process dies; without
+  // memfd support it is a temporary file in $QSIM_TMP (default /tmp),
+  // removed by close().
+  static lib_t __attribute__((unused)) open(const char *libfile) {
+    lib_t lib;
+    double t0 = now_ms();
+
+    int libfd = ::open(libfile, O_RDONLY);
+    struct stat st;
+    if (libfd < 0 || fstat(libfd, &st) < 0) {
       std::cerr << "Cannot open library " << libfile << std::endl;
       exit(1);
     }
 
-    while ((size = fread(buf, 1, buf_size, libfp)) > 0) {
-      if (fwrite(buf, 1, size, fp) != size) {
+    // The memory file only has to stay open until dlopen() has mapped it.
+    const char *method = "memfd";
+    unsigned copy = next_copy();
+    std::ostringstream memfd_name;
+    memfd_name << "qsim-" << copy;
+    int fd = anon_file(memfd_name.str().c_str());
+    int memfd = -1;
+    if (fd >= 0) {
+      if (copy_fd(fd, libfd, st.st_size)) {
+        lib.file = fd_path(fd, copy);
+        memfd = fd;
+      } else {
+        ::close(fd);
+      }
+    }
+
+    if (lib.file.empty()) {
+      // Use $QSIM_TMP, if it's set.
+      const char* tmpdir = getenv("QSIM_TMP");
+      if (tmpdir) TMP_DIR = tmpdir;
+
+      std::string tmpfile(std::string(TMP_DIR) + TMP_PFX);
+      std::vector<char> name(tmpfile.begin(), tmpfile.end());
+      name.push_back('\0');
+
+      method = "tmpfile";
+      fd = mkstemp(&name[0]);
+      if (fd < 0) {
+        std::cerr << "Cannot open tmp file " << &name[0] << std::endl;
+        exit(1);
+      }
+
+      if (!copy_fd(fd, libfd, st.st_size)) {
         std::cerr << "couldn't write whole buffer" << std::endl;
         exit(1);
       }
+      ::close(fd);
+      lib.file = &name[0];
     }
-    fclose(fp);
-
-    // Make temporary copy of libfile, so opening multiple copies of the same
-    // file results in independent copies of global variables.
-    lib.file = strdup(tmpfile);
-    std::cout << "Opening " << lib.file.c_str() << std::endl;
+    ::close(libfd);
 
+    double t1 = now_ms();
     lib.handle = dlopen(lib.file.c_str(), RTLD_NOW|RTLD_LOCAL);
     if (lib.handle == NULL) {
       std::cerr << "dlopen(\"" << lib.file.c_str() << "\") failed:  " 
                 << dlerror() << '\n';
+    } else if (memfd >= 0) {
+      ::close(memfd);
+    }
+
+    if (load_report()) {
+      double t2 = now_ms();
+
+      std::ostringstream msg;
+      msg << "Opening " << libfile << " as " << lib.file << " (" << method
+          << ", " << std::fixed << std::setprecision(1)
+          << st.st_size / 1048576.0 << " MB copied in " << t1 - t0
+          << " ms, dlopen " << t2 - t1 << " ms)";
+      std::cerr << msg.str() << std::endl;
     }
 
     return lib;
@@ -82,7 +201,7 @@ namespace Mgzd {
 
   static void __attribute__((unused)) close(const lib_t &lib) {
     //dlclose(lib.handle);
-    unlink(lib.file.c_str());
+    if (lib.file.compare(0, 6, "/proc/") != 0) unlink(lib.file.c_str());
   }
 
   template <typename T> static void sym(T *&ret, 
@@ -96,5 +215,14 @@ namespace Mgzd {
     }
   }
 
+  // Like sym(), but for symbols that older libraries may not export. Sets ret
+  // to NULL instead of failing when the symbol is missing.
+  template <typename T> static void sym_opt(T *&ret,
+                                            const lib_t lib,
+                                            const char *sym) {
+    (void*&)ret = dlsym(lib.handle, sym);
+    if (dlerror()) ret = NULL;
+  }
+
 };
 #endif
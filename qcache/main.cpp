@@ -2,7 +2,6 @@
 #include <fstream>
 #include <vector>
 
-#include <pthread.h>
 
 #include <stdint.h>
 #include <stdlib.h>
@@ -12,10 +11,12 @@
 
 #include <qsim.h>
 #include <qsim-load.h>
+#include <qsim-runner.h>
 
 #include <qcache.h>
 #include <qcache-moesi.h>
 #include <qcache-repl.h>
+#include <qcache-l0.h>
 #include <qtickable.h>
 
 #include <qcpu.h>
@@ -52,6 +53,10 @@ typedef Qcache::CacheGrp< 0, CPDirMoesi, 8,  6, 6, ReplLRU        > l1d_t;
 typedef Qcache::CacheGrp<10, CPNull,     8,  8, 6, ReplLRU        > l2_t;
 typedef Qcache::Cache   <20, CPNull,    16, 9, 6, ReplLRU,  true, true> l3_t;
 
+// Same-line filters in front of the L1s. <log2(bytes/line), hit latency>
+// must match the L1 types.
+typedef Qcache::L0Grp<6, 0> l0_t;
+
 // For now the L1 through LLC latency is a template parameter to mc_t.
 //typedef MemController<DramTiming1067, Dim4GB2Rank, AddrMappingA,30,3> mc_t;
 typedef Qcache::FuncDram<200, 100, 3, Dim4GB2Rank, AddrMappingA> mc_t;
@@ -62,6 +67,14 @@ typedef Qcache::CPUTimer<Qcache::InstLatencyForward, 2> CPUTimer_t;
 // Tiny 512k LLC to use (without L2) when validating replacement policies
 //typedef Qcache::Cache   <CPNull,   8, 10, 6, ReplBRRIP, true> l3_t;
 
+// Number of cycles between barriers.
+const Qcache::cycle_t BARRIER_INTERVAL = 10000;
+const Qcache::cycle_t BARRIERS_PER_TICK = 100;
+const Qcache::cycle_t BARRIERS_PER_OUTPUT = 1;
+
+// The run normally ends with the application; this is a backstop.
+const Qcache::cycle_t MAX_BARRIERS = 100000000;
+
 // This is a sad little hack that ensures our N threads are packed into the N
 // lowest-ID'd CPUs. On our test machine, this keeps the threads on as few
 // sockets as possible, without scheduling any pair of threads to the same
@@ -80,15 +93,24 @@ public:
   CallbackAdaptor(
     Qsim::OSDomain &osd, l1i_t &l1i, l1d_t &l1d, Qcache::Tickable *mc=NULL
   ):
-    cpu(), running(true), l1i(l1i), l1d(l1d), osd(osd)
+    cpu(), running(true), nextBarrier(BARRIER_INTERVAL),
+    outputCountdown(BARRIERS_PER_OUTPUT), lastIcount(osd.get_n(), NO_ICOUNT),
+    l1i(l1i), l1d(l1d),
+    l0i(osd.get_n(), l1i, "L0i"), l0d(osd.get_n(), l1d, "L0d"), osd(osd)
   {
+    // Only user-mode memory and register traffic is timed; let the OSDomain
+    // drop the rest before it reaches us.
+    Qsim::OSDomain::cb_filter user;
+    user.prot(Qsim::OSDomain::PROT_USER);
+
     icb_handle = osd.set_inst_cb(this, &CallbackAdaptor::inst_cb);
-    mcb_handle = osd.set_mem_cb(this, &CallbackAdaptor::mem_cb);
-    osd.set_reg_cb(this, &CallbackAdaptor::reg_cb);
+    mcb_handle = osd.set_mem_cb_ex(user, this, &CallbackAdaptor::mem_cb);
+    osd.set_reg_cb(user, this, &CallbackAdaptor::reg_cb);
     osd.set_app_end_cb(this, &CallbackAdaptor::app_end_cb);
 
     for (unsigned i = 0; i < osd.get_n(); ++i) {
-      cpu.push_back(CPUTimer_t(i, l1d.getCache(i), l1i.getCache(i), mc));
+      cpu.push_back(CPUTimer_t(i, l0d.getMemSysDev(i), l0i.getMemSysDev(i),
+                               mc));
     }
 
     #ifdef PROFILE
@@ -98,7 +120,7 @@ public:
 
   ~CallbackAdaptor() {
     //osd.unset_inst_cb(icb_handle);
-    //osd.unset_mem_cb(mcb_handle);
+    //osd.unset_mem_cb_ex(mcb_handle);
 
     #ifdef PROFILE
     Qsim::end_prof(osd);
@@ -115,14 +137,14 @@ public:
   }
 
   void reg_cb(int c, int r, uint8_t size, int wr) {
-    if (!running || osd.get_prot(c) == Qsim::OSDomain::PROT_KERN) return;
-    cpu[c].regCallback(size==0?QSIM_RFLAGS:r, wr);
+    if (!running) return;
+    cpu[c].regCallback(size==0?QSIM_X86_RFLAGS:r, wr);
   }
 
-  void mem_cb(int c, uint64_t va, uint64_t pa, uint8_t sz, int wr) {
-    if (!running || osd.get_prot(c) == Qsim::OSDomain::PROT_KERN) return;
-    //l1d.getCache(c).access(pa, osd.get_reg(c, QSIM_RIP), c, wr);
-    cpu[c].memCallback(pa, osd.get_reg(c, QSIM_RIP), wr);
+  void mem_cb(int c, const Qsim::OSDomain::mem_access &a) {
+    if (!running) return;
+    //l1d.getCache(c).access(a.paddr, a.pc, c, a.type);
+    cpu[c].memCallback(a.paddr, a.pc, a.type);
     return;
   }
 
@@ -131,13 +153,48 @@ public:
     return 1;
   }
 
+  // CPUs run until their cycle count reaches the next barrier. Even if a CPU
+  // runs out of instructions, its model must be ticked up to the barrier.
+  // The runner calls this once more after a step that ran nothing, which
+  // shows up as no change in the instruction count since the last call.
+  bool step_cb(int c) {
+    uint64_t n(osd.get_icount(c));
+    bool stalled(n == lastIcount[c]);
+    lastIcount[c] = n;
+
+    if (!osd.runnable(c) || stalled) {
+      while (cpu[c].getCycle() < nextBarrier) cpu[c].idleInst();
+      return true;
+    }
+    return cpu[c].getCycle() >= nextBarrier;
+  }
+
+  // Runs with every CPU stopped.
+  bool quantum_cb(uint64_t q) {
+    // The first step of a quantum has nothing to compare against.
+    for (unsigned i = 0; i < lastIcount.size(); ++i) lastIcount[i] = NO_ICOUNT;
+
+    nextBarrier += BARRIER_INTERVAL;
+    if (--outputCountdown == 0) {
+      outputCountdown = BARRIERS_PER_OUTPUT;
+      std::cout << "Tick " << cpu[0].getCycle() << '\n';
+    }
+    return running;
+  }
+
   volatile bool running;
+  Qcache::cycle_t nextBarrier;
+  unsigned outputCountdown;
+
+  static const uint64_t NO_ICOUNT = ~0ull;
+  std::vector<uint64_t> lastIcount;
   
   l1i_t &l1i;
   l1d_t &l1d;
+  l0_t l0i, l0d;
 
   Qsim::OSDomain::inst_cb_handle_t icb_handle;
-  Qsim::OSDomain::mem_cb_handle_t mcb_handle;
+  Qsim::OSDomain::mem_ex_flt_handle_t mcb_handle;
   Qsim::OSDomain &osd;
 
   std::vector<CPUTimer_t> cpu;
@@ -150,73 +207,6 @@ static inline unsigned long long utime() {
 }
 
 
-pthread_barrier_t b0, b1;
-Qsim::OSDomain *osd_p;
-CallbackAdaptor *cba_p;
-
-struct thread_arg_t {
-  int cpuStart;
-  int cpuEnd;
-  Qcache::cycle_t nextBarrier;
-  pthread_t thread;
-};
-
-// Number of cycles between barriers.
-const Qcache::cycle_t BARRIER_INTERVAL = 10000;
-const Qcache::cycle_t BARRIERS_PER_TICK = 100;
-const Qcache::cycle_t BARRIERS_PER_OUTPUT = 1;
-const Qcache::cycle_t LIMIT = 100000;
-
-void *thread_main(void *arg_vp) {
-  bool runningLocal(true);
-  unsigned outputCountdown(BARRIERS_PER_OUTPUT),
-           timerCountdown(BARRIERS_PER_TICK),
-           topCount(0);
-
-  thread_arg_t *arg((thread_arg_t*)arg_vp);
-
-  arg->nextBarrier = BARRIER_INTERVAL;
-
-  pthread_barrier_wait(&b0);
-  while(runningLocal && topCount < LIMIT) {
-    bool doBarrier(true);
-    for (unsigned i = 0; i < 1000; ++i) {
-      for (unsigned c = arg->cpuStart; c < arg->cpuEnd; ++c) {
-        if (cba_p->cpu[c].getCycle() >= arg->nextBarrier) continue;
-	bool runFail(osd_p->run(c, 200) == 0);
-        if (!runFail && cba_p->cpu[c].getCycle() < arg->nextBarrier)
-          doBarrier = false;
-
-        // Even if we run out of cycles, the CPU model must be ticked.
-        if (runFail)
-          while (cba_p->cpu[c].getCycle() < arg->nextBarrier)
-            cba_p->cpu[c].idleInst();
-      }
-      if (doBarrier) {
-          arg->nextBarrier += BARRIER_INTERVAL;
-          pthread_barrier_wait(&b1);
-          // Every thread reads "running" only in this critical section.
-          runningLocal = cba_p->running;
-          if (!runningLocal) break;
-          if (arg->cpuStart == 0 && --outputCountdown == 0) {
-            outputCountdown = BARRIERS_PER_OUTPUT;
-	    std::cout << "Tick " << cba_p->cpu[0].getCycle() << '\n';
-	  }
-          if (arg->cpuStart == 0 && --timerCountdown == 0) {
-            timerCountdown = BARRIERS_PER_TICK;
-            osd_p->timer_interrupt();
-          }
-          pthread_barrier_wait(&b0);
-      }
-    }
-
-    // if (arg->cpuStart == 0 && runningLocal) osd_p->timer_interrupt();
-    ++topCount;
-  }
-
-  return 0;
-}
-
 int main(int argc, char** argv) {
   int threads;
 
@@ -234,8 +224,6 @@ int main(int argc, char** argv) {
 
   threads = atol(argv[3]);
 
-  std::vector<thread_arg_t> targs(threads);
-
   std::ostream *traceOut;
   if (argc >= 5) {
     traceOut = new std::ofstream(argv[4]);
@@ -253,34 +241,21 @@ int main(int argc, char** argv) {
   l1i_t l1_i(osd.get_n(), l2, "L1i");
   l1d_t l1_d(osd.get_n(), l2, "L1d");
 
-  pthread_barrier_init(&b0, NULL, threads);
-  pthread_barrier_init(&b1, NULL, threads);
-
   //CallbackAdaptor *cba = new CallbackAdaptor(osd, l1_i, l1_d, &mc); // qdram
   CallbackAdaptor *cba = new CallbackAdaptor(osd, l1_i, l1_d); // FuncDram
 
-  osd_p = &osd;
-  cba_p = cba;
-
-  if (osd.get_n() % threads) {
-    std::cerr << "Error: number of host threads must divide evenly into"
-                 " number of guest threads.\n";
-    exit(1);
-  }
-
 #ifdef CPULOCK
   setCpuAff(threads);
 #endif
 
-  unsigned long long start_usec = utime();
-  for (unsigned i = 0; i < threads; ++i) {
-    targs[i].cpuStart = i * (osd.get_n() / threads);
-    targs[i].cpuEnd = (i + 1) * (osd.get_n() / threads);
-    pthread_create(&targs[i].thread, NULL, thread_main, (void*)&targs[i]);
-  }
+  Qsim::ParallelRunner runner(osd, threads);
+  runner.set_step(200);
+  runner.set_timer(BARRIERS_PER_TICK);
+  runner.set_step_cb(cba, &CallbackAdaptor::step_cb);
+  runner.set_quantum_cb(cba, &CallbackAdaptor::quantum_cb);
 
-  for (unsigned i = 0; i < threads; ++i)
-    pthread_join(targs[i].thread, NULL);
+  unsigned long long start_usec = utime();
+  runner.run(MAX_BARRIERS);
   unsigned long long end_usec = utime();
 
   std::cout << "Total time: " << std::dec << end_usec - start_usec << "us\n";
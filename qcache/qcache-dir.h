@@ -134,7 +134,7 @@ namespace Qcache {
       return banks[getBankIdx(addr)].getEntry(addr).present.end();
     }
 
-    std::set<int>::iterator clearIds(addr_t addr, int remaining) {
+    void clearIds(addr_t addr, int remaining) {
       ASSERT(addr%(1<<L2LINESZ) == 0);
       ASSERT(banks[getBankIdx(addr)].getEntry(addr).lockHolder == remaining);
 #ifdef DEBUG
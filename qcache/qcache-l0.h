@@ -0,0 +1,97 @@
+#ifndef __QCACHE_L0_H
+#define __QCACHE_L0_H
+
+#include <vector>
+#include <iostream>
+
+#include "qcache.h"
+
+namespace Qcache {
+  // Line-coalescing filter between a CPU model and its private L1. Runs of
+  // accesses to the line last touched are absorbed here instead of being
+  // simulated again in the L1: reads while the L1 still holds the line, and
+  // writes once the L1 has it modified. Everything else, including the first
+  // write to a line that is not yet modified, is forwarded.
+  //
+  // The L1's tag word for the line, returned through access()'s line pointer,
+  // tells us whether the line is still resident and in what state, so
+  // evictions and remote invalidations take effect on the next access. An
+  // absorbed access would have been a hit to the L1's MRU line with no state
+  // change, so only its replacement update and access count are skipped.
+  // Reads are counted here as they are in the caches, so the L1's accesses
+  // plus the L0's hits give the reads the CPU made.
+  template <int L2LINESZ, int HIT_LAT=0> class L0Filter : public MemSysDev {
+  public:
+    L0Filter(MemSysDev &l1, const char *n = "L0", int id = 0):
+      l1(&l1), line(NULL), tag(0), name(n), id(id), accesses(0), hits(0) {}
+
+    ~L0Filter() {
+      if (!printResults) return;
+      std::cout << name << ", " << id << ", " << accesses << ", " << hits
+                << ", " << (100.0*hits)/accesses << "%\n";
+    }
+
+    int access(addr_t addr, addr_t pc, int core, int wr,
+               unsigned *flagptr=NULL, addr_t **lp=NULL)
+    {
+      addr_t t(addr>>L2LINESZ);
+
+      if (!wr) ++accesses;
+
+      if (line && t == tag) {
+        addr_t l(*(volatile addr_t *)line), stateMask((1<<L2LINESZ)-1);
+        int state(l & stateMask);
+        if ((l>>L2LINESZ) == t && state && (!wr || state == STATE_M)) {
+          if (!wr) ++hits;
+          if (lp) *lp = line;
+          return HIT_LAT;
+        }
+      }
+
+      addr_t *p(NULL);
+      int lat(l1->access(addr, pc, core, wr, flagptr, &p));
+      line = p;
+      tag = t;
+      if (lp) *lp = p;
+
+      return lat;
+    }
+
+    int getLatency() { return l1->getLatency(); }
+
+    uint64_t getAccesses() const { return accesses; }
+    uint64_t getHits() const { return hits; }
+
+  private:
+    // Modified is 0x02 in all of the coherence protocols (see CPNull).
+    enum { STATE_M = 0x02 };
+
+    MemSysDev *l1;
+    addr_t *line;               // L1 tag word of the last line, if known
+    addr_t tag;
+    const char *name;
+    int id;
+
+    uint64_t accesses, hits;
+  };
+
+  // One L0Filter per cache in a group of private L1s.
+  template <int L2LINESZ, int HIT_LAT=0> class L0Grp : public MemSysDevSet {
+  public:
+    L0Grp(int n, MemSysDevSet &l1, const char *name = "L0") {
+      filters.reserve(n);
+      for (int i = 0; i < n; ++i)
+        filters.push_back(FILTER(l1.getMemSysDev(i), name, i));
+    }
+
+    L0Filter<L2LINESZ, HIT_LAT> &getFilter(size_t i) { return filters[i]; }
+
+    MemSysDev &getMemSysDev(size_t i) { return getFilter(i); }
+
+  private:
+    typedef L0Filter<L2LINESZ, HIT_LAT> FILTER;
+    std::vector<FILTER> filters;
+  };
+};
+
+#endif
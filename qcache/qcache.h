@@ -258,6 +258,9 @@ namespace Qcache {
 
     int getLatency() { return LATENCY + lowerLevel->getLatency(); }
 
+    uint64_t getAccesses() const { return accesses; }
+    uint64_t getMisses() const { return misses; }
+
     void l1LockAddr(addr_t addr) {
       if (!upperLevel) cprot->lockAddr(addr, id);
       else upperLevel->l1LockAddr(addr);
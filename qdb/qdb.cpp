@@ -226,7 +226,7 @@ void disas(uint64_t vaddr, uint64_t size) {
   unsigned int n_decoded;
 
   // Copy the instructions from QSIM ram.
-  for (uint64_t i = 0; i < size; i++) cd->mem_rd(buf[i], vaddr+i);
+  cd->mem_rd_block(vaddr, buf, size);
 
   // Disassemble them.
   distorm_decode(0, buf, size, Decode32Bits, insts, size, &n_decoded);
@@ -246,19 +246,19 @@ void disas(uint64_t vaddr, uint64_t size) {
 
 void mem_dump_row(uint64_t paddr, uint64_t size) {
   typedef unsigned long long ull;
+  uint8_t row[DUMP_COLS];
+  cd->mem_rd_block(paddr, row, size);
+
   printf("%08llx: ", (ull)paddr);
   for (unsigned i = 0; i < size; i++) {
-    uint8_t val;
-    cd->mem_rd(val, paddr+i);
-    printf("%02x ", (unsigned)val);
+    printf("%02x ", (unsigned)row[i]);
   }
 
   if (size < DUMP_COLS) 
     for (unsigned i = size; i < DUMP_COLS; i++) printf("   ");
 
   for (unsigned i = 0; i < size; i++) {
-    uint8_t val;
-    cd->mem_rd(val, paddr+i);
+    uint8_t val = row[i];
     if (isprint(val)) putc(val, stdout);
     else              putc('.',  stdout);
   }
@@ -278,10 +278,13 @@ void mem_dump(uint64_t paddr, uint64_t size) {
 // Print status of CPU i.
 void cpu_stat(unsigned i) {
   typedef unsigned long long ull;
-  ull rax = cd->get_reg(i, QSIM_X86_RAX), rcx = cd->get_reg(i, QSIM_X86_RCX),
-      rdx = cd->get_reg(i, QSIM_X86_RDX), rbx = cd->get_reg(i, QSIM_X86_RBX),
-      rsp = cd->get_reg(i, QSIM_X86_RSP), rbp = cd->get_reg(i, QSIM_X86_RBP),
-      rip = rip_vec[i],               cr3 = cd->get_reg(i, QSIM_X86_CR3);
+  static const int regs[] = { QSIM_X86_RAX, QSIM_X86_RCX, QSIM_X86_RDX,
+                              QSIM_X86_RBX, QSIM_X86_RSP, QSIM_X86_RBP,
+                              QSIM_X86_CR3 };
+  uint64_t v[7];
+  cd->get_regs(i, regs, 7, v);
+  ull rax = v[0], rcx = v[1], rdx = v[2], rbx = v[3], rsp = v[4], rbp = v[5],
+      rip = rip_vec[i], cr3 = v[6];
   int tid = cd->get_tid(i);
   const char* sym = get_nearest_symbol_below(rip, cr3).c_str();
 
@@ -13,6 +13,7 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <stddef.h>
 #include <stdbool.h>
 #include "qsim-vm.h"
 
@@ -33,6 +34,20 @@ void set_trans_cb (trans_cb_t );
 void set_gen_cbs  (bool state );
 void set_sys_cbs  (bool state );
 
+// Optional exports. QSim falls back to the byte-at-a-time mem_rd/mem_wr
+// interface when these are missing.
+void mem_rd_block     (uint64_t paddr, void *buf, size_t len);
+void mem_wr_block     (uint64_t paddr, const void *buf, size_t len);
+void mem_rd_virt_block(int c, uint64_t vaddr, void *buf, size_t len);
+void mem_wr_virt_block(int c, uint64_t vaddr, const void *buf, size_t len);
+
+// Fill r with up to max host mappings of guest RAM; returns the number of
+// regions. Optional.
+int  get_ram_regions  (struct qsim_ram_region *r, int max);
+
+// Read the n registers listed in r from CPU c into out. Optional.
+void get_regs(int c, const int *r, int n, uint64_t *out);
+
 #ifdef __cplusplus
 };
 #endif
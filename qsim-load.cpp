@@ -31,11 +31,15 @@ public:
       osd.set_app_start_cb(this, &QsimLoadHelper::app_start_cb)
     );
     
+    // Unless the caller has a timer of its own, interrupt every 10000
+    // instructions while loading.
+    bool own_timer(!osd.get_timer());
+    if (own_timer) osd.set_timer(10000, false);
+
     // The main loop: run until 'finished' is true.                            
-    while (!finished) {
-      osd.run(10000);
-      osd.timer_interrupt();
-    }
+    while (!finished) osd.run(10000);
+
+    if (own_timer) osd.set_timer(0);
 
     osd.run(finished_core, 1);
 
@@ -76,13 +80,13 @@ private:
       // actually deposited in %rcx.                                           
 
       uint64_t vaddr = osd.get_reg(c, addr_reg);
+      char buf[1024];
       int count = 1024;
       while (infile.good() && count) {
-        char ch;
-        infile.get(ch);
-        osd.mem_wr_virt(c, ch, vaddr++);
+        infile.get(buf[1024 - count]);
         count--;
       }
+      osd.mem_wr_virt_block(c, vaddr, buf, 1024-count);
       osd.set_reg(c, size_reg, 1024-count);
     } else if (rax == 0xc5b1fffe) {
       // Asking if input is ready
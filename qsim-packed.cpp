@@ -0,0 +1,81 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+#include <qsim-packed.h>
+
+using namespace Qsim;
+
+Qsim::PackedQueue::PackedQueue(OSDomain &cd, int cpu, bool keep_bytes):
+  cd(cd), cpu(cpu), enc(buf, keep_bytes), rd(0), count(0), head_len(0)
+{
+  icb_handle   = cd.set_inst_cb<PackedQueue, &PackedQueue::inst_cb>(cpu, this);
+  mcb_handle   = cd.set_mem_cb <PackedQueue, &PackedQueue::mem_cb >(cpu, this);
+  intcb_handle = cd.set_int_cb <PackedQueue, &PackedQueue::int_cb >(cpu, this);
+}
+
+Qsim::PackedQueue::~PackedQueue() {
+  cd.unset_inst_cb(cpu, icb_handle);
+  cd.unset_mem_cb (cpu, mcb_handle);
+  cd.unset_int_cb (cpu, intcb_handle);
+}
+
+const QueueItem &Qsim::PackedQueue::front() {
+  if (!head_len) {
+    PackedDecoder d(&buf[rd], &buf[0] + buf.size(), dec_state);
+    d.next(head);
+    head_len = d.pos() - &buf[rd];
+    head_state = d.state();
+  }
+
+  return head;
+}
+
+void Qsim::PackedQueue::pop() {
+  front();
+
+  rd += head_len;
+  dec_state = head_state;
+  head_len = 0;
+
+  if (--count == 0) {
+    // Drained: start over with fresh delta state on both sides.
+    buf.clear();
+    rd = 0;
+    enc.reset();
+    dec_state.reset();
+  } else if (rd > 4096 && rd > buf.size()/2) {
+    // Drop the consumed prefix. Decoder state is position-independent.
+    buf.erase(buf.begin(), buf.begin() + rd);
+    rd = 0;
+  }
+}
+
+Qsim::PackedQueue::const_iterator Qsim::PackedQueue::begin() const {
+  if (!count) return end();
+  return const_iterator(&buf[rd], &buf[0] + buf.size(), dec_state);
+}
+
+void Qsim::PackedQueue::inst_cb(int c, uint64_t va, uint64_t pa, uint8_t l,
+                                const uint8_t *b, enum inst_type t)
+{
+  enc.inst(c, va, pa, l, b, t);
+  ++count;
+}
+
+void Qsim::PackedQueue::mem_cb(int c, uint64_t va, uint64_t pa, uint8_t s,
+                               int t)
+{
+  enc.mem(c, va, pa, s, t);
+  ++count;
+}
+
+int Qsim::PackedQueue::int_cb(int c, uint8_t vec) {
+  enc.intr(c, vec);
+  ++count;
+  return 0;
+}
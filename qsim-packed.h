@@ -0,0 +1,302 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+#ifndef __QSIM_PACKED_H
+#define __QSIM_PACKED_H
+
+#include <vector>
+#include <iterator>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+namespace Qsim {
+  // Packed, variable-length encoding of QueueItems.
+  //
+  // Every record starts with a tag byte:
+  //   bits 0-1  record type (QueueItem::INST, MEM, INTR or REG)
+  //   bit  2    INST: instruction bytes follow
+  //   bit  3    CPU differs from the previous record; varint CPU id follows
+  //   bits 4-7  INST: inst_type; MEM: access type
+  //
+  // followed by:
+  //   INST  len, zigzag(vaddr - prev inst vaddr),
+  //         zigzag((paddr - vaddr) - prev inst offset), [bytes]
+  //   MEM   size, zigzag(vaddr - prev mem vaddr),
+  //         zigzag((paddr - vaddr) - prev mem offset)
+  //   INTR  vector
+  //   REG   varint reg, size, varint type
+  //
+  // Sequential instructions on one page encode in four bytes without
+  // instruction bytes, compared to sizeof(QueueItem) for the unpacked form.
+  // The encoder and decoder carry the same delta state, so a stream has to be
+  // decoded from the beginning (or from the last reset()).
+  struct PackedState {
+    PackedState() { reset(); }
+    void reset() {
+      cpu = 0; inst_va = inst_off = mem_va = mem_off = 0;
+    }
+
+    int      cpu;
+    uint64_t inst_va, inst_off, mem_va, mem_off;
+  };
+
+  class PackedEncoder {
+  public:
+    PackedEncoder(std::vector<uint8_t> &out, bool keep_bytes = false):
+      out(out), keep_bytes(keep_bytes) {}
+
+    void inst(int cpu, uint64_t va, uint64_t pa, uint8_t len,
+              const uint8_t *bytes, enum inst_type type)
+    {
+      uint8_t *p = reserve(48);
+      uint8_t *tag = p++;
+      *tag = QueueItem::INST | (keep_bytes ? 0x04 : 0) | (type << 4);
+      p = put_cpu(p, tag, cpu);
+      *p++ = len;
+      p = put_uvarint(p, zigzag(va - s.inst_va));
+      p = put_uvarint(p, zigzag((pa - va) - s.inst_off));
+      if (keep_bytes) { memcpy(p, bytes, len); p += len; }
+      s.inst_va = va; s.inst_off = pa - va;
+      commit(p);
+    }
+
+    void mem(int cpu, uint64_t va, uint64_t pa, uint8_t size, int type) {
+      uint8_t *p = reserve(32);
+      uint8_t *tag = p++;
+      *tag = QueueItem::MEM | ((type & 0x0f) << 4);
+      p = put_cpu(p, tag, cpu);
+      *p++ = size;
+      p = put_uvarint(p, zigzag(va - s.mem_va));
+      p = put_uvarint(p, zigzag((pa - va) - s.mem_off));
+      s.mem_va = va; s.mem_off = pa - va;
+      commit(p);
+    }
+
+    void intr(int cpu, uint8_t vec) {
+      uint8_t *p = reserve(16);
+      uint8_t *tag = p++;
+      *tag = QueueItem::INTR;
+      p = put_cpu(p, tag, cpu);
+      *p++ = vec;
+      commit(p);
+    }
+
+    void reg(int cpu, int r, uint8_t size, int type) {
+      uint8_t *p = reserve(32);
+      uint8_t *tag = p++;
+      *tag = QueueItem::REG;
+      p = put_cpu(p, tag, cpu);
+      p = put_uvarint(p, uint32_t(r));
+      *p++ = size;
+      p = put_uvarint(p, uint32_t(type));
+      commit(p);
+    }
+
+    void push(const QueueItem &i) {
+      switch (i.cb_type) {
+      case QueueItem::INST:
+        inst(i.id, i.data.inst.vaddr, i.data.inst.paddr, i.data.inst.len,
+             i.data.inst.bytes, i.data.inst.type);
+        break;
+      case QueueItem::MEM:
+        mem(i.id, i.data.mem.vaddr, i.data.mem.paddr, i.data.mem.size,
+            i.data.mem.type);
+        break;
+      case QueueItem::INTR: intr(i.id, i.data.intr.vec); break;
+      case QueueItem::REG:
+        reg(i.id, i.data.reg.reg, i.data.reg.size, i.data.reg.type);
+        break;
+      default: break;
+      }
+    }
+
+    // Forget the delta state; call when the output buffer is cleared.
+    void reset() { s.reset(); }
+
+    static uint64_t zigzag(uint64_t d) {
+      return (d << 1) ^ uint64_t(int64_t(d) >> 63);
+    }
+
+  private:
+    std::vector<uint8_t> &out;
+    bool keep_bytes;
+    PackedState s;
+    size_t pos;
+
+    uint8_t *reserve(size_t n) {
+      pos = out.size();
+      out.resize(pos + n);
+      return &out[pos];
+    }
+
+    void commit(uint8_t *end) { out.resize(end - &out[0]); }
+
+    uint8_t *put_cpu(uint8_t *p, uint8_t *tag, int cpu) {
+      if (cpu == s.cpu) return p;
+      *tag |= 0x08;
+      s.cpu = cpu;
+      return put_uvarint(p, uint32_t(cpu));
+    }
+
+    static uint8_t *put_uvarint(uint8_t *p, uint64_t v) {
+      while (v >= 0x80) { *p++ = uint8_t(v) | 0x80; v >>= 7; }
+      *p++ = uint8_t(v);
+      return p;
+    }
+  };
+
+  class PackedDecoder {
+  public:
+    PackedDecoder(const uint8_t *begin, const uint8_t *end,
+                  const PackedState &st = PackedState()):
+      p(begin), end(end), s(st) {}
+
+    bool done() const { return p >= end; }
+    const uint8_t *pos() const { return p; }
+    const PackedState &state() const { return s; }
+
+    // Decode the next record into item. Returns false at the end of input.
+    bool next(QueueItem &item) {
+      if (p >= end) return false;
+
+      uint8_t tag = *p++;
+      if (tag & 0x08) s.cpu = get_uvarint();
+      item.id = s.cpu;
+
+      switch (tag & 0x03) {
+      case QueueItem::INST: {
+        item.cb_type = QueueItem::INST;
+        item.data.inst.len = *p++;
+        item.data.inst.vaddr = s.inst_va += unzigzag(get_uvarint());
+        s.inst_off += unzigzag(get_uvarint());
+        item.data.inst.paddr = item.data.inst.vaddr + s.inst_off;
+        item.data.inst.type = inst_type(tag >> 4);
+        if (tag & 0x04) {
+          memcpy(item.data.inst.bytes, p, item.data.inst.len);
+          p += item.data.inst.len;
+        }
+        break;
+      }
+      case QueueItem::MEM:
+        item.cb_type = QueueItem::MEM;
+        item.data.mem.size = *p++;
+        item.data.mem.vaddr = s.mem_va += unzigzag(get_uvarint());
+        s.mem_off += unzigzag(get_uvarint());
+        item.data.mem.paddr = item.data.mem.vaddr + s.mem_off;
+        item.data.mem.type = tag >> 4;
+        break;
+      case QueueItem::INTR:
+        item.cb_type = QueueItem::INTR;
+        item.data.intr.vec = *p++;
+        break;
+      case QueueItem::REG:
+        item.cb_type = QueueItem::REG;
+        item.data.reg.reg = get_uvarint();
+        item.data.reg.size = *p++;
+        item.data.reg.type = get_uvarint();
+        break;
+      }
+
+      return true;
+    }
+
+    static uint64_t unzigzag(uint64_t v) { return (v >> 1) ^ -(v & 1); }
+
+  private:
+    const uint8_t *p, *end;
+    PackedState s;
+
+    uint64_t get_uvarint() {
+      uint64_t v = 0;
+      unsigned shift = 0;
+      while (p < end) {
+        uint8_t b = *p++;
+        v |= uint64_t(b & 0x7f) << shift;
+        if (!(b & 0x80)) break;
+        shift += 7;
+      }
+      return v;
+    }
+  };
+
+  // Input iterator over the decoded records of [begin, end).
+  class PackedIterator {
+  public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef QueueItem               value_type;
+    typedef ptrdiff_t               difference_type;
+    typedef const QueueItem*        pointer;
+    typedef const QueueItem&        reference;
+
+    PackedIterator(): d(NULL, NULL), valid(false) {}
+    PackedIterator(const uint8_t *b, const uint8_t *e,
+                   const PackedState &st = PackedState()): d(b, e, st)
+    {
+      valid = d.next(item);
+    }
+
+    const QueueItem &operator*()  const { return item; }
+    const QueueItem *operator->() const { return &item; }
+    PackedIterator &operator++() { valid = d.next(item); return *this; }
+
+    bool operator==(const PackedIterator &r) const {
+      return valid == r.valid && (!valid || d.pos() == r.d.pos());
+    }
+    bool operator!=(const PackedIterator &r) const { return !(*this == r); }
+
+  private:
+    PackedDecoder d;
+    QueueItem item;
+    bool valid;
+  };
+
+  // A Queue work-alike that stores the event stream of one CPU in packed form.
+  // front() decodes on demand; instruction bytes are only retained if
+  // keep_bytes is set.
+  class PackedQueue {
+  public:
+    PackedQueue(OSDomain &cd, int cpu, bool keep_bytes = false);
+    ~PackedQueue();
+
+    bool     empty() const { return count == 0; }
+    size_t   size()  const { return count; }
+    size_t   bytes() const { return buf.size() - rd; }
+
+    const QueueItem &front();
+    void pop();
+
+    typedef PackedIterator const_iterator;
+    const_iterator begin() const;
+    const_iterator end()   const { return const_iterator(); }
+
+  private:
+    OSDomain &cd;
+    int cpu;
+
+    std::vector<uint8_t> buf;
+    PackedEncoder enc;
+    PackedState dec_state, head_state;
+    size_t rd, count;
+    QueueItem head;
+    size_t head_len;
+
+    OSDomain::inst_cpu_handle_t icb_handle;
+    OSDomain::mem_cpu_handle_t  mcb_handle;
+    OSDomain::int_cpu_handle_t  intcb_handle;
+
+    // Registered for this queue's CPU only.
+    void inst_cb(int, uint64_t, uint64_t, uint8_t, const uint8_t*,
+                 enum inst_type);
+    void mem_cb (int, uint64_t, uint64_t, uint8_t, int);
+    int  int_cb (int, uint8_t);
+  };
+};
+
+#endif
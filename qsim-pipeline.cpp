@@ -0,0 +1,104 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+#include <qsim-pipeline.h>
+
+#include <sched.h>
+
+using namespace Qsim;
+
+// Spin this many times on a full or empty ring before yielding the host CPU.
+static const unsigned SPINS_BEFORE_YIELD = 1024;
+
+Qsim::Pipeline::Pipeline(OSDomain &osd, unsigned ring_size, int ev):
+  osd(osd), rings(osd.get_n()), stall_count(osd.get_n()), closed(false),
+  events(ev)
+{
+  for (unsigned i = 0; i < rings.size(); ++i)
+    rings[i] = new SpscRing<QueueItem>(ring_size);
+
+  // Register on each CPU separately, so a CPU's events only pass through its
+  // own callback lists.
+  icb_handles.resize(rings.size());
+  mcb_handles.resize(rings.size());
+  intcb_handles.resize(rings.size());
+  rcb_handles.resize(rings.size());
+  for (unsigned i = 0; i < rings.size(); ++i) {
+    if (events & INST)
+      icb_handles[i] = osd.set_inst_cb<Pipeline, &Pipeline::inst_cb>(i, this);
+    if (events & MEM)
+      mcb_handles[i] = osd.set_mem_cb<Pipeline, &Pipeline::mem_cb>(i, this);
+    if (events & INTR)
+      intcb_handles[i] = osd.set_int_cb<Pipeline, &Pipeline::int_cb>(i, this);
+    if (events & REG)
+      rcb_handles[i] = osd.set_reg_cb<Pipeline, &Pipeline::reg_cb>(i, this);
+  }
+}
+
+Qsim::Pipeline::~Pipeline() {
+  close();
+
+  for (unsigned i = 0; i < rings.size(); ++i) {
+    if (events & REG)  osd.unset_reg_cb(i, rcb_handles[i]);
+    if (events & INTR) osd.unset_int_cb(i, intcb_handles[i]);
+    if (events & MEM)  osd.unset_mem_cb(i, mcb_handles[i]);
+    if (events & INST) osd.unset_inst_cb(i, icb_handles[i]);
+  }
+
+  for (unsigned i = 0; i < rings.size(); ++i) delete rings[i];
+}
+
+bool Qsim::Pipeline::wait_pop(int cpu, QueueItem &item) {
+  unsigned spins = 0;
+  for (;;) {
+    if (rings[cpu]->pop(item)) return true;
+
+    // Check the ring once more after seeing the close flag; the producer may
+    // have pushed its last items just before closing.
+    if (is_closed()) return rings[cpu]->pop(item);
+
+    if (++spins < SPINS_BEFORE_YIELD) cpu_relax();
+    else { spins = 0; sched_yield(); }
+  }
+}
+
+void Qsim::Pipeline::put(int cpu, const QueueItem &item) {
+  if (rings[cpu]->push(item)) return;
+
+  // Back-pressure: the consumer for this CPU is behind. Holding the callback
+  // here stalls emulation of this CPU until there is room.
+  std::atomic<uint64_t> &n(stall_count[cpu].n);
+  n.store(n.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+  unsigned spins = 0;
+  while (!rings[cpu]->push(item)) {
+    if (is_closed()) return;
+    if (++spins < SPINS_BEFORE_YIELD) cpu_relax();
+    else { spins = 0; sched_yield(); }
+  }
+}
+
+void Qsim::Pipeline::inst_cb(int cpu, uint64_t va, uint64_t pa, uint8_t l,
+                             const uint8_t *b, enum inst_type t)
+{
+  put(cpu, QueueItem(cpu, va, pa, l, b, t));
+}
+
+void Qsim::Pipeline::mem_cb(int cpu, uint64_t va, uint64_t pa, uint8_t s,
+                            int t)
+{
+  put(cpu, QueueItem(cpu, va, pa, s, t));
+}
+
+int Qsim::Pipeline::int_cb(int cpu, uint8_t vec) {
+  put(cpu, QueueItem(cpu, vec));
+  return 0;
+}
+
+void Qsim::Pipeline::reg_cb(int cpu, int r, uint8_t s, int t) {
+  put(cpu, QueueItem(cpu, r, s, t));
+}
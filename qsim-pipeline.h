@@ -0,0 +1,168 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+#ifndef __QSIM_PIPELINE_H
+#define __QSIM_PIPELINE_H
+
+#include <vector>
+#include <atomic>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+namespace Qsim {
+  // Size of a host cache line. Producer and consumer state are kept on
+  // separate lines so the two threads do not false-share.
+  const unsigned CACHE_LINE_SIZE = 64;
+
+  static inline void cpu_relax() {
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause" ::: "memory");
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield" ::: "memory");
+#endif
+  }
+
+  // Bounded, lock-free, single-producer/single-consumer ring. The size is
+  // rounded up to a power of two. Each side keeps a private copy of the other
+  // side's index so the shared indices are only re-read when the ring looks
+  // full (producer) or empty (consumer).
+  template <typename T> class SpscRing {
+  public:
+    SpscRing(size_t size = 65536): head(0), tail(0), head_cache(0),
+                                  tail_cache(0)
+    {
+      size_t sz = 1;
+      while (sz < size) sz <<= 1;
+      buf.resize(sz);
+      mask = sz - 1;
+    }
+
+    // Producer side. Returns false if the ring is full.
+    bool push(const T &item) {
+      uint64_t h = head.load(std::memory_order_relaxed);
+      if (h - tail_cache > mask) {
+        tail_cache = tail.load(std::memory_order_acquire);
+        if (h - tail_cache > mask) return false;
+      }
+      buf[h & mask] = item;
+      head.store(h + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer side. Returns false if the ring is empty.
+    bool pop(T &item) {
+      uint64_t t = tail.load(std::memory_order_relaxed);
+      if (t == head_cache) {
+        head_cache = head.load(std::memory_order_acquire);
+        if (t == head_cache) return false;
+      }
+      item = buf[t & mask];
+      tail.store(t + 1, std::memory_order_release);
+      return true;
+    }
+
+    // Consumer side. Pop up to n items into out; returns the number popped.
+    size_t pop_bulk(T *out, size_t n) {
+      uint64_t t = tail.load(std::memory_order_relaxed);
+      if (head_cache - t < n) head_cache = head.load(std::memory_order_acquire);
+      size_t avail = head_cache - t;
+      if (avail > n) avail = n;
+      for (size_t i = 0; i < avail; ++i) out[i] = buf[(t + i) & mask];
+      tail.store(t + avail, std::memory_order_release);
+      return avail;
+    }
+
+    bool empty() const {
+      return head.load(std::memory_order_acquire) ==
+             tail.load(std::memory_order_acquire);
+    }
+
+    size_t capacity() const { return mask + 1; }
+
+  private:
+    std::vector<T> buf;
+    uint64_t mask;
+
+    // Padding keeps each index on its own cache line.
+    unsigned char pad0[CACHE_LINE_SIZE];
+    std::atomic<uint64_t> head;                     // Written by producer
+    unsigned char pad1[CACHE_LINE_SIZE - sizeof(uint64_t)];
+    std::atomic<uint64_t> tail;                     // Written by consumer
+    unsigned char pad2[CACHE_LINE_SIZE - sizeof(uint64_t)];
+    uint64_t head_cache;                            // Consumer's copy
+    unsigned char pad3[CACHE_LINE_SIZE - sizeof(uint64_t)];
+    uint64_t tail_cache;                            // Producer's copy
+    unsigned char pad4[CACHE_LINE_SIZE - sizeof(uint64_t)];
+  };
+
+  // Moves the event stream of an OSDomain onto other host threads. Every guest
+  // CPU gets its own SpscRing of QueueItems, filled by the thread running the
+  // emulation and drained by exactly one consumer thread for that CPU. When a
+  // ring is full the producing callback waits for the consumer, which stalls
+  // run() until the timing model catches up.
+  class Pipeline {
+  public:
+    enum { INST = 0x01, MEM = 0x02, INTR = 0x04, REG = 0x08 };
+
+    Pipeline(OSDomain &osd, unsigned ring_size = 65536,
+             int events = INST|MEM|INTR);
+    ~Pipeline();
+
+    // Consumer side; only one thread may consume a given CPU's ring. pop()
+    // returns false immediately if the ring is empty; wait_pop() blocks until
+    // an item arrives or the pipeline is closed and drained.
+    bool pop(int cpu, QueueItem &item) { return rings[cpu]->pop(item); }
+    bool wait_pop(int cpu, QueueItem &item);
+    unsigned pop_bulk(int cpu, QueueItem *out, unsigned n) {
+      return rings[cpu]->pop_bulk(out, n);
+    }
+
+    // Producer side. After close(), consumers drain what is left and then see
+    // end-of-stream; further events are discarded.
+    void close() { closed.store(true, std::memory_order_release); }
+    bool is_closed() const { return closed.load(std::memory_order_acquire); }
+
+    // Number of times the producer for CPU i found its ring full. May be read
+    // from any thread while the producer runs.
+    uint64_t stalls(int cpu) const {
+      return stall_count[cpu].n.load(std::memory_order_relaxed);
+    }
+
+  private:
+    // Written only by the thread running the CPU, so a relaxed load and store
+    // suffice. Each counter has its own cache line, like the ring indices.
+    struct stall_counter {
+      stall_counter(): n(0) {}
+      std::atomic<uint64_t> n;
+      unsigned char pad[CACHE_LINE_SIZE - sizeof(std::atomic<uint64_t>)];
+    };
+
+    OSDomain &osd;
+    std::vector<SpscRing<QueueItem>*> rings;
+    std::vector<stall_counter> stall_count;
+    std::atomic<bool> closed;
+
+    std::vector<OSDomain::inst_cpu_handle_t> icb_handles;
+    std::vector<OSDomain::mem_cpu_handle_t>  mcb_handles;
+    std::vector<OSDomain::int_cpu_handle_t>  intcb_handles;
+    std::vector<OSDomain::reg_cpu_handle_t>  rcb_handles;
+    int events;
+
+    void put(int cpu, const QueueItem &item);
+
+    void inst_cb(int, uint64_t, uint64_t, uint8_t, const uint8_t*,
+                 enum inst_type);
+    void mem_cb (int, uint64_t, uint64_t, uint8_t, int);
+    int  int_cb (int, uint8_t);
+    void reg_cb (int, int, uint8_t, int);
+  };
+};
+
+#endif
@@ -30,7 +30,8 @@ public:
   }
 
   ~QsimProf() {
-    //osd.unset_inst_cb(icbH);
+    // Returns once no CPU is still inside inst_cb().
+    osd.unset_inst_cb(icbH);
     tr.close();
   }
 
@@ -82,5 +83,6 @@ void Qsim::start_prof(OSDomain &osd, const char *tracefile,
 }
 
 void Qsim::end_prof(OSDomain &osd) {
-  if (prof) delete(prof);
+  delete prof;
+  prof = NULL;
 }
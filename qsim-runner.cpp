@@ -0,0 +1,208 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+#include <qsim-runner.h>
+
+#include <iostream>
+#include <thread>
+
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+using namespace Qsim;
+
+// Spin this many times before yielding (SPIN) or sleeping (FUTEX).
+static const unsigned SPINS_BEFORE_YIELD = 1024;
+static const unsigned SPINS_BEFORE_SLEEP = 128;
+
+static void futex_wait(std::atomic<unsigned> *a, unsigned v) {
+  syscall(SYS_futex, (unsigned*)a, FUTEX_WAIT_PRIVATE, v, NULL, NULL, 0);
+}
+
+static void futex_wake_all(std::atomic<unsigned> *a) {
+  syscall(SYS_futex, (unsigned*)a, FUTEX_WAKE_PRIVATE, 0x7fffffff, NULL,
+          NULL, 0);
+}
+
+void Qsim::Barrier::wait(void (*serial)(void*), void *arg) {
+  unsigned g = gen.load(std::memory_order_acquire);
+
+  if (count.fetch_add(1, std::memory_order_acq_rel) + 1 == n) {
+    // Last to arrive: everyone else is waiting, so the serial section runs
+    // alone.
+    count.store(0, std::memory_order_relaxed);
+    if (serial) serial(arg);
+    gen.store(g + 1, std::memory_order_release);
+    if (k == FUTEX) futex_wake_all(&gen);
+    return;
+  }
+
+  unsigned spins = 0;
+  while (gen.load(std::memory_order_acquire) == g) {
+    if (k == FUTEX) {
+      if (++spins < SPINS_BEFORE_SLEEP) cpu_relax();
+      else futex_wait(&gen, g);
+    } else {
+      if (++spins < SPINS_BEFORE_YIELD) cpu_relax();
+      else { spins = 0; sched_yield(); }
+    }
+  }
+}
+
+Qsim::ParallelRunner::ParallelRunner(OSDomain &osd, unsigned t):
+  osd(osd), threads(t), quantum(100000), step(100000), timer_quanta(1),
+  barrier_kind(Barrier::SPIN), step_cb(NULL, NULL), cpu_cb(NULL, NULL),
+  quantum_cb(NULL, NULL), cpus(osd.get_n()), queues(NULL), barrier(NULL),
+  quanta(0), max_quanta(0), stopping(false), stop_req(false), steals(0)
+{
+  // Everything below, from the barrier to dealing out the CPUs, assumes at
+  // least one thread, and hence at least one CPU.
+  if (cpus.empty()) {
+    std::cerr << "ParallelRunner needs a domain with at least one CPU.\n";
+    exit(1);
+  }
+
+  if (threads == 0 || threads > cpus.size()) threads = cpus.size();
+}
+
+Qsim::ParallelRunner::~ParallelRunner() {
+  step_cb.release();
+  cpu_cb.release();
+  quantum_cb.release();
+}
+
+bool Qsim::ParallelRunner::work_queue::take(unsigned &c, bool steal) {
+  while (lock.exchange(true, std::memory_order_acquire)) cpu_relax();
+
+  bool found(head != tail);
+  if (found) c = steal ? cpu[--tail] : cpu[head++];
+
+  lock.store(false, std::memory_order_release);
+
+  return found;
+}
+
+// Deal this quantum's CPUs out to the threads' queues, round-robin. Busy
+// CPUs are dealt first so that every thread starts on real work; CPUs in
+// the idle loop, and those that cannot run at all, come last, where they
+// are the first to be stolen by threads that finish early.
+void Qsim::ParallelRunner::fill_queues() {
+  std::vector<unsigned> order;
+  for (unsigned c = 0; c < cpus.size(); ++c)
+    if (osd.runnable(c) && !osd.idle(c)) order.push_back(c);
+  for (unsigned c = 0; c < cpus.size(); ++c)
+    if (osd.runnable(c) && osd.idle(c)) order.push_back(c);
+  for (unsigned c = 0; c < cpus.size(); ++c)
+    if (!osd.runnable(c)) order.push_back(c);
+
+  for (unsigned t = 0; t < threads; ++t) {
+    queues[t].cpu.clear();
+    queues[t].head = 0;
+  }
+  for (unsigned i = 0; i < order.size(); ++i)
+    queues[i % threads].cpu.push_back(order[i]);
+  for (unsigned t = 0; t < threads; ++t)
+    queues[t].tail = queues[t].cpu.size();
+}
+
+uint64_t Qsim::ParallelRunner::run(uint64_t max) {
+  uint64_t start = quanta;
+
+  max_quanta = max ? quanta + max : 0;
+  stopping = false;
+  stop_req.store(false, std::memory_order_relaxed);
+  barrier = new Barrier(threads, barrier_kind);
+  queues = new work_queue[threads];
+  fill_queues();
+
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; ++t)
+    workers.push_back(std::thread(&ParallelRunner::thread_main, this, t));
+  thread_main(0);
+  for (unsigned t = 0; t < workers.size(); ++t) workers[t].join();
+
+  delete barrier;
+  barrier = NULL;
+  delete[] queues;
+  queues = NULL;
+
+  return quanta - start;
+}
+
+// Run CPU c for one step. Returns true when it has finished the quantum.
+bool Qsim::ParallelRunner::cpu_step(int c) {
+  cpu_state &s(cpus[c]);
+
+  if (step_cb.thunk && step_cb(c)) return true;
+
+  unsigned n = step;
+  if (!step_cb.thunk && quantum - s.ran < n) n = quantum - s.ran;
+
+  uint64_t skipped = osd.get_skipped(c);
+  n = osd.run(c, n);
+  s.ran += n;
+  s.icount += n;
+
+  // A CPU that ran nothing ends its quantum here, but a paced model still
+  // has to see that happen. So does one that only skipped instructions
+  // while parked in idle skip mode: they generate no callbacks, so a model
+  // that paces CPUs from its callbacks would never see them progress.
+  if (n == 0 || (step_cb.thunk && osd.get_skipped(c) - skipped == n)) {
+    if (step_cb.thunk) step_cb(c);
+    return true;
+  }
+
+  return !step_cb.thunk && s.ran >= quantum;
+}
+
+// Run CPU c until it has finished the quantum.
+void Qsim::ParallelRunner::run_cpu(unsigned c) {
+  cpus[c].ran = 0;
+  while (!cpu_step(c));
+  if (cpu_cb.thunk) cpu_cb(c, quanta);
+}
+
+void Qsim::ParallelRunner::thread_main(unsigned t) {
+  while (!stopping) {
+    unsigned c;
+
+    while (queues[t].take(c, false)) run_cpu(c);
+
+    // Nothing is queued once a quantum starts, so a thread that finds every
+    // queue empty is done until the next one.
+    for (unsigned i = 1; i < threads; ++i) {
+      work_queue &victim(queues[(t + i) % threads]);
+      while (victim.take(c, true)) {
+        steals.fetch_add(1, std::memory_order_relaxed);
+        run_cpu(c);
+      }
+    }
+
+    // The barrier publishes stopping and the refilled queues to every
+    // thread.
+    barrier->wait(between_quanta, this);
+  }
+}
+
+void Qsim::ParallelRunner::between_quanta(void *arg) {
+  ParallelRunner *r = static_cast<ParallelRunner*>(arg);
+
+  ++r->quanta;
+
+  if (r->timer_quanta && r->quanta % r->timer_quanta == 0)
+    r->osd.timer_interrupt();
+
+  if (r->quantum_cb.thunk && !r->quantum_cb(r->quanta)) r->stopping = true;
+  if (r->max_quanta && r->quanta >= r->max_quanta) r->stopping = true;
+  if (r->stop_req.load(std::memory_order_acquire)) r->stopping = true;
+
+  if (!r->stopping) r->fill_queues();
+}
@@ -0,0 +1,180 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+#ifndef __QSIM_RUNNER_H
+#define __QSIM_RUNNER_H
+
+#include <vector>
+#include <atomic>
+
+#include <stdint.h>
+
+#include <qsim.h>
+#include <qsim-pipeline.h>
+
+namespace Qsim {
+  // Reusable barrier for a fixed number of threads. The last thread to
+  // arrive runs the serial function, if one is given, before any thread is
+  // released. SPIN waiters busy-wait (yielding now and then) and give the
+  // lowest latency when every thread has a host CPU to itself; FUTEX waiters
+  // spin briefly and then sleep in the kernel, which is kinder to
+  // oversubscribed hosts.
+  class Barrier {
+  public:
+    enum kind { SPIN, FUTEX };
+
+    Barrier(unsigned n, kind k = SPIN): n(n), k(k), count(0), gen(0) {}
+
+    void wait(void (*serial)(void*) = NULL, void *arg = NULL);
+
+  private:
+    unsigned n;
+    kind k;
+    std::atomic<unsigned> count;
+    unsigned char pad[CACHE_LINE_SIZE - sizeof(unsigned)];
+    std::atomic<unsigned> gen;      // Bumped each time the barrier opens
+  };
+
+  // Runs the CPUs of an OSDomain on a set of host threads in lockstep
+  // quanta. Within a quantum each thread takes CPUs from its own work queue
+  // and runs each, step instructions at a time, until it has finished the
+  // quantum; a thread whose queue is empty steals CPUs from the others. All
+  // threads then meet at a barrier, where the timer interrupt and the
+  // quantum callback run while no CPU is running.
+  //
+  //   Qsim::ParallelRunner r(osd, 4);
+  //   r.set_quantum(100000);
+  //   r.set_quantum_cb(&model, &Model::sync);
+  //   r.run();
+  class ParallelRunner {
+  public:
+    // Use one host thread per guest CPU if threads is 0. Any number of
+    // threads up to the number of CPUs may be used; the domain must have at
+    // least one CPU.
+    ParallelRunner(OSDomain &osd, unsigned threads = 0);
+    ~ParallelRunner();
+
+    // Instructions each CPU runs per quantum, and per call to run() within
+    // a quantum.
+    void set_quantum(uint64_t insts) { quantum = insts; }
+    void set_step(unsigned insts) { step = insts; }
+
+    void set_barrier(Barrier::kind k) { barrier_kind = k; }
+
+    // Call timer_interrupt() after every n quanta; 0 disables the timer.
+    void set_timer(unsigned n) { timer_quanta = n; }
+
+    // Decides when a CPU has finished its quantum, for models that pace
+    // CPUs by something other than instruction count (e.g. simulated
+    // cycles). Called with the CPU index before every step; returns true
+    // once the CPU is done. Without it a CPU is done after quantum
+    // instructions. Either way a CPU that cannot run (see
+    // OSDomain::runnable()) ends its quantum at its next step, and one that
+    // runs no instructions ends it after the step, as does a paced CPU that
+    // only skips instructions in idle skip mode; the step callback is then
+    // called once more, its result ignored, so that a model can catch up to
+    // the end of the quantum.
+    typedef Callback<bool, int> step_cb_fn;
+
+    // Per-CPU work as each CPU finishes a quantum, on the thread that ran
+    // it: (cpu, quantum).
+    typedef Callback<void, int, uint64_t> cpu_cb_fn;
+
+    // Serial work between quanta, with every CPU stopped: (quanta run so
+    // far). Returns false to stop the run.
+    typedef Callback<bool, uint64_t> quantum_cb_fn;
+
+    template <typename T>
+      void set_step_cb(T* p, typename step_cb_fn::method<T>::type f)
+    {
+      step_cb.release();
+      step_cb = step_cb_fn::bind(p, f);
+    }
+
+    template <typename T>
+      void set_cpu_cb(T* p, typename cpu_cb_fn::method<T>::type f)
+    {
+      cpu_cb.release();
+      cpu_cb = cpu_cb_fn::bind(p, f);
+    }
+
+    template <typename T>
+      void set_quantum_cb(T* p, typename quantum_cb_fn::method<T>::type f)
+    {
+      quantum_cb.release();
+      quantum_cb = quantum_cb_fn::bind(p, f);
+    }
+
+    // Run until the quantum callback or stop() ends the run, or until
+    // max_quanta quanta have run (0 for no limit). The calling thread
+    // serves as host thread 0. Returns the number of quanta run.
+    uint64_t run(uint64_t max_quanta = 0);
+
+    // Ask the run to end after the current quantum. May be called from any
+    // thread, including from OSDomain callbacks.
+    void stop() { stop_req.store(true, std::memory_order_release); }
+
+    unsigned get_threads() const { return threads; }
+    uint64_t get_icount(int cpu) const { return cpus[cpu].icount; }
+    uint64_t get_quanta() const { return quanta; }
+
+    // CPU quanta run by a thread other than the one they were queued on.
+    uint64_t get_steals() const { return steals; }
+
+  private:
+    OSDomain &osd;
+    unsigned threads;
+
+    uint64_t quantum;
+    unsigned step;
+    unsigned timer_quanta;
+    Barrier::kind barrier_kind;
+
+    step_cb_fn    step_cb;
+    cpu_cb_fn     cpu_cb;
+    quantum_cb_fn quantum_cb;
+
+    // Per-CPU state, padded so threads running neighbouring CPUs do not
+    // false-share.
+    struct cpu_state {
+      cpu_state(): icount(0), ran(0) {}
+      uint64_t icount;          // Instructions run in total
+      uint64_t ran;             // Instructions run this quantum
+      unsigned char pad[CACHE_LINE_SIZE - 2*sizeof(uint64_t)];
+    };
+    std::vector<cpu_state> cpus;
+
+    // The CPUs a thread has yet to run this quantum. The owner takes from
+    // the head and thieves from the tail. Items are whole CPU quanta, so a
+    // spinlock is cheap next to the work it guards.
+    struct work_queue {
+      work_queue(): lock(false), head(0), tail(0) {}
+      std::atomic<bool> lock;
+      std::vector<unsigned> cpu;
+      unsigned head, tail;
+      unsigned char pad[CACHE_LINE_SIZE];
+
+      bool take(unsigned &c, bool steal);
+    };
+    work_queue *queues;
+
+    Barrier *barrier;
+    uint64_t quanta, max_quanta;
+    bool stopping;
+    std::atomic<bool> stop_req;
+    std::atomic<uint64_t> steals;
+
+    void thread_main(unsigned t);
+    void fill_queues();
+    void run_cpu(unsigned c);
+    bool cpu_step(int c);
+    static void between_quanta(void *arg);
+  };
+};
+
+#endif
@@ -0,0 +1,643 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Synthetic stand-in for the QEMU library, built as libqemu-qsim-synth.so and
+// loaded by an OSDomain created with cpu_type "synth". It exports the same
+// functions as the QEMU builds and, instead of emulating a machine, produces
+// a random instruction stream with memory and register accesses at whatever
+// rate the callbacks allow. RAM and registers are real: stores write the
+// guest memory, register writes the register file, and both can be read,
+// written and saved like a QEMU guest's. The stream looks like x86-64 user
+// code to qsim, with system calls into the kernel if asked for.
+//
+// The stream is set with the "kernel" argument, a comma-separated list of
+// key=value settings; sizes take K, M and G suffixes:
+//
+//   mem=0.3        fraction of instructions that access memory
+//   wr=0.3         fraction of those accesses that are stores
+//   br=0.15        fraction of instructions that are branches
+//   taken=0.5      fraction of branches that jump elsewhere in the code
+//   fp=0.05        fraction of instructions that are floating point
+//   sys=0          fraction of instructions that are system calls; each
+//                  enters the kernel, where the next one returns to user mode
+//   regs=2         register accesses per instruction, alternately read and
+//                  written
+//   reg_set=16     registers the accesses are drawn from, the first ones in
+//                  enum regs; only the first 16 take the values written
+//   flags=0        1 to report condition flag accesses: branches read ZF and
+//                  CF, and other integer instructions write all the flags
+//   size=8         bytes per memory access (1, 2, 4 or 8)
+//   footprint=1M   data footprint of each CPU
+//   share=0.1      fraction of accesses made to the region shared by all CPUs
+//   shared_fp=64K  size of the shared region
+//   code_fp=64K    code footprint of each CPU
+//   boot=1000      instructions CPU 0 runs before the application start
+//                  marker; 0 for none
+//   roi=0          instructions between region of interest markers; each CPU
+//                  passes begin 1, begin 2, end 2 and end 1 in turn, so it
+//                  is in region 1 for three quarters of its instructions and
+//                  in region 2 for one. 0 for none
+//   idle=0         instructions each CPU runs before it reports entering its
+//                  idle loop, where it keeps running until its next
+//                  interrupt switches it back to its task. 0 for never
+//   regions=1      number of equal parts get_ram_regions() reports guest RAM
+//                  in, last to first, as a machine with several banks would
+//   seed=1         random seed
+//
+//   Qsim::OSDomain osd(4, "mem=0.4,footprint=8M,share=0.2", "synth");
+#include <string>
+#include <atomic>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "qsim-vm.h"
+#include "qsim-x86-regs.h"
+
+namespace {
+  const unsigned INST_LEN = 4;
+  const uint64_t PAGE_SIZE = 4096;
+
+  // Odd constant for drawing more bits out of one random number.
+  const uint64_t MIX = 0x9e3779b97f4a7c15ull;
+
+  // Fractions are kept as thresholds on 32-bit random numbers.
+  uint32_t frac(double f) {
+    if (f <= 0) return 0;
+    if (f >= 1) return 0xffffffff;
+    return uint32_t(f * 4294967296.0);
+  }
+
+  // Random integer in [0, n) from 32 random bits.
+  inline uint64_t below(uint32_t r, uint64_t n) {
+    return (uint64_t(r) * n) >> 32;
+  }
+
+  struct config {
+    config(): mem(frac(0.3)), wr(frac(0.3)), br(frac(0.15)), taken(frac(0.5)),
+              fp(frac(0.05)), share(frac(0.1)), sys(0), regs(2),
+              reg_set(16), flags(0), size(8), regions(1), footprint(1 << 20), shared_fp(64 << 10),
+              code_fp(64 << 10),
+              boot(1000), roi(0), idle(0), seed(1) {}
+
+    uint32_t mem, wr, br, taken, fp, share, sys;
+    unsigned regs, reg_set, flags, size, regions;
+    uint64_t footprint, shared_fp, code_fp, boot, roi, idle, seed;
+
+    bool parse(const std::string &spec);
+  };
+
+  uint64_t parse_size(const char *s) {
+    char *end;
+    uint64_t v = strtoull(s, &end, 0);
+    switch (*end) {
+    case 'k': case 'K': v <<= 10; break;
+    case 'm': case 'M': v <<= 20; break;
+    case 'g': case 'G': v <<= 30; break;
+    }
+    return v;
+  }
+
+  bool config::parse(const std::string &spec) {
+    size_t pos = 0;
+    while (pos < spec.size()) {
+      size_t end = spec.find(',', pos);
+      if (end == std::string::npos) end = spec.size();
+      std::string item(spec, pos, end - pos);
+      pos = end + 1;
+
+      if (item.empty() || item == "-") continue;
+
+      size_t eq = item.find('=');
+      if (eq == std::string::npos) {
+        fprintf(stderr, "synth: expected key=value, got \"%s\"\n",
+                item.c_str());
+        return false;
+      }
+      std::string k(item, 0, eq);
+      const char *v = item.c_str() + eq + 1;
+
+      if      (k == "mem")       mem = frac(atof(v));
+      else if (k == "wr")        wr = frac(atof(v));
+      else if (k == "br")        br = frac(atof(v));
+      else if (k == "taken")     taken = frac(atof(v));
+      else if (k == "fp")        fp = frac(atof(v));
+      else if (k == "sys")       sys = frac(atof(v));
+      else if (k == "share")     share = frac(atof(v));
+      else if (k == "regs")      regs = atoi(v);
+      else if (k == "reg_set")   reg_set = atoi(v);
+      else if (k == "flags")     flags = atoi(v);
+      else if (k == "size")      size = atoi(v);
+      else if (k == "footprint") footprint = parse_size(v);
+      else if (k == "shared_fp") shared_fp = parse_size(v);
+      else if (k == "code_fp")   code_fp = parse_size(v);
+      else if (k == "boot")      boot = parse_size(v);
+      else if (k == "roi")       roi = parse_size(v);
+      else if (k == "idle")      idle = parse_size(v);
+      else if (k == "regions")   regions = atoi(v);
+      else if (k == "seed")      seed = parse_size(v);
+      else {
+        fprintf(stderr, "synth: unknown setting \"%s\"\n", k.c_str());
+        return false;
+      }
+    }
+
+    if (size != 1 && size != 2 && size != 4 && size != 8) {
+      fprintf(stderr, "synth: access size must be 1, 2, 4 or 8\n");
+      return false;
+    }
+    if (reg_set < 1 || reg_set > QSIM_X86_N_REGS) {
+      fprintf(stderr, "synth: reg_set must be between 1 and %d\n",
+              QSIM_X86_N_REGS);
+      return false;
+    }
+    if (regions < 1) {
+      fprintf(stderr, "synth: need at least one RAM region\n");
+      return false;
+    }
+    if (br > 0xffffffff - fp) {
+      fprintf(stderr, "synth: br and fp add up to more than 1\n");
+      return false;
+    }
+
+    // Whole accesses and instructions only.
+    footprint -= footprint % size;
+    shared_fp -= shared_fp % size;
+    code_fp -= code_fp % INST_LEN;
+    if (footprint < size || shared_fp < size || code_fp < INST_LEN) {
+      fprintf(stderr, "synth: footprint too small\n");
+      return false;
+    }
+
+    return true;
+  }
+
+  struct cpu_state {
+    cpu_state(): icount(0), pc(0), rng(0), started(false), gen(true),
+                 busy(0), idle(false), pending_any(false)
+    {
+      memset(regs, 0, sizeof regs);
+      for (unsigned i = 0; i < 4; i++) pending[i] = 0;
+    }
+
+    uint64_t icount;
+    uint64_t pc;
+    uint64_t rng;
+    bool started;              // Has announced itself to qsim
+    bool gen;                  // Per-CPU callback generation
+    uint64_t busy;             // Instructions run since the last interrupt
+    bool idle;                 // In the idle loop
+    uint64_t regs[QSIM_X86_N_REGS];
+
+    // Interrupt vectors posted from any thread, delivered before the next
+    // instruction.
+    std::atomic<bool> pending_any;
+    std::atomic<uint64_t> pending[4];
+
+    unsigned char pad[64];
+  };
+
+  config cfg;
+  unsigned n_cpus = 1;
+  uint64_t ram_size;
+  uint8_t *ram;
+  uint64_t shared_base, private_base;
+  cpu_state *cpus;
+  bool app_started;
+
+  atomic_cb_t atomic_cb;
+  inst_cb_t   inst_cb;
+  int_cb_t    int_cb;
+  mem_cb_t    mem_cb;
+  magic_cb_t  magic_cb;
+  io_cb_t     io_cb;
+  reg_cb_t    reg_cb;
+  trans_cb_t  trans_cb;
+  bool gen_cbs = true;
+
+  inline uint64_t next_rand(cpu_state &s) {
+    // xorshift64*
+    s.rng ^= s.rng >> 12;
+    s.rng ^= s.rng << 25;
+    s.rng ^= s.rng >> 27;
+    return s.rng * 0x2545f4914f6cdd1dull;
+  }
+
+  void deliver_ints(int c, cpu_state &s) {
+    s.pending_any.store(false, std::memory_order_relaxed);
+    for (unsigned w = 0; w < 4; w++) {
+      uint64_t m = s.pending[w].exchange(0, std::memory_order_acquire);
+      for (unsigned b = 0; m; b++, m >>= 1)
+        if ((m & 1) && int_cb) int_cb(c, w*64 + b);
+    }
+
+    // Any interrupt ends the idle loop.
+    if (s.idle) {
+      s.idle = false;
+      s.busy = 0;
+      if (magic_cb) magic_cb(c, 0xc75c0000 | (c + 1));
+    }
+  }
+
+  // Identify CPU c to qsim as an OS would: CPU 0 brings up the others, and
+  // each CPU reports the task it runs. Returns nonzero if a callback asked
+  // to stop.
+  int start_cpu(int c, cpu_state &s) {
+    int rval = 0;
+
+    s.started = true;
+    if (!magic_cb) return 0;
+
+    if (c == 0)
+      for (unsigned i = 1; i < n_cpus; i++)
+        if (magic_cb(0, 0xb0070000 | i)) rval = 1;
+    if (magic_cb(c, 0xc75c0000 | (c + 1))) rval = 1;
+
+    return rval;
+  }
+
+  // Run one instruction. Returns nonzero if a callback asked to stop.
+  inline int step(int c, cpu_state &s) {
+    int rval = 0;
+
+    if (s.pending_any.load(std::memory_order_relaxed)) deliver_ints(c, s);
+
+    uint64_t r = next_rand(s);
+    uint32_t r0 = r, r1 = r >> 32;
+    bool gen = gen_cbs && s.gen;
+
+    // System calls are drawn separately, so that without them the stream is
+    // unchanged. They are padded with prefixes to the usual length.
+    static const uint8_t syscall[INST_LEN] = { 0x66, 0x66, 0x0f, 0x05 },
+                         sysret[INST_LEN]  = { 0x66, 0x48, 0x0f, 0x07 };
+    bool sys = cfg.sys && uint32_t(next_rand(s)) < cfg.sys,
+         kern = !(s.regs[QSIM_X86_CS] & 3);
+
+    enum inst_type t = sys ? QSIM_INST_TRAP :
+                       r0 < cfg.br ? QSIM_INST_BR :
+                       r0 - cfg.br < cfg.fp ? QSIM_INST_FPBASIC :
+                       QSIM_INST_INTBASIC;
+    uint64_t pc = s.pc;
+    const uint8_t *bytes = !sys ? ram + pc : kern ? sysret : syscall;
+    if (gen && inst_cb) inst_cb(c, pc, pc, INST_LEN, bytes, t);
+
+    for (unsigned i = 0; i < cfg.regs; i++) {
+      int reg = ((r >> (4*(i % 16))) & 0xff) % cfg.reg_set, w = i & 1;
+      if (w && reg < 16) s.regs[reg] = s.icount;
+      if (gen && reg_cb) reg_cb(c, reg, 8, w);
+    }
+
+    if (cfg.flags && gen && reg_cb) {
+      if (t == QSIM_INST_BR)
+        reg_cb(c, QSIM_FLAG_ZF|QSIM_FLAG_CF, 0, 0);
+      else if (t == QSIM_INST_INTBASIC)
+        reg_cb(c, QSIM_FLAG_ALL, 0, 1);
+    }
+
+    if (r1 < cfg.mem) {
+      uint64_t r2 = next_rand(s);
+      uint32_t a0 = r2, a1 = r2 >> 32, ai = (r2 * MIX) >> 32;
+      bool w = a0 < cfg.wr;
+      uint64_t a;
+      if (a1 < cfg.share) {
+        a = shared_base + below(ai, cfg.shared_fp / cfg.size)*cfg.size;
+      } else {
+        a = private_base + c * cfg.footprint +
+            below(ai, cfg.footprint / cfg.size)*cfg.size;
+      }
+      if (w) {
+        // Other CPUs may be reading the shared region.
+        uint64_t v = s.icount;
+        switch (cfg.size) {
+        case 1: __atomic_store_n(ram + a, uint8_t(v), __ATOMIC_RELAXED); break;
+        case 2: __atomic_store_n((uint16_t*)(ram + a), uint16_t(v),
+                                 __ATOMIC_RELAXED); break;
+        case 4: __atomic_store_n((uint32_t*)(ram + a), uint32_t(v),
+                                 __ATOMIC_RELAXED); break;
+        case 8: __atomic_store_n((uint64_t*)(ram + a), v, __ATOMIC_RELAXED);
+                break;
+        }
+      }
+      if (gen && mem_cb) mem_cb(c, a, a, cfg.size, w);
+    }
+
+    uint64_t code = c * cfg.code_fp;
+    if (t == QSIM_INST_BR && r0 < below(cfg.taken, cfg.br)) {
+      s.pc = code + below((r * MIX) >> 32, cfg.code_fp / INST_LEN)*INST_LEN;
+    } else {
+      s.pc += INST_LEN;
+      if (s.pc == code + cfg.code_fp) s.pc = code;
+    }
+    s.regs[QSIM_X86_RIP] = s.pc;
+    if (sys) {
+      s.regs[QSIM_X86_CS] = kern ? 0x33 : 0x10;
+      s.regs[QSIM_X86_SS] = kern ? 0x2b : 0x18;
+    }
+
+    ++s.icount;
+    if (c == 0 && !app_started && cfg.boot && s.icount == cfg.boot) {
+      app_started = true;
+      if (magic_cb && magic_cb(0, 0xaaaaaaaa)) rval = 1;
+    }
+    if (cfg.roi && s.icount % cfg.roi == 0 && magic_cb) {
+      static const uint32_t marks[] = {
+        0xb10c0001, 0xb10c0002, 0xe10c0002, 0xe10c0001
+      };
+      if (magic_cb(c, marks[(s.icount / cfg.roi - 1) % 4])) rval = 1;
+    }
+    if (cfg.idle && !s.idle && ++s.busy == cfg.idle) {
+      s.idle = true;
+      if (magic_cb && magic_cb(c, 0x1d1e1d1e)) rval = 1;
+    }
+
+    return rval;
+  }
+
+  bool write_all(FILE *f, const void *p, size_t n) {
+    return fwrite(p, 1, n, f) == n;
+  }
+
+  bool read_all(int fd, void *p, size_t n) {
+    uint8_t *b = (uint8_t*)p;
+    while (n) {
+      ssize_t r = read(fd, b, n);
+      if (r <= 0) return false;
+      b += r; n -= r;
+    }
+    return true;
+  }
+
+  const char STATE_MAGIC[8] = {'Q', 'S', 'I', 'M', 'S', 'Y', 'N', '1'};
+  const uint64_t END_OF_PAGES = ~0ull;
+
+  // State file: magic, CPU count, RAM size, app_started, each CPU's
+  // (icount, pc, rng, started, regs), then each non-zero RAM page as (page
+  // index, contents), ended by END_OF_PAGES.
+  bool load_state(int fd) {
+    char magic[8];
+    uint32_t n;
+    uint64_t size;
+    uint8_t started;
+    if (!read_all(fd, magic, 8) || memcmp(magic, STATE_MAGIC, 8) ||
+        !read_all(fd, &n, sizeof n) || n != n_cpus ||
+        !read_all(fd, &size, sizeof size) || size != ram_size ||
+        !read_all(fd, &started, 1))
+      return false;
+    app_started = started;
+
+    for (unsigned i = 0; i < n_cpus; i++) {
+      cpu_state &s(cpus[i]);
+      uint8_t st;
+      if (!read_all(fd, &s.icount, sizeof s.icount) ||
+          !read_all(fd, &s.pc, sizeof s.pc) ||
+          !read_all(fd, &s.rng, sizeof s.rng) ||
+          !read_all(fd, &st, 1) ||
+          !read_all(fd, s.regs, sizeof s.regs))
+        return false;
+      s.started = st;
+    }
+
+    memset(ram, 0, ram_size);
+    for (;;) {
+      uint64_t page;
+      if (!read_all(fd, &page, sizeof page)) return false;
+      if (page == END_OF_PAGES) break;
+      if (page >= ram_size / PAGE_SIZE ||
+          !read_all(fd, ram + page*PAGE_SIZE, PAGE_SIZE))
+        return false;
+    }
+
+    return true;
+  }
+
+  // Give the guest RAM back when the library is unloaded, so that a process
+  // can create and destroy many domains.
+  __attribute__((destructor)) void unload() {
+    if (ram) munmap(ram, ram_size);
+    delete[] cpus;
+  }
+
+  bool page_is_zero(const uint8_t *p) {
+    const uint64_t *w = (const uint64_t*)p;
+    for (unsigned i = 0; i < PAGE_SIZE/sizeof(uint64_t); i++)
+      if (w[i]) return false;
+    return true;
+  }
+};
+
+extern "C" {
+  void qemu_init(const char **argv) {
+    std::string spec;
+    unsigned ram_mb = 1024;
+    int incoming = -1;
+
+    for (unsigned i = 0; argv && argv[i]; i++) {
+      if (!argv[i + 1]) break;
+      if (!strcmp(argv[i], "-m")) ram_mb = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-smp")) n_cpus = atoi(argv[++i]);
+      else if (!strcmp(argv[i], "-synth")) spec = argv[++i];
+      else if (!strcmp(argv[i], "-incoming") && !strncmp(argv[i+1], "fd:", 3))
+        incoming = atoi(argv[++i] + 3);
+    }
+    if (n_cpus == 0) n_cpus = 1;
+
+    if (!cfg.parse(spec)) exit(1);
+
+    ram_size = uint64_t(ram_mb) << 20;
+    shared_base = n_cpus * cfg.code_fp;
+    private_base = shared_base + cfg.shared_fp;
+    if (private_base + n_cpus * cfg.footprint > ram_size) {
+      fprintf(stderr, "synth: footprints do not fit in %u MB of RAM\n",
+              ram_mb);
+      exit(1);
+    }
+
+    ram = (uint8_t*)mmap(NULL, ram_size, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ram == MAP_FAILED) {
+      perror("synth: mmap");
+      exit(1);
+    }
+
+    // Every instruction is nopl 0(%rax); the types come from the mix.
+    static const uint8_t nopl[INST_LEN] = { 0x0f, 0x1f, 0x40, 0x00 };
+    for (uint64_t a = 0; a < shared_base; a += INST_LEN)
+      memcpy(ram + a, nopl, INST_LEN);
+
+    cpus = new cpu_state[n_cpus];
+    for (unsigned i = 0; i < n_cpus; i++) {
+      cpu_state &s(cpus[i]);
+      s.pc = i * cfg.code_fp;
+      s.rng = (cfg.seed + 1) * MIX + i * 0xbf58476d1ce4e5b9ull;
+      if (!s.rng) s.rng = 1;
+      s.regs[QSIM_X86_CS] = 0x33;
+      s.regs[QSIM_X86_SS] = 0x2b;
+      s.regs[QSIM_X86_CR0] = 0x80050033;
+      s.regs[QSIM_X86_RIP] = s.pc;
+      s.regs[QSIM_X86_RSP] = private_base + (i + 1) * cfg.footprint;
+    }
+
+    if (incoming >= 0 && !load_state(incoming)) {
+      fprintf(stderr, "synth: could not load saved state\n");
+      exit(1);
+    }
+  }
+
+  uint64_t run_cpu(int c, uint64_t n) {
+    cpu_state &s(cpus[c]);
+
+    if (!s.started && start_cpu(c, s)) return 0;
+
+    for (uint64_t i = 0; i < n; i++)
+      if (step(c, s)) return i + 1;
+
+    return n;
+  }
+
+  // Run the whole machine: the started CPUs take turns.
+  uint64_t run(uint64_t n) {
+    const uint64_t TURN = 1000;
+    uint64_t total = 0;
+
+    while (total < n) {
+      for (unsigned c = 0; c < n_cpus && total < n; c++) {
+        if (c && !cpus[0].started) continue;
+        uint64_t want = n - total < TURN ? n - total : TURN,
+                 ran = run_cpu(c, want);
+        total += ran;
+        if (ran < want) return total;
+      }
+    }
+
+    return total;
+  }
+
+  int interrupt_cpu(int c, uint8_t vec) {
+    cpu_state &s(cpus[c]);
+    s.pending[vec / 64].fetch_or(1ull << (vec % 64),
+                                 std::memory_order_release);
+    s.pending_any.store(true, std::memory_order_release);
+    return 0;
+  }
+
+  int interrupt(uint8_t vec) { return interrupt_cpu(0, vec); }
+
+  void set_atomic_cb(atomic_cb_t cb) { atomic_cb = cb; }
+  void set_inst_cb  (inst_cb_t   cb) { inst_cb   = cb; }
+  void set_int_cb   (int_cb_t    cb) { int_cb    = cb; }
+  void set_mem_cb   (mem_cb_t    cb) { mem_cb    = cb; }
+  void set_magic_cb (magic_cb_t  cb) { magic_cb  = cb; }
+  void set_io_cb    (io_cb_t     cb) { io_cb     = cb; }
+  void set_reg_cb   (reg_cb_t    cb) { reg_cb    = cb; }
+  void set_trans_cb (trans_cb_t  cb) { trans_cb  = cb; }
+
+  void set_gen_cbs(bool state) { gen_cbs = state; }
+  void set_gen_cbs_cpu(int c, bool state) { cpus[c].gen = state; }
+
+  // Kernel code from the sys setting is reported like user code.
+  void set_sys_cbs(bool state) {}
+
+  uint64_t get_reg(int c, int r) {
+    return r >= 0 && r < QSIM_X86_N_REGS ? cpus[c].regs[r] : 0;
+  }
+
+  void get_regs(int c, const int *r, int n, uint64_t *out) {
+    for (int i = 0; i < n; i++) out[i] = get_reg(c, r[i]);
+  }
+
+  void set_reg(int c, int r, uint64_t val) {
+    if (r < 0 || r >= QSIM_X86_N_REGS) return;
+    cpus[c].regs[r] = val;
+    if (r == QSIM_X86_RIP) cpus[c].pc = val - val % INST_LEN;
+  }
+
+  // Guest addresses are physical addresses; both wrap at the end of RAM.
+  uint8_t mem_rd(uint64_t paddr) { return ram[paddr % ram_size]; }
+  void mem_wr(uint64_t paddr, uint8_t data) { ram[paddr % ram_size] = data; }
+
+  uint8_t mem_rd_virt(int c, uint64_t vaddr) { return mem_rd(vaddr); }
+  void mem_wr_virt(int c, uint64_t vaddr, uint8_t data) {
+    mem_wr(vaddr, data);
+  }
+
+  void mem_rd_block(uint64_t paddr, void *buf, size_t len) {
+    uint8_t *b = (uint8_t*)buf;
+    for (size_t i = 0; i < len; i++) b[i] = mem_rd(paddr + i);
+  }
+
+  void mem_wr_block(uint64_t paddr, const void *buf, size_t len) {
+    const uint8_t *b = (const uint8_t*)buf;
+    for (size_t i = 0; i < len; i++) mem_wr(paddr + i, b[i]);
+  }
+
+  void mem_rd_virt_block(int c, uint64_t vaddr, void *buf, size_t len) {
+    mem_rd_block(vaddr, buf, len);
+  }
+
+  void mem_wr_virt_block(int c, uint64_t vaddr, const void *buf, size_t len) {
+    mem_wr_block(vaddr, buf, len);
+  }
+
+  int get_ram_regions(qsim_ram_region *r, int max) {
+    int n = (int)cfg.regions < max ? cfg.regions : max;
+    if (n < 1) return 0;
+
+    // Equal parts, the last taking what does not divide evenly.
+    uint64_t part = ram_size / n;
+    for (int i = 0; i < n; i++) {
+      uint64_t start = i * part;
+      r[n - 1 - i].paddr = start;
+      r[n - 1 - i].size = i == n - 1 ? ram_size - start : part;
+      r[n - 1 - i].host = ram + start;
+    }
+    return n;
+  }
+
+  int qsim_savevm_state(const char *filename) {
+    FILE *f = fopen(filename, "wb");
+    if (!f) return -1;
+
+    uint32_t n = n_cpus;
+    uint8_t started = app_started;
+    bool ok = write_all(f, STATE_MAGIC, 8) && write_all(f, &n, sizeof n) &&
+              write_all(f, &ram_size, sizeof ram_size) &&
+              write_all(f, &started, 1);
+
+    for (unsigned i = 0; ok && i < n_cpus; i++) {
+      const cpu_state &s(cpus[i]);
+      uint8_t st = s.started;
+      ok = write_all(f, &s.icount, sizeof s.icount) &&
+           write_all(f, &s.pc, sizeof s.pc) &&
+           write_all(f, &s.rng, sizeof s.rng) &&
+           write_all(f, &st, 1) &&
+           write_all(f, s.regs, sizeof s.regs);
+    }
+
+    for (uint64_t p = 0; ok && p < ram_size / PAGE_SIZE; p++) {
+      if (page_is_zero(ram + p*PAGE_SIZE)) continue;
+      ok = write_all(f, &p, sizeof p) &&
+           write_all(f, ram + p*PAGE_SIZE, PAGE_SIZE);
+    }
+    ok = ok && write_all(f, &END_OF_PAGES, sizeof END_OF_PAGES);
+
+    if (fclose(f)) ok = false;
+    return ok ? 0 : -1;
+  }
+
+  int qsim_loadvm_state(const char *filename) {
+    FILE *f = fopen(filename, "rb");
+    if (!f) return -1;
+    bool ok = load_state(fileno(f));
+    fclose(f);
+    return ok ? 0 : -1;
+  }
+};
@@ -42,6 +42,10 @@ typedef void (*inst_cb_t)(int cpu_id, uint64_t vaddr, uint64_t paddr,
                           enum inst_type type);
 typedef void (*mem_cb_t)(int cpu_id, uint64_t vaddr, uint64_t paddr,
                         uint8_t  size, int type);
+/* For an IN (type 0), a non-NULL return points at the value the guest
+   reads instead of the device's; it only has to stay valid until the callback
+   returns. NULL leaves the device's value. Backends must honour this, since
+   replay (OSDomain::start_replay()) returns the recorded values this way. */
 typedef uint32_t* (*io_cb_t) (int cpu_id, uint64_t addr, uint8_t size,
                               int type, uint32_t val);
 
@@ -51,6 +55,13 @@ typedef int (*atomic_cb_t)(int cpu_id);
 typedef void (*reg_cb_t)(int cpu_id, int reg, uint8_t  val, int type);
 typedef void (*trans_cb_t)(int cpu_id);
 
+/* A contiguous block of guest physical RAM and its host mapping. */
+struct qsim_ram_region {
+  uint64_t       paddr;
+  uint64_t       size;
+  const uint8_t *host;
+};
+
 #ifdef __cplusplus
 };
 #endif
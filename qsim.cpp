@@ -12,12 +12,20 @@
 #include <fstream>
 #include <vector>
 #include <queue>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <map>
+#include <algorithm>
 
+#include <cxxabi.h>
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <unistd.h>
+#include <string.h>
+#include <dlfcn.h>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -69,6 +77,8 @@ string get_qemu_lib(string cpu_type = "x86") {
   string suffix;
   if (cpu_type == "a64")
     suffix = "/lib/libqemu-qsim-a64.so";
+  else if (cpu_type == "synth")
+    suffix = "/lib/libqemu-qsim-synth.so";
   else
     suffix = "/lib/libqemu-qsim-x86.so";
   const char *qsim_prefix = getenv("QSIM_PREFIX");
@@ -172,6 +182,27 @@ void Qsim::QemuCpu::load_and_grab_pointers(const char* libfile) {
   Mgzd::sym(qemu_mem_wr_virt,     qemu_lib, "mem_wr_virt"         );
   Mgzd::sym(qsim_savevm_state,    qemu_lib, "qsim_savevm_state"   );
   Mgzd::sym(qsim_loadvm_state,    qemu_lib, "qsim_loadvm_state"   );
+
+  Mgzd::sym_opt(qemu_mem_rd_block,      qemu_lib, "mem_rd_block"     );
+  Mgzd::sym_opt(qemu_mem_wr_block,      qemu_lib, "mem_wr_block"     );
+  Mgzd::sym_opt(qemu_mem_rd_virt_block, qemu_lib, "mem_rd_virt_block");
+  Mgzd::sym_opt(qemu_mem_wr_virt_block, qemu_lib, "mem_wr_virt_block");
+  Mgzd::sym_opt(qemu_get_ram_regions,   qemu_lib, "get_ram_regions"  );
+  Mgzd::sym_opt(qemu_get_regs,          qemu_lib, "get_regs"         );
+  Mgzd::sym_opt(qemu_interrupt_cpu,     qemu_lib, "interrupt_cpu"    );
+  Mgzd::sym_opt(qemu_set_gen_cbs_cpu,   qemu_lib, "set_gen_cbs_cpu"  );
+}
+
+// Heap copy of a NULL-terminated argument list. Each OSDomain gets its own, as
+// the arguments differ between domains.
+static const char **copy_args(const char **a) {
+  unsigned n = 0;
+  while (a[n]) ++n;
+
+  const char **r = new const char*[n + 1];
+  for (unsigned i = 0; i <= n; ++i) r[i] = a[i];
+
+  return r;
 }
 
 const char** get_qemu_args(const char* kernel, int ram_size, int n_cpus, const string& cpu_type, qsim_mode mode)
@@ -203,7 +234,7 @@ const char** get_qemu_args(const char* kernel, int ram_size, int n_cpus, const s
   char* initrd_path = strdup(initrd_path_s.c_str());
   char* disk_path   = strdup(disk_path_s.c_str());
 
-  static const char *argv_interactive_a32[] = {
+  const char *argv_interactive_a32[] = {
     "qemu", "-monitor", "/dev/null",
     "-m", ramsize, "-M", "vexpress-a9",
     "-kernel", kernel_path,
@@ -215,7 +246,7 @@ const char** get_qemu_args(const char* kernel, int ram_size, int n_cpus, const s
 
   string a64_img_options_s = "file=" + disk_path_s + ",id=coreimg,cache=unsafe,if=none";
   char* a64_img_options = strdup(a64_img_options_s.c_str());
-  static const char *argv_interactive_a64[] = {
+  const char *argv_interactive_a64[] = {
     "qemu", 
     "-m", ramsize, "-M", "virt",
     "-cpu", "cortex-a57",
@@ -237,7 +268,7 @@ const char** get_qemu_args(const char* kernel, int ram_size, int n_cpus, const s
 
   string bios_path_s = qsim_prefix + "qemu/pc-bios";
   char* bios_path = strdup(bios_path_s.c_str());
-  static const char *argv_interactive_x86[] = {
+  const char *argv_interactive_x86[] = {
     "qemu", "-no-hpet",
     "-L", bios_path,
     "-m", ramsize,
@@ -256,7 +287,7 @@ const char** get_qemu_args(const char* kernel, int ram_size, int n_cpus, const s
 
   //static char *argv_headless_a32[];
   initrd_path_s = qsim_prefix + "initrd/initrd.cpio";
-  static const char *argv_headless_x86[] = {
+  const char *argv_headless_x86[] = {
     "qemu", "-no-hpet", "-no-acpi",
     "-L", bios_path,
     "-m", ramsize,
@@ -274,7 +305,7 @@ const char** get_qemu_args(const char* kernel, int ram_size, int n_cpus, const s
     NULL
   };
 
-  static const char *argv_headless_a64[] = {
+  const char *argv_headless_a64[] = {
     "qemu",
     "-m", ramsize, "-M", "virt",
     "-cpu", "cortex-a57",
@@ -288,18 +319,28 @@ const char** get_qemu_args(const char* kernel, int ram_size, int n_cpus, const s
     NULL
   };
 
+  // The synthetic backend takes its stream settings in place of a kernel.
+  const char *argv_synth[] = {
+    "qemu", "-m", ramsize, "-smp", ncpus,
+    "-synth", kernel[0] ? strdup(kernel) : "-",
+    NULL
+  };
+
+  if (cpu_type == "synth")
+    return copy_args(argv_synth);
+
   if (mode == QSIM_INTERACTIVE) {
     if (cpu_type == "x86")
-      return argv_interactive_x86;
+      return copy_args(argv_interactive_x86);
     else if (cpu_type == "a64")
-      return argv_interactive_a64;
+      return copy_args(argv_interactive_a64);
     else
-      return argv_interactive_a32;
+      return copy_args(argv_interactive_a32);
   } else {
     if (cpu_type == "x86")
-      return argv_headless_x86;
+      return copy_args(argv_headless_x86);
     else if (cpu_type == "a64")
-      return argv_headless_a64;
+      return copy_args(argv_headless_a64);
   }
 
   return NULL;
@@ -342,16 +383,59 @@ Qsim::QemuCpu::~QemuCpu() {
   Mgzd::close(qemu_lib);
 }
 
-vector<OSDomain*> Qsim::OSDomain::osdomains;
+OSDomain *Qsim::OSDomain::osdomains[MAX_DOMAINS];
+std::mutex Qsim::OSDomain::osdomains_lock;
+Qsim::OSDomain::trampolines Qsim::OSDomain::tramps[MAX_DOMAINS];
+
+// Fills tramps[0..D) with the trampolines instantiated for each domain ID.
+template <unsigned D> struct Qsim::OSDomain::trampoline_table {
+  static void fill() {
+    trampoline_table<D - 1>::fill();
+    trampolines &t(tramps[D - 1]);
+    t.atomic = atomic_cb_s<D - 1>;
+    t.magic  = magic_cb_s<D - 1>;
+    t.inst   = inst_cb_s<D - 1>;
+    t.mem    = mem_cb_s<D - 1>;
+    t.io     = io_cb_s<D - 1>;
+    t.intr   = int_cb_s<D - 1>;
+    t.reg    = reg_cb_s<D - 1>;
+    t.trans  = trans_cb_s<D - 1>;
+  }
+};
+
+template <> struct Qsim::OSDomain::trampoline_table<0> {
+  static void fill() {}
+};
 
 void Qsim::OSDomain::assign_id() {
-  id = osdomains.size();
-  osdomains.push_back(this);
+  std::lock_guard<std::mutex> l(osdomains_lock);
+
+  if (!tramps[0].inst) trampoline_table<MAX_DOMAINS>::fill();
+
+  for (id = 0; id < int(MAX_DOMAINS) && osdomains[id]; ++id);
+  if (id == int(MAX_DOMAINS)) {
+    cerr << "Too many OSDomains; at most " << MAX_DOMAINS
+         << " can exist at once.\n";
+    exit(1);
+  }
+
+  osdomains[id] = this;
+  tramp = &tramps[id];
+}
+
+void Qsim::OSDomain::release_id() {
+  std::lock_guard<std::mutex> l(osdomains_lock);
+  osdomains[id] = NULL;
 }
 
 Qsim::OSDomain::OSDomain(uint16_t n, string kernel_path, const string& cpu_type,
                          qsim_mode mode_arg, unsigned ram_mb)
-  : n_cpus(n), waiting_for_eip(0), mode(mode_arg)
+  : n_cpus(n), cpu_cbs(NULL), rr(NULL), icounts(n), timer_insts(0),
+    timer_per_cpu(true), timer_next(n), timer_count(0), timer_start(0),
+    idle_skip(false), parked(NULL), skipped(n), roi_gating(false),
+    roi_in(n), roi_cpus(0), prof(NULL),
+    ram_regions_valid(false), batch_events(0), waiting_for_eip(0),
+    mode(mode_arg)
 {
   assign_id();
 
@@ -360,7 +444,7 @@ Qsim::OSDomain::OSDomain(uint16_t n, string kernel_path, const string& cpu_type,
   if (n > 0) {
     // Create a master CPU using the given kernel
     cpus.push_back(new QemuCpu(id << 16, kernel_path.c_str(), ram_mb, n, cpu_type, mode));
-    cpus[0]->set_magic_cb(magic_cb_s);
+    cpus[0]->set_magic_cb(tramp->magic);
 
     // Set master CPU state to "running"
     running.push_back(true);
@@ -372,6 +456,13 @@ Qsim::OSDomain::OSDomain(uint16_t n, string kernel_path, const string& cpu_type,
       tids.push_back(0);
       idlevec.push_back(true);
     }
+
+    ctx.resize(n_cpus);
+    deps.resize(n_cpus);
+    ctx_a64 = cpu_type == "a64";
+    rcu.set_readers(n_cpus);
+    cpu_cbs = new cpu_cb_lists[n_cpus];
+    parked = new park_state[n_cpus];
   }
   cmd_argv = get_qemu_args(kernel_path.c_str(), ram_mb, n, cpu_type, mode);
 }
@@ -379,6 +470,17 @@ Qsim::OSDomain::OSDomain(uint16_t n, string kernel_path, const string& cpu_type,
 void Qsim::OSDomain::init(const char* filename)
 {
   assign_id();
+  rr = NULL;
+  timer_insts = 0;
+  timer_per_cpu = true;
+  timer_count = 0;
+  timer_start = 0;
+  idle_skip = false;
+  roi_gating = false;
+  roi_cpus = 0;
+  prof = NULL;
+  ram_regions_valid = false;
+  batch_events = 0;
 
   ifstream file(filename);
   if (!file) {
@@ -443,7 +545,7 @@ void Qsim::OSDomain::init(const char* filename)
   ram_size_mb = strtol(cmd_args[m_pos], NULL, 0);
 
   cpus.push_back(new QemuCpu(cmd_argv, arch));
-  cpus[0]->set_magic_cb(magic_cb_s);
+  cpus[0]->set_magic_cb(tramp->magic);
 
   for (int i = 0; i < n_cpus; i++) {
     running.push_back(true);
@@ -451,6 +553,17 @@ void Qsim::OSDomain::init(const char* filename)
     idlevec.push_back(true);
   }
 
+  ctx.resize(n_cpus);
+  deps.resize(n_cpus);
+  icounts.resize(n_cpus);
+  timer_next.resize(n_cpus);
+  skipped.resize(n_cpus);
+  roi_in.resize(n_cpus);
+  parked = new park_state[n_cpus];
+  ctx_a64 = arch == "a64";
+  rcu.set_readers(n_cpus);
+  cpu_cbs = new cpu_cb_lists[n_cpus];
+
   mode = QSIM_HEADLESS;
 }
 
@@ -494,53 +607,484 @@ void Qsim::OSDomain::save_state(const char* filename) {
   cmd_file.close();
 }
 
-int Qsim::OSDomain::get_tid(uint16_t i) {
-  if (!running[i]) return -1;
-  else return tids[i];
-}
-
-Qsim::OSDomain::cpu_mode Qsim::OSDomain::get_mode(uint16_t i) {
-  bool prot = (cpus[0]->get_reg(i, QSIM_X86_CR0))&1;
+void Qsim::OSDomain::refresh_ctx(uint16_t i) {
+  static const int regs[] = { QSIM_X86_CS, QSIM_X86_CR0 };
+  uint64_t v[2];
+  cpus[0]->get_regs(i, regs, 2, v);
 
-  return prot?MODE_PROT:MODE_REAL;
+  cpu_ctx &c(ctx[i]);
+  c.prot = (v[0] & 1) ? PROT_USER : PROT_KERN;
+  c.mode = (v[1] & 1) ? MODE_PROT : MODE_REAL;
+  c.valid = c.tracking;
 }
 
-Qsim::OSDomain::cpu_prot Qsim::OSDomain::get_prot(uint16_t i) {
-  bool user = (cpus[0]->get_reg(i, QSIM_X86_CS))&1;
+// Can this instruction change the privilege level or mode? Faults and
+// interrupts are seen through int_cb, so only instructions that switch
+// explicitly are listed. Extra hits only cost a refresh.
+bool Qsim::OSDomain::ctx_changing_inst(const uint8_t *b, uint8_t len) {
+  if (ctx_a64) {
+    if (len != 4) return false;
+    uint32_t w = b[0] | b[1] << 8 | b[2] << 16 | uint32_t(b[3]) << 24;
+    return w == 0xd69f03e0                                   // eret
+        || ((w & 0xffe0001c) == 0xd4000000 && (w & 3) != 0); // svc/hvc/smc
+  }
+
+  // Skip legacy and REX prefixes.
+  const uint8_t *end = b + len;
+  while (b < end && (*b == 0x66 || *b == 0x67 || *b == 0xf0 || *b == 0xf2 ||
+                     *b == 0xf3 || *b == 0x2e || *b == 0x36 || *b == 0x3e ||
+                     *b == 0x26 || *b == 0x64 || *b == 0x65 ||
+                     (*b & 0xf0) == 0x40)) ++b;
+  if (b == end) return false;
+
+  switch (*b) {
+  case 0xca: case 0xcb:                     // lret
+  case 0xcc: case 0xcd: case 0xce: case 0xcf: // int3, int, into, iret
+  case 0x9a: case 0xea:                     // far call, far jmp
+    return true;
+  case 0xff:                                // far call/jmp through memory
+    if (b + 1 == end) return false;
+    return ((b[1] >> 3) & 7) == 3 || ((b[1] >> 3) & 7) == 5;
+  case 0x0f:
+    if (b + 1 == end) return false;
+    switch (b[1]) {
+    case 0x01:                              // lmsw, swapgs, ...
+    case 0x05: case 0x07:                   // syscall, sysret
+    case 0x22:                              // mov to control register
+    case 0x34: case 0x35:                   // sysenter, sysexit
+      return true;
+    }
+    break;
+  }
 
-  return user?PROT_USER:PROT_KERN;
+  return false;
 }
 
 string Qsim::OSDomain::getCpuType(uint16_t i) {
   return cpus[i]->getCpuType();
 }
 
+// Host cycle counter for callback profiling. Only differences are kept;
+// prof_report() converts them to time against the steady clock.
+static inline uint64_t prof_clock() {
+#if defined(__i386__) || defined(__x86_64__)
+  return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+  uint64_t t;
+  __asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(t));
+  return t;
+#else
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+static inline uint64_t prof_start(const void *p) {
+  return p ? prof_clock() : 0;
+}
+
+static uint64_t steady_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Callback types, as passed to prof_sample().
+enum {
+  PROF_ATOMIC, PROF_MAGIC, PROF_INST, PROF_MEM, PROF_IO, PROF_INT, PROF_REG,
+  PROF_TRANS, PROF_DEP, PROF_KINDS
+};
+
+static const char *const prof_names[PROF_KINDS] = {
+  "atomic", "magic", "inst", "mem", "io", "int", "reg", "trans", "dep"
+};
+
+// Dispatch times are binned by log2 of their cycle count. Each CPU times
+// this many distinct callbacks; any more are counted together.
+static const unsigned PROF_BUCKETS = 40;
+static const unsigned PROF_HANDLES = 32;
+
+unsigned Qsim::OSDomain::run_slice(uint16_t i, unsigned n) {
+  reset_ctx(i);
+  rcu.enter(i);
+  unsigned rval = cpus[0]->run(i, n);
+  if (deps[i].open) dep_flush(i);
+  rcu.exit(i);
+  reset_ctx(i);
+  icounts[i] += rval;
+  if (batch_events && !batch_cbs.empty()) flush_batch(i);
+
+  return rval;
+}
+
 unsigned Qsim::OSDomain::run(uint16_t i, unsigned n) {
-  if (running[i]) { return cpus[0]->run(i, n); }
+  if (!running[i]) return 0;
+
+  // Timer deadlines and replayed interrupts fall between slices.
+  unsigned total = 0;
+  do {
+    if (rr) rr_deliver(i);
+
+    unsigned slice = n - total;
+    if (rr) slice = rr_limit(i, slice);
+    if (timer_insts) slice = timer_limit(i, slice);
+
+    park_state &p(parked[i]);
+    unsigned ran;
+    if (skipping() && p.parked.load(std::memory_order_acquire)) {
+      ran = slice;
+      icounts[i] += ran;
+      skipped[i] += ran;
+    } else {
+      unsigned w = p.wakes.load(std::memory_order_relaxed);
+      uint64_t t = prof_start(prof);
+      ran = run_slice(i, slice);
+      if (prof) prof_run(i, ran, t);
+      if (p.wakes.load(std::memory_order_relaxed) != w)
+        p.parked.store(false, std::memory_order_release);
+    }
 
-  return 0;
+    total += ran;
+    if (timer_insts) timer_tick(i, ran);
+
+    // A CPU that parked cut its slice short, and skips the rest.
+    if (ran < slice &&
+        !(skipping() && p.parked.load(std::memory_order_acquire)))
+      break;
+  } while (total < n);
+
+  return total;
 }
 
 unsigned Qsim::OSDomain::run(unsigned n) {
-  if (running[0]) { return cpus[0]->run(n); } 
+  if (!running[0]) return 0;
+
+  unsigned total = 0;
+  do {
+    unsigned slice = n - total;
+    if (timer_insts) slice = timer_limit(-1, slice);
+
+    uint64_t t = prof_start(prof);
+    for (unsigned i = 0; i < n_cpus; i++) { reset_ctx(i); rcu.enter(i); }
+    unsigned ran = cpus[0]->run(slice);
+    for (unsigned i = 0; i < n_cpus; i++) {
+      if (deps[i].open) dep_flush(i);
+      rcu.exit(i);
+      reset_ctx(i);
+    }
+    if (prof) prof_run(0, ran, t);
+    if (batch_events && !batch_cbs.empty())
+      for (unsigned i = 0; i < n_cpus; i++) flush_batch(i);
 
-  return 0;
+    total += ran;
+    if (timer_insts) timer_tick(-1, ran);
+    if (ran < slice) break;
+  } while (total < n);
+
+  return total;
+}
+
+void Qsim::OSDomain::set_timer(uint64_t insts, bool per_cpu) {
+  timer_insts = insts;
+  timer_per_cpu = per_cpu;
+  for (unsigned i = 0; i < n_cpus; i++) timer_next[i] = icounts[i] + insts;
+  timer_start = timer_count;
+}
+
+// Longest slice of n that CPU i (-1 for run(n)) can run without passing a
+// timer deadline.
+unsigned Qsim::OSDomain::timer_limit(int i, unsigned n) const {
+  uint64_t left;
+  if (timer_per_cpu && i >= 0) {
+    left = timer_next[i] - icounts[i];
+  } else {
+    // Other CPUs may be counting too, so this is only a hint.
+    left = timer_insts - (timer_count - timer_start) % timer_insts;
+  }
+
+  return left < n ? left : n;
+}
+
+void Qsim::OSDomain::timer_tick(int i, unsigned ran) {
+  if (timer_per_cpu && i >= 0) {
+    if (icounts[i] >= timer_next[i]) {
+      timer_next[i] = icounts[i] + timer_insts;
+      // As in timer_interrupt(), the PIT only interrupts CPU 0, and stopped
+      // CPUs get no interrupts at all.
+      uint8_t vec = timer_vec();
+      if (running[i] && (vec == 0xef || i == 0)) post_int(i, vec);
+    }
+    return;
+  }
+
+  uint64_t c = timer_count.fetch_add(ran) + ran - timer_start;
+  if ((c - ran) / timer_insts != c / timer_insts) timer_interrupt();
+}
+
+// The register ids BASE .. BASE+N-1, for reading a whole context at once.
+template <int N, int BASE> struct RegList {
+  RegList() { for (int i = 0; i < N; ++i) r[i] = BASE + i; }
+  int r[N];
+};
+
+void Qsim::OSDomain::get_context(int c, X86Context &ctx) {
+  static const RegList<QSIM_X86_N_REGS, 0> regs;
+  get_regs(c, regs.r, QSIM_X86_N_REGS, ctx.reg);
+}
+
+void Qsim::OSDomain::get_context(int c, Arm64Context &ctx) {
+  // QSIM_ARM64_INVALID is not a register; leave its slot zeroed.
+  static const RegList<QSIM_ARM64_ENDING - 1, 1> regs;
+  ctx.reg[QSIM_ARM64_INVALID] = 0;
+  get_regs(c, regs.r, QSIM_ARM64_ENDING - 1, ctx.reg + 1);
+}
+
+static bool region_less(const qsim_ram_region &a, const qsim_ram_region &b) {
+  return a.paddr < b.paddr;
+}
+
+const vector<qsim_ram_region> &Qsim::OSDomain::get_ram_regions() {
+  if (!ram_regions_valid) {
+    // The RAM layout is fixed once QEMU is initialized, so ask only once.
+    qsim_ram_region r[16];
+    int n = cpus[0]->get_ram_regions(r, 16);
+    if (n > 0) ram_regions.assign(r, r + n);
+    std::sort(ram_regions.begin(), ram_regions.end(), region_less);
+    ram_regions_valid = true;
+  }
+
+  return ram_regions;
 }
 
 void Qsim::OSDomain::connect_console(std::ostream& s) {
   consoles.push_back(&s);
 }
 
+// Local APIC timer once the secondary CPUs are up, the PIT before.
+uint8_t Qsim::OSDomain::timer_vec() const {
+  return n_cpus > 1 && running[0] && running[1] ? 0xef : 0x30;
+}
+
 void Qsim::OSDomain::timer_interrupt() {
-  if (n_cpus > 1 && running[0] && running[1]) {
+  if (timer_vec() == 0xef) {
     for (unsigned i = 0; i < n_cpus; i++) if (running[i]) {
-      cpus[0]->interrupt(0xef);
+      post_int(i, 0xef);
     }
   } else {
-    cpus[0]->interrupt(0x30);
+    post_int(0, 0x30);
   }
 }
 
+// One logged input. Logs are a header followed by these, in host byte order.
+struct rr_event {
+  enum { INT, IO };
+  uint64_t icount;     // CPU's count at delivery, or at the run() for I/O
+  uint64_t port;
+  uint32_t val;
+  uint16_t cpu;
+  uint8_t  kind;
+  uint8_t  vec;
+  uint8_t  size, type;
+  uint8_t  pad[6];
+};
+
+static const char RR_MAGIC[8] = { 'Q', 'S', 'I', 'M', 'R', 'R', '0', '1' };
+
+struct Qsim::OSDomain::replay_state {
+  replay_state(unsigned n, bool play):
+    play(play), pending(n), log(n), ints(n), ios(n), int_next(n),
+    io_next(n), diverged(false) {}
+
+  bool play;
+
+  // Recording: interrupts waiting for their CPU's next run(), guarded by
+  // lock as they may be posted from other CPUs' threads, and each CPU's log,
+  // only ever touched by the thread running it.
+  std::ofstream out;
+  std::mutex lock;
+  vector<vector<uint8_t> > pending;
+  vector<vector<rr_event> > log;
+
+  // Replaying: each CPU's interrupts and I/O, with the next to deliver.
+  vector<vector<rr_event> > ints, ios;
+  vector<size_t> int_next, io_next;
+  std::atomic<bool> diverged;
+};
+
+int Qsim::OSDomain::post_int(uint16_t i, uint8_t vec) {
+  unpark(i);
+
+  if (!rr) return cpus[0]->interrupt_cpu(i, vec);
+
+  // Replays bring their own interrupts.
+  if (!rr->play) {
+    std::lock_guard<std::mutex> l(rr->lock);
+    rr->pending[i].push_back(vec);
+  }
+
+  return 0;
+}
+
+// Raise the interrupts due on CPU i before it runs.
+void Qsim::OSDomain::rr_deliver(uint16_t i) {
+  if (rr->play) {
+    const vector<rr_event> &q(rr->ints[i]);
+    size_t &k(rr->int_next[i]);
+    while (k < q.size() && q[k].icount <= icounts[i]) {
+      unpark(i);
+      cpus[0]->interrupt_cpu(i, q[k++].vec);
+    }
+    return;
+  }
+
+  vector<uint8_t> v;
+  {
+    std::lock_guard<std::mutex> l(rr->lock);
+    v.swap(rr->pending[i]);
+  }
+
+  for (unsigned k = 0; k < v.size(); ++k) {
+    rr_event e = {};
+    e.icount = icounts[i];
+    e.cpu = i;
+    e.kind = rr_event::INT;
+    e.vec = v[k];
+    rr->log[i].push_back(e);
+    cpus[0]->interrupt_cpu(i, v[k]);
+  }
+}
+
+// Shorten a replayed run so that it stops at CPU i's next interrupt.
+unsigned Qsim::OSDomain::rr_limit(uint16_t i, unsigned n) {
+  if (!rr->play) return n;
+
+  const vector<rr_event> &q(rr->ints[i]);
+  size_t k(rr->int_next[i]);
+  if (k < q.size() && q[k].icount - icounts[i] < n)
+    n = q[k].icount - icounts[i];
+
+  return n;
+}
+
+uint32_t *Qsim::OSDomain::rr_io(uint16_t i, uint64_t port, uint8_t s,
+                                int type, uint32_t data)
+{
+  if (!rr->play) {
+    rr_event e = {};
+    e.icount = icounts[i];
+    e.port = port;
+    e.val = data;
+    e.cpu = i;
+    e.kind = rr_event::IO;
+    e.size = s;
+    e.type = type;
+    rr->log[i].push_back(e);
+    return NULL;
+  }
+
+  vector<rr_event> &q(rr->ios[i]);
+  size_t &k(rr->io_next[i]);
+  if (k < q.size() && q[k].port == port && q[k].size == s &&
+      q[k].type == type)
+    return &q[k++].val;
+
+  if (!rr->diverged.exchange(true)) {
+    cerr << "Replay diverged: unexpected I/O on CPU " << i
+         << " near instruction " << icounts[i] << ".\n";
+  }
+
+  return NULL;
+}
+
+bool Qsim::OSDomain::start_record(const char *filename) {
+  if (rr) {
+    cerr << "Already recording or replaying.\n";
+    return false;
+  }
+
+  rr = new replay_state(n_cpus, false);
+  rr->out.open(filename, std::ios::binary);
+  if (!rr->out) {
+    cerr << "Could not open \"" << filename << "\" for writing.\n";
+    delete rr;
+    rr = NULL;
+    return false;
+  }
+
+  set_io_cb(tramp->io);
+
+  return true;
+}
+
+void Qsim::OSDomain::end_record() {
+  if (!rr || rr->play) return;
+
+  // Interrupts still held are logged at the counts where a replay will
+  // raise them.
+  for (unsigned i = 0; i < n_cpus; i++) rr_deliver(i);
+
+  uint32_t n = n_cpus;
+  rr->out.write(RR_MAGIC, sizeof(RR_MAGIC));
+  rr->out.write((const char*)&n, sizeof(n));
+  for (unsigned i = 0; i < n_cpus; i++) {
+    const vector<rr_event> &l(rr->log[i]);
+    if (!l.empty())
+      rr->out.write((const char*)&l[0], l.size() * sizeof(rr_event));
+  }
+  if (!rr->out) cerr << "Error writing record/replay log.\n";
+
+  delete rr;
+  rr = NULL;
+}
+
+bool Qsim::OSDomain::start_replay(const char *filename) {
+  if (rr) {
+    cerr << "Already recording or replaying.\n";
+    return false;
+  }
+
+  ifstream in(filename, std::ios::binary);
+  if (!in) {
+    cerr << "Could not open \"" << filename << "\" for reading.\n";
+    return false;
+  }
+
+  char magic[sizeof(RR_MAGIC)];
+  uint32_t n;
+  in.read(magic, sizeof(magic));
+  in.read((char*)&n, sizeof(n));
+  if (!in || memcmp(magic, RR_MAGIC, sizeof(magic)) || n != n_cpus) {
+    cerr << "\"" << filename << "\" is not a record/replay log for "
+         << n_cpus << " CPUs.\n";
+    return false;
+  }
+
+  replay_state *r = new replay_state(n_cpus, true);
+  rr_event e;
+  while (in.read((char*)&e, sizeof(e))) {
+    if (e.cpu >= n_cpus) {
+      cerr << "Corrupt record/replay log \"" << filename << "\".\n";
+      delete r;
+      return false;
+    }
+    (e.kind == rr_event::INT ? r->ints : r->ios)[e.cpu].push_back(e);
+  }
+
+  rr = r;
+  set_io_cb(tramp->io);
+
+  return true;
+}
+
+bool Qsim::OSDomain::end_replay() {
+  if (!rr || !rr->play) return true;
+
+  bool ok = !rr->diverged;
+  delete rr;
+  rr = NULL;
+
+  return ok;
+}
+
 void Qsim::OSDomain::set_inst_cb  (inst_cb_t   cb) {
   cpus[0]->set_inst_cb  (cb);
 }
@@ -571,183 +1115,932 @@ void Qsim::OSDomain::set_trans_cb(trans_cb_t cb) {
 
 void Qsim::OSDomain::set_gen_cbs(bool state) {
   cpus[0]->set_gen_cbs(state);
+  for (unsigned i = 0; i < n_cpus; i++) reset_ctx(i);
 }
 
 void Qsim::OSDomain::set_sys_cbs(bool state) {
   cpus[0]->set_sys_cbs(state);
 }
 
+void Qsim::OSDomain::add_roi(uint16_t id) {
+  if (roi_ids.empty()) roi_ids.resize(0x10000);
+  roi_ids[id] = true;
+
+  if (!roi_gating) {
+    // Everyone starts outside; the global switch only needs setting once.
+    roi_gating = true;
+    roi_cpus = 0;
+    for (unsigned i = 0; i < n_cpus; i++) roi_in[i] = false;
+    if (cpus[0]->has_gen_cbs_cpu()) {
+      for (unsigned i = 0; i < n_cpus; i++) cpus[0]->set_gen_cbs_cpu(i, false);
+    } else {
+      cpus[0]->set_gen_cbs(false);
+    }
+    for (unsigned i = 0; i < n_cpus; i++) reset_ctx(i);
+  }
+
+  for (unsigned i = 0; i < n_cpus; i++) roi_update(i);
+}
+
+// A ROI marker from CPU i's current task. Regions that are not instrumented
+// are ignored, as is an end without a begin (a region instrumented while
+// the task was inside it).
+void Qsim::OSDomain::roi_mark(uint16_t i, uint16_t id, bool begin) {
+  if (!roi_gating || !roi_ids[id]) return;
+
+  {
+    std::lock_guard<std::mutex> l(roi_lock);
+    unsigned &d(roi_depth[tids[i]]);
+    if (begin) ++d;
+    else if (d) --d;
+  }
+
+  roi_update(i);
+}
+
+// Turn callbacks on CPU i on or off to match its current task.
+void Qsim::OSDomain::roi_update(uint16_t i) {
+  std::lock_guard<std::mutex> l(roi_lock);
+
+  std::unordered_map<uint16_t, unsigned>::const_iterator d;
+  d = roi_depth.find(tids[i]);
+  bool want = d != roi_depth.end() && d->second;
+  if (want == bool(roi_in[i])) return;
+
+  roi_in[i] = want;
+  if (cpus[0]->has_gen_cbs_cpu()) {
+    cpus[0]->set_gen_cbs_cpu(i, want);
+    reset_ctx(i);
+  } else if (want ? roi_cpus++ == 0 : --roi_cpus == 0) {
+    cpus[0]->set_gen_cbs(want);
+    for (unsigned j = 0; j < n_cpus; j++) reset_ctx(j);
+  }
+}
+
+// Profile counters are only written by the thread running their CPU, but
+// prof_report() may read them from another thread at any time. Relaxed
+// atomics make that safe; the writer needs no locked instruction, since no
+// other thread adds to the same counter.
+typedef std::atomic<uint64_t> prof_ctr;
+
+static inline void prof_add(prof_ctr &c, uint64_t d) {
+  c.store(c.load(std::memory_order_relaxed) + d, std::memory_order_relaxed);
+}
+
+static inline uint64_t prof_get(const prof_ctr &c) {
+  return c.load(std::memory_order_relaxed);
+}
+
+struct Qsim::OSDomain::prof_cpu {
+  prof_cpu(): runs(0), run_insts(0), run_cycles(0), n_handles(0) {
+    for (unsigned k = 0; k < PROF_KINDS; k++) {
+      events[k] = sampled[k] = cycles[k] = cb_cycles[k] = 0;
+      for (unsigned b = 0; b < PROF_BUCKETS; b++) hist[k][b] = 0;
+    }
+    for (unsigned j = 0; j <= PROF_HANDLES; j++) {
+      handles[j].kind = 0;
+      handles[j].fn = NULL;
+      handles[j].obj = NULL;
+      handles[j].calls = handles[j].cycles = 0;
+    }
+  }
+
+  unsigned countdown[PROF_KINDS];    // Events until the next timed one
+  prof_ctr events[PROF_KINDS];
+  prof_ctr sampled[PROF_KINDS];      // Events timed
+  prof_ctr cycles[PROF_KINDS];       // Spent in the timed dispatches
+  prof_ctr cb_cycles[PROF_KINDS];    // Of which inside callbacks
+  prof_ctr hist[PROF_KINDS][PROF_BUCKETS];
+  prof_ctr runs, run_insts, run_cycles;
+
+  struct handle {
+    unsigned kind;
+    void (*fn)();
+    const void *obj;
+    prof_ctr calls, cycles;
+  };
+  handle handles[PROF_HANDLES + 1];  // The last one counts the overflow
+  std::atomic<unsigned> n_handles;   // Published to prof_report()
+
+  unsigned char pad[64];
+};
+
+struct Qsim::OSDomain::prof_state {
+  unsigned period;
+  std::ostream *dump;
+  uint64_t dump_ns;
+  std::atomic<uint64_t> next_dump;
+  uint64_t start_ns, start_clock;
+  std::mutex report_lock;
+  prof_cpu *cpus;
+};
+
+void Qsim::OSDomain::enable_prof(unsigned period, std::ostream *dump,
+                                 unsigned dump_ms)
+{
+  disable_prof();
+
+  prof_state *p = new prof_state;
+  p->period = period ? period : 1;
+  p->dump = dump_ms ? dump : NULL;
+  p->dump_ns = dump_ms * 1000000ull;
+  p->cpus = new prof_cpu[n_cpus];
+  for (unsigned i = 0; i < n_cpus; i++)
+    for (unsigned k = 0; k < PROF_KINDS; k++)
+      p->cpus[i].countdown[k] = p->period;
+  p->start_ns = steady_ns();
+  p->start_clock = prof_clock();
+  p->next_dump = p->start_ns + p->dump_ns;
+
+  prof = p;
+}
+
+void Qsim::OSDomain::disable_prof() {
+  if (!prof) return;
+  delete[] prof->cpus;
+  delete prof;
+  prof = NULL;
+}
+
+Qsim::OSDomain::prof_cpu *Qsim::OSDomain::prof_tick(uint16_t i, unsigned k) {
+  prof_cpu &c(prof->cpus[i]);
+
+  prof_add(c.events[k], 1);
+  if (--c.countdown[k]) return NULL;
+
+  c.countdown[k] = prof->period;
+  prof_add(c.sampled[k], 1);
+  return &c;
+}
+
+void Qsim::OSDomain::prof_done(prof_cpu *p, unsigned k, uint64_t start) {
+  if (!p) return;
+
+  uint64_t d = prof_clock() - start;
+  unsigned b = d ? 63 - __builtin_clzll(d) : 0;
+  if (b >= PROF_BUCKETS) b = PROF_BUCKETS - 1;
+
+  prof_add(p->cycles[k], d);
+  prof_add(p->hist[k][b], 1);
+}
+
+void Qsim::OSDomain::prof_call(prof_cpu *p, unsigned k, void (*fn)(),
+                               const void *obj, uint64_t start)
+{
+  uint64_t d = prof_clock() - start;
+  prof_add(p->cb_cycles[k], d);
+
+  // Only this CPU's thread adds handles, so n_handles is only published.
+  unsigned n = p->n_handles.load(std::memory_order_relaxed), j;
+  for (j = 0; j < n; ++j) {
+    const prof_cpu::handle &h(p->handles[j]);
+    if (h.fn == fn && h.obj == obj && h.kind == k) break;
+  }
+
+  if (j == n && n < PROF_HANDLES) {
+    p->handles[n].kind = k;
+    p->handles[n].fn = fn;
+    p->handles[n].obj = obj;
+    p->n_handles.store(n + 1, std::memory_order_release);
+  }
+
+  prof_cpu::handle &h(p->handles[j]);
+  prof_add(h.calls, 1);
+  prof_add(h.cycles, d);
+}
+
+void Qsim::OSDomain::prof_run(uint16_t i, unsigned insts, uint64_t start) {
+  prof_cpu &c(prof->cpus[i]);
+  prof_add(c.runs, 1);
+  prof_add(c.run_insts, insts);
+  prof_add(c.run_cycles, prof_clock() - start);
+
+  if (!prof->dump) return;
+
+  uint64_t now = steady_ns(),
+           next = prof->next_dump.load(std::memory_order_relaxed);
+  if (now >= next &&
+      prof->next_dump.compare_exchange_strong(next, now + prof->dump_ns))
+    prof_report(*prof->dump);
+}
+
+// Name of the function at fn, if the dynamic symbol table has it.
+static string prof_fn_name(void (*fn)()) {
+  Dl_info info;
+  if (!fn || !dladdr(reinterpret_cast<void*>(fn), &info) || !info.dli_sname)
+    return "";
+
+  int status;
+  char *d = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+  string name(d ? d : info.dli_sname);
+  free(d);
+
+  return name;
+}
+
+void Qsim::OSDomain::prof_report(std::ostream &os) {
+  if (!prof) return;
+
+  std::lock_guard<std::mutex> l(prof->report_lock);
+
+  double secs = (steady_ns() - prof->start_ns) / 1e9,
+         ns = secs * 1e9 / (prof_clock() - prof->start_clock + 1),
+         ms = ns / 1e6;
+  char line[256];
+
+  snprintf(line, sizeof line, "qsim callback profile: %.3f s, 1 in %u events "
+           "timed, %.3f ns/cycle\n", secs, prof->period, ns);
+  os << line;
+
+  // Untimed events are assumed to cost what the timed ones did on the same
+  // CPU. QEMU's share is what is left of each run. run(n) books the whole
+  // domain's runs to CPU 0.
+  os << "  cpu       runs        insts     run ms    qemu ms dispatch ms"
+        "      cb ms\n";
+  double t_run = 0, t_disp = 0, t_cb = 0;
+  uint64_t t_runs = 0, t_insts = 0;
+  uint64_t events[PROF_KINDS] = {0}, sampled[PROF_KINDS] = {0},
+           hist[PROF_KINDS][PROF_BUCKETS] = {{0}};
+  double cycles[PROF_KINDS] = {0}, cb_cycles[PROF_KINDS] = {0};
+  for (unsigned i = 0; i < n_cpus; i++) {
+    const prof_cpu &c(prof->cpus[i]);
+    double disp = 0, cb = 0;
+    for (unsigned k = 0; k < PROF_KINDS; k++) {
+      uint64_t e = prof_get(c.events[k]), n = prof_get(c.sampled[k]),
+               cy = prof_get(c.cycles[k]), cb_cy = prof_get(c.cb_cycles[k]);
+      events[k] += e;
+      sampled[k] += n;
+      cycles[k] += cy;
+      cb_cycles[k] += cb_cy;
+      for (unsigned b = 0; b < PROF_BUCKETS; b++)
+        hist[k][b] += prof_get(c.hist[k][b]);
+      if (!n) continue;
+      disp += double(cy) * e / n;
+      cb += double(cb_cy) * e / n;
+    }
+
+    uint64_t runs = prof_get(c.runs), insts = prof_get(c.run_insts);
+    double run = prof_get(c.run_cycles), qemu = run > disp ? run - disp : 0;
+    snprintf(line, sizeof line, "%5u %10llu %12llu %10.1f %10.1f %11.1f "
+             "%10.1f\n", i, (unsigned long long)runs,
+             (unsigned long long)insts, run*ms, qemu*ms, disp*ms, cb*ms);
+    os << line;
+
+    t_run += run; t_disp += disp; t_cb += cb;
+    t_runs += runs; t_insts += insts;
+  }
+  double t_qemu = t_run > t_disp ? t_run - t_disp : 0;
+  snprintf(line, sizeof line, "  all %10llu %12llu %10.1f %10.1f %11.1f "
+           "%10.1f\n", (unsigned long long)t_runs,
+           (unsigned long long)t_insts, t_run*ms, t_qemu*ms, t_disp*ms,
+           t_cb*ms);
+  os << line;
+
+  os << "  type         events     events/s  dispatch ns/ev  cb ns/ev\n";
+  for (unsigned k = 0; k < PROF_KINDS; k++) {
+    if (!events[k]) continue;
+    double d = sampled[k] ? cycles[k] * ns / sampled[k] : 0,
+           c = sampled[k] ? cb_cycles[k] * ns / sampled[k] : 0;
+    snprintf(line, sizeof line, "  %-6s %14llu %12.0f %15.1f %9.1f\n",
+             prof_names[k], (unsigned long long)events[k], events[k] / secs,
+             d, c);
+    os << line;
+
+    // Histogram of the timed dispatches: count below each bound, in ns.
+    os << "        ";
+    for (unsigned b = 0; b < PROF_BUCKETS; b++) {
+      if (!hist[k][b]) continue;
+      snprintf(line, sizeof line, " <%.0f:%llu", double(2ull << b) * ns,
+               (unsigned long long)hist[k][b]);
+      os << line;
+    }
+    os << '\n';
+  }
+
+  // Callbacks, costliest first, merged across CPUs.
+  typedef std::map<std::pair<std::pair<unsigned, void (*)()>, const void*>,
+                   std::pair<uint64_t, uint64_t> > handle_map;
+  handle_map handles;
+  for (unsigned i = 0; i < n_cpus; i++) {
+    const prof_cpu &c(prof->cpus[i]);
+    unsigned n = c.n_handles.load(std::memory_order_acquire);
+    for (unsigned j = 0; j <= PROF_HANDLES; j++) {
+      if (j >= n && j < PROF_HANDLES) continue;
+      const prof_cpu::handle &h(c.handles[j]);
+      uint64_t calls = prof_get(h.calls);
+      if (!calls) continue;
+      std::pair<uint64_t, uint64_t> &t(
+        handles[std::make_pair(std::make_pair(h.kind, h.fn), h.obj)]);
+      t.first += calls;
+      t.second += prof_get(h.cycles);
+    }
+  }
+
+  std::vector<handle_map::const_iterator> hs;
+  std::vector<std::pair<uint64_t, unsigned> > order;
+  handle_map::const_iterator h;
+  for (h = handles.begin(); h != handles.end(); ++h) {
+    order.push_back(std::make_pair(h->second.second, hs.size()));
+    hs.push_back(h);
+  }
+  std::sort(order.rbegin(), order.rend());
+
+  if (!order.empty())
+    os << "  type   object             handler              calls   ns/call"
+          "     est ms\n";
+  for (unsigned i = 0; i < order.size(); i++) {
+    h = hs[order[i].second];
+    unsigned k = h->first.first.first;
+    void (*fn)() = h->first.first.second;
+    uint64_t calls = h->second.first;
+    double c = h->second.second;
+
+    if (!fn) {
+      snprintf(line, sizeof line, "  %-6s %-37s", "-", "(others)");
+    } else {
+      snprintf(line, sizeof line, "  %-6s %-18p %-18p", prof_names[k],
+               h->first.second, reinterpret_cast<void*>(fn));
+    }
+    os << line;
+    snprintf(line, sizeof line, " %8llu %9.1f %10.1f",
+             (unsigned long long)calls, c * ns / calls, c * prof->period * ms);
+    os << line;
+
+    string name(prof_fn_name(fn));
+    if (!name.empty()) os << "  " << name;
+    os << '\n';
+  }
+}
+
 Qsim::OSDomain::~OSDomain() {
-  // Destroy the callback objects.
-  for (unsigned i = 0; i < atomic_cbs.size(); ++i) delete atomic_cbs[i];
-  for (unsigned i = 0; i < io_cbs.size(); ++i) delete io_cbs[i];
-  for (unsigned i = 0; i < mem_cbs.size(); ++i) delete mem_cbs[i];
-  for (unsigned i = 0; i < int_cbs.size(); ++i) delete int_cbs[i];
-  for (unsigned i = 0; i < inst_cbs.size(); ++i) delete inst_cbs[i];
-  for (unsigned i = 0; i < start_cbs.size(); ++i) delete start_cbs[i];
-  for (unsigned i = 0; i < end_cbs.size(); ++i) delete end_cbs[i];
-  for (unsigned i = 0; i < magic_cbs.size(); ++i) delete magic_cbs[i];
-
-  // Destroy the CPUs.
+  end_record();
+  end_replay();
+  disable_prof();
+
+  // Destroy the CPUs. The callback lists free themselves.
   delete cpus[0];
+  delete[] cpu_cbs;
+  delete[] parked;
+  release_id();
   //for (unsigned i = 0; i < n; i++) delete cpus[i];
 }
 
 void Qsim::OSDomain::unset_atomic_cb(atomic_cb_handle_t h) {
-  atomic_cbs.erase(h);
+  atomic_cbs.remove(rcu, h);
 }
 
 void Qsim::OSDomain::unset_magic_cb(magic_cb_handle_t h) {
-  magic_cbs.erase(h);
+  magic_cbs.remove(rcu, h);
 }
 
 void Qsim::OSDomain::unset_io_cb(io_cb_handle_t h) {
-  io_cbs.erase(h);
+  io_cbs.remove(rcu, h);
 }
 
 void Qsim::OSDomain::unset_mem_cb(mem_cb_handle_t h) {
-  mem_cbs.erase(h);
+  mem_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_mem_cb_ex(mem_ex_cb_handle_t h) {
+  mem_ex_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_int_cb(int_cb_handle_t h) {
+  int_cbs.remove(rcu, h);
 }
 
 void Qsim::OSDomain::unset_inst_cb(inst_cb_handle_t h) {
-  inst_cbs.erase(h);
+  inst_cbs.remove(rcu, h);
 }
 
 void Qsim::OSDomain::unset_reg_cb(reg_cb_handle_t h) {
-  reg_cbs.erase(h);
+  reg_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_mem_cb(uint16_t i, mem_cpu_handle_t h) {
+  cpu_cbs[i].mem.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_mem_cb_ex(uint16_t i, mem_ex_cpu_handle_t h) {
+  cpu_cbs[i].mem_ex.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_int_cb(uint16_t i, int_cpu_handle_t h) {
+  cpu_cbs[i].intr.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_inst_cb(uint16_t i, inst_cpu_handle_t h) {
+  cpu_cbs[i].inst.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_reg_cb(uint16_t i, reg_cpu_handle_t h) {
+  cpu_cbs[i].reg.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_mem_cb(mem_flt_handle_t h) {
+  mem_flt_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_mem_cb_ex(mem_ex_flt_handle_t h) {
+  mem_ex_flt_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_int_cb(int_flt_handle_t h) {
+  int_flt_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_inst_cb(inst_flt_handle_t h) {
+  inst_flt_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_reg_cb(reg_flt_handle_t h) {
+  reg_flt_cbs.remove(rcu, h);
 }
 
 void Qsim::OSDomain::unset_trans_cb(trans_cb_handle_t h) {
-  trans_cbs.erase(h);
+  trans_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_batch_cb(batch_cb_handle_t h) {
+  batch_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_dep_cb(dep_cb_handle_t h) {
+  dep_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::unset_dep_cb(uint16_t i, dep_cpu_handle_t h) {
+  cpu_cbs[i].dep.remove(rcu, h);
 }
 
 void Qsim::OSDomain::unset_app_start_cb(start_cb_handle_t h) {
-  start_cbs.erase(h);
+  start_cbs.remove(rcu, h);
 }
 
 void Qsim::OSDomain::unset_app_end_cb(end_cb_handle_t h) {
-  end_cbs.erase(h);
+  end_cbs.remove(rcu, h);
+}
+
+void Qsim::OSDomain::enable_batching(unsigned ring_size, int mask) {
+  // Round the ring size up to a power of two so indexing is a mask.
+  unsigned sz = 1;
+  while (sz < ring_size) sz <<= 1;
+
+  batch_rings.assign(n_cpus, batch_ring());
+  for (unsigned i = 0; i < n_cpus; i++) batch_rings[i].buf.resize(sz);
+  batch_events = mask;
+
+  // Route the selected event types through OSDomain's own callbacks.
+  if (mask & BATCH_INST) set_inst_cb(tramp->inst);
+  if (mask & BATCH_MEM)  set_mem_cb (tramp->mem );
+  if (mask & BATCH_INT)  set_int_cb (tramp->intr);
+  if (mask & BATCH_REG)  set_reg_cb (tramp->reg );
+}
+
+void Qsim::OSDomain::disable_batching() {
+  for (unsigned i = 0; i < batch_rings.size(); i++) flush_batch(i);
+  batch_events = 0;
+  batch_rings.clear();
+}
+
+unsigned Qsim::OSDomain::pull_batch(uint16_t i, BatchItem *out, unsigned n) {
+  if (i >= batch_rings.size()) return 0;
+
+  batch_ring &r(batch_rings[i]);
+  uint64_t mask = r.buf.size() - 1;
+  unsigned count = 0;
+
+  while (count < n && r.tail != r.head) {
+    // Copy the largest contiguous run available.
+    unsigned idx = r.tail & mask;
+    unsigned run = r.buf.size() - idx;
+    if (run > r.head - r.tail) run = r.head - r.tail;
+    if (run > n - count) run = n - count;
+    memcpy(out + count, &r.buf[idx], run * sizeof(BatchItem));
+    count  += run;
+    r.tail += run;
+  }
+
+  return count;
+}
+
+void Qsim::OSDomain::flush_batch(uint16_t i) {
+  if (i >= batch_rings.size()) return;
+
+  batch_ring &r(batch_rings[i]);
+  uint64_t mask = r.buf.size() - 1;
+
+  // The ring may wrap, so deliver it in at most two contiguous pieces.
+  while (r.tail != r.head) {
+    unsigned idx = r.tail & mask;
+    unsigned run = r.buf.size() - idx;
+    if (run > r.head - r.tail) run = r.head - r.tail;
+
+    const std::vector<batch_cb_fn> &batch_list(batch_cbs.get());
+    std::vector<batch_cb_fn>::const_iterator j;
+    for (j = batch_list.begin(); j != batch_list.end(); ++j)
+      (*j)(i, &r.buf[idx], run);
+
+    r.tail += run;
+  }
 }
 
-int Qsim::OSDomain::atomic_cb_s(int cpu_id) {
-  osdomains[cpu_id >> 16]->atomic_cb(cpu_id & 0xffff);
+template <unsigned D> int Qsim::OSDomain::atomic_cb_s(int cpu_id) {
+  osdomains[D]->atomic_cb(cpu_id & 0xffff);
 
   return 0;
 }
 
 int Qsim::OSDomain::atomic_cb(int cpu_id) {
-  std::vector<atomic_cb_obj_base*>::iterator i;
+  const std::vector<atomic_cb_fn> &atomic_list(atomic_cbs.get());
+  std::vector<atomic_cb_fn>::const_iterator i;
 
   int rval = 0;
 
+  prof_cpu *pc = prof_sample(cpu_id, PROF_ATOMIC);
+  uint64_t t0 = prof_start(pc);
+
   // Logical OR the output of all the registered callbacks. If at least one
   // demands we stop, we must stop.
-  for (i = atomic_cbs.begin(); i != atomic_cbs.end(); ++i) {
-    if ( (**i)(cpu_id) ) rval = 1;
+  for (i = atomic_list.begin(); i != atomic_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    if ( (*i)(cpu_id) ) rval = 1;
+    prof_cb(pc, PROF_ATOMIC, *i, t);
   }
 
+  prof_done(pc, PROF_ATOMIC, t0);
+
   return rval;
 }
 
-void Qsim::OSDomain::inst_cb_s(int cpu_id, uint64_t va, uint64_t pa,
-                               uint8_t l, const uint8_t *bytes,
-                               enum inst_type type)
+template <unsigned D>
+  void Qsim::OSDomain::inst_cb_s(int cpu_id, uint64_t va, uint64_t pa,
+                                 uint8_t l, const uint8_t *bytes,
+                                 enum inst_type type)
 {
-  osdomains[cpu_id >> 16]->inst_cb(cpu_id & 0xffff, va, pa, l, bytes, type);
+  osdomains[D]->inst_cb(cpu_id & 0xffff, va, pa, l, bytes, type);
 }
 
 void Qsim::OSDomain::inst_cb(int cpu_id, uint64_t va, uint64_t pa, 
                              uint8_t l, const uint8_t *bytes, 
                              enum inst_type type)
 {
-  std::vector<inst_cb_obj_base*>::iterator i;
+  const std::vector<inst_cb_fn> &inst_list(inst_cbs.get());
+  std::vector<inst_cb_fn>::const_iterator i;
+
+  note_inst(cpu_id, va, bytes, l);
+
+  // The previous instruction is complete.
+  if (deps[cpu_id].open) dep_flush(cpu_id);
+
+  if (roi_drop(cpu_id)) return;
+
+  if (dep_wanted(cpu_id)) dep_begin(cpu_id, va, pa, l, type);
 
-  // Just iterate through the callbacks and call them all.
-  for (i = inst_cbs.begin(); i != inst_cbs.end(); ++i)
-    (**i)(cpu_id, va, pa, l, bytes, type);
+  prof_cpu *pc = prof_sample(cpu_id, PROF_INST);
+  uint64_t t0 = prof_start(pc);
+
+  if (batch_events & BATCH_INST) {
+    if (BatchItem *b = batch_slot(cpu_id)) {
+      b->cb_type = BatchItem::INST;
+      b->size = l; b->type = type; b->data = 0;
+      b->vaddr = va; b->paddr = pa;
+    }
+  }
+
+  // Just iterate through the callbacks and call them all, domain-wide ones
+  // first.
+  for (i = inst_list.begin(); i != inst_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    (*i)(cpu_id, va, pa, l, bytes, type);
+    prof_cb(pc, PROF_INST, *i, t);
+  }
+
+  const std::vector<filtered_cb<inst_cb_fn> > &flt_list(inst_flt_cbs.get());
+  std::vector<filtered_cb<inst_cb_fn> >::const_iterator j;
+  for (j = flt_list.begin(); j != flt_list.end(); ++j) {
+    if (j->filt->match_inst(type) && j->filt->match_addr(va, pa) &&
+        filt_ctx(*j->filt, cpu_id)) {
+      uint64_t t = prof_start(pc);
+      j->cb(cpu_id, va, pa, l, bytes, type);
+      prof_cb(pc, PROF_INST, j->cb, t);
+    }
+  }
+
+  const std::vector<inst_cb_fn> &cpu_list(cpu_cbs[cpu_id].inst.get());
+  for (i = cpu_list.begin(); i != cpu_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    (*i)(cpu_id, va, pa, l, bytes, type);
+    prof_cb(pc, PROF_INST, *i, t);
+  }
+
+  prof_done(pc, PROF_INST, t0);
 }
 
-void Qsim::OSDomain::mem_cb_s(int cpu_id, uint64_t va, uint64_t pa,
-                             uint8_t s, int type)
+template <unsigned D>
+  void Qsim::OSDomain::mem_cb_s(int cpu_id, uint64_t va, uint64_t pa,
+                                uint8_t s, int type)
 {
-  osdomains[cpu_id >> 16]->mem_cb(cpu_id & 0xffff, va, pa, s, type);
+  osdomains[D]->mem_cb(cpu_id & 0xffff, va, pa, s, type);
 }
 
 void Qsim::OSDomain::mem_cb(int cpu_id, uint64_t va, uint64_t pa,
 			   uint8_t s, int type) {
-  std::vector<mem_cb_obj_base*>::iterator i;
+  const std::vector<mem_cb_fn> &mem_list(mem_cbs.get());
+  std::vector<mem_cb_fn>::const_iterator i;
+
+  if (roi_drop(cpu_id)) return;
+
+  prof_cpu *pc = prof_sample(cpu_id, PROF_MEM);
+  uint64_t t0 = prof_start(pc);
+
+  if (batch_events & BATCH_MEM) {
+    if (BatchItem *b = batch_slot(cpu_id)) {
+      b->cb_type = BatchItem::MEM;
+      b->size = s; b->type = type; b->data = 0;
+      b->vaddr = va; b->paddr = pa;
+    }
+  }
+
+  for (i = mem_list.begin(); i != mem_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    (*i)(cpu_id, va, pa, s, type);
+    prof_cb(pc, PROF_MEM, *i, t);
+  }
+
+  const std::vector<filtered_cb<mem_cb_fn> > &flt_list(mem_flt_cbs.get());
+  std::vector<filtered_cb<mem_cb_fn> >::const_iterator f;
+  for (f = flt_list.begin(); f != flt_list.end(); ++f) {
+    if (f->filt->match_addr(va, pa) && filt_ctx(*f->filt, cpu_id)) {
+      uint64_t t = prof_start(pc);
+      f->cb(cpu_id, va, pa, s, type);
+      prof_cb(pc, PROF_MEM, f->cb, t);
+    }
+  }
+
+  const std::vector<mem_cb_fn> &cpu_list(cpu_cbs[cpu_id].mem.get());
+  for (i = cpu_list.begin(); i != cpu_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    (*i)(cpu_id, va, pa, s, type);
+    prof_cb(pc, PROF_MEM, *i, t);
+  }
+
+  const std::vector<mem_ex_cb_fn> &mem_ex_list(mem_ex_cbs.get());
+  const std::vector<mem_ex_cb_fn> &cpu_ex_list(cpu_cbs[cpu_id].mem_ex.get());
+  const std::vector<filtered_cb<mem_ex_cb_fn> >
+    &flt_ex_list(mem_ex_flt_cbs.get());
+  if (!mem_ex_list.empty() || !cpu_ex_list.empty() || !flt_ex_list.empty()) {
+    mem_access a;
+    a.vaddr = va; a.paddr = pa; a.pc = ctx[cpu_id].pc;
+    a.size = s; a.type = type;
+    a.prot = get_prot(cpu_id); a.tid = get_tid(cpu_id);
+
+    std::vector<mem_ex_cb_fn>::const_iterator j;
+    for (j = mem_ex_list.begin(); j != mem_ex_list.end(); ++j) {
+      uint64_t t = prof_start(pc);
+      (*j)(cpu_id, a);
+      prof_cb(pc, PROF_MEM, *j, t);
+    }
+
+    std::vector<filtered_cb<mem_ex_cb_fn> >::const_iterator k;
+    for (k = flt_ex_list.begin(); k != flt_ex_list.end(); ++k) {
+      if (k->filt->match_addr(va, pa) && k->filt->match_prot(a.prot) &&
+          k->filt->match_tid(a.tid)) {
+        uint64_t t = prof_start(pc);
+        k->cb(cpu_id, a);
+        prof_cb(pc, PROF_MEM, k->cb, t);
+      }
+    }
 
-  for (i = mem_cbs.begin(); i != mem_cbs.end(); ++i)
-    (**i)(cpu_id, va, pa, s, type);
+    for (j = cpu_ex_list.begin(); j != cpu_ex_list.end(); ++j) {
+      uint64_t t = prof_start(pc);
+      (*j)(cpu_id, a);
+      prof_cb(pc, PROF_MEM, *j, t);
+    }
+  }
+
+  prof_done(pc, PROF_MEM, t0);
 }
 
-uint32_t *Qsim::OSDomain::io_cb_s(int cpu_id, uint64_t port, uint8_t s,
-                                  int type, uint32_t data)
+template <unsigned D>
+  uint32_t *Qsim::OSDomain::io_cb_s(int cpu_id, uint64_t port, uint8_t s,
+                                    int type, uint32_t data)
 {
-  return osdomains[cpu_id >> 16]->io_cb(cpu_id & 0xffff, port, s, type, data);
+  return osdomains[D]->io_cb(cpu_id & 0xffff, port, s, type, data);
 }
 
 uint32_t *Qsim::OSDomain::io_cb(int cpu_id, uint64_t port, uint8_t s, 
 			  int type, uint32_t data) {
-  std::vector<io_cb_obj_base*>::iterator i;
+  const std::vector<io_cb_fn> &io_list(io_cbs.get());
+  std::vector<io_cb_fn>::const_iterator i;
+
+  // A replay hands QEMU the recorded value.
+  uint32_t *rval = rr ? rr_io(cpu_id, port, s, type, data) : NULL;
+  if (rval) data = *rval;
+
+  prof_cpu *pc = prof_sample(cpu_id, PROF_IO);
+  uint64_t t0 = prof_start(pc);
 
-  for (i = io_cbs.begin(); i != io_cbs.end(); ++i) {
-    (**i)(cpu_id, port, s, type, data);
+  for (i = io_list.begin(); i != io_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    (*i)(cpu_id, port, s, type, data);
+    prof_cb(pc, PROF_IO, *i, t);
   }
 
-  return 0;
+  prof_done(pc, PROF_IO, t0);
+
+  return rval;
 }
 
-int Qsim::OSDomain::int_cb_s(int cpu_id, uint8_t vec) {
-  return osdomains[cpu_id >> 16]->int_cb(cpu_id & 0xffff, vec);
+template <unsigned D> int Qsim::OSDomain::int_cb_s(int cpu_id, uint8_t vec) {
+  return osdomains[D]->int_cb(cpu_id & 0xffff, vec);
 }
 
 int Qsim::OSDomain::int_cb(int cpu_id, uint8_t vec) {
-  std::vector<int_cb_obj_base*>::iterator i;
+  const std::vector<int_cb_fn> &int_list(int_cbs.get());
+  std::vector<int_cb_fn>::const_iterator i;
 
   int rval = 0;
 
+  note_int(cpu_id);
+
+  if (deps[cpu_id].open) dep_flush(cpu_id);
+
+  prof_cpu *pc = prof_sample(cpu_id, PROF_INT);
+  uint64_t t0 = prof_start(pc);
+
+  if (batch_events & BATCH_INT) {
+    if (BatchItem *b = batch_slot(cpu_id)) {
+      b->cb_type = BatchItem::INTR;
+      b->size = 0; b->type = 0; b->data = vec;
+      b->vaddr = b->paddr = 0;
+    }
+  }
+
   // Logical OR the output of all the registered callbacks.
-  for (i = int_cbs.begin(); i != int_cbs.end(); ++i)
-    if ((**i)(cpu_id, vec)) rval = 1;
+  for (i = int_list.begin(); i != int_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    if ((*i)(cpu_id, vec)) rval = 1;
+    prof_cb(pc, PROF_INT, *i, t);
+  }
+
+  const std::vector<filtered_cb<int_cb_fn> > &flt_list(int_flt_cbs.get());
+  std::vector<filtered_cb<int_cb_fn> >::const_iterator j;
+  for (j = flt_list.begin(); j != flt_list.end(); ++j) {
+    if (!filt_ctx(*j->filt, cpu_id)) continue;
+    uint64_t t = prof_start(pc);
+    if (j->cb(cpu_id, vec)) rval = 1;
+    prof_cb(pc, PROF_INT, j->cb, t);
+  }
+
+  const std::vector<int_cb_fn> &cpu_list(cpu_cbs[cpu_id].intr.get());
+  for (i = cpu_list.begin(); i != cpu_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    if ((*i)(cpu_id, vec)) rval = 1;
+    prof_cb(pc, PROF_INT, *i, t);
+  }
+
+  prof_done(pc, PROF_INT, t0);
 
   return rval;
 }
 
-void Qsim::OSDomain::reg_cb_s(int cpu_id, int reg, uint8_t size, int type) {
-  osdomains[cpu_id >> 16]->reg_cb(cpu_id & 0xffff, reg, size, type);
+template <unsigned D>
+  void Qsim::OSDomain::reg_cb_s(int cpu_id, int reg, uint8_t size, int type)
+{
+  osdomains[D]->reg_cb(cpu_id & 0xffff, reg, size, type);
 }
 
 void Qsim::OSDomain::reg_cb(int cpu_id, int reg, uint8_t size, int type) {
-  std::vector<reg_cb_obj_base*>::iterator i;
-  for (i = reg_cbs.begin(); i != reg_cbs.end(); ++i)
-    (**i)(cpu_id, reg, size, type);
+  const std::vector<reg_cb_fn> &reg_list(reg_cbs.get());
+  std::vector<reg_cb_fn>::const_iterator i;
+
+  if (roi_drop(cpu_id)) return;
+
+  // With only dependency callbacks registered, that is all there is to do.
+  if (deps[cpu_id].open) {
+    dep_add(cpu_id, reg, size, type);
+    if (reg_cbs.empty() && reg_flt_cbs.empty() &&
+        cpu_cbs[cpu_id].reg.empty() && !(batch_events & BATCH_REG)) return;
+  }
+
+  prof_cpu *pc = prof_sample(cpu_id, PROF_REG);
+  uint64_t t0 = prof_start(pc);
+
+  if (batch_events & BATCH_REG) {
+    if (BatchItem *b = batch_slot(cpu_id)) {
+      b->cb_type = BatchItem::REG;
+      b->size = size; b->type = type; b->data = reg;
+      b->vaddr = b->paddr = 0;
+    }
+  }
+
+  for (i = reg_list.begin(); i != reg_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    (*i)(cpu_id, reg, size, type);
+    prof_cb(pc, PROF_REG, *i, t);
+  }
+
+  const std::vector<filtered_cb<reg_cb_fn> > &flt_list(reg_flt_cbs.get());
+  std::vector<filtered_cb<reg_cb_fn> >::const_iterator j;
+  for (j = flt_list.begin(); j != flt_list.end(); ++j) {
+    if (!filt_ctx(*j->filt, cpu_id)) continue;
+    uint64_t t = prof_start(pc);
+    j->cb(cpu_id, reg, size, type);
+    prof_cb(pc, PROF_REG, j->cb, t);
+  }
+
+  const std::vector<reg_cb_fn> &cpu_list(cpu_cbs[cpu_id].reg.get());
+  for (i = cpu_list.begin(); i != cpu_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    (*i)(cpu_id, reg, size, type);
+    prof_cb(pc, PROF_REG, *i, t);
+  }
+
+  prof_done(pc, PROF_REG, t0);
 }
 
-void Qsim::OSDomain::trans_cb_s(int cpu_id) {
-  osdomains[cpu_id >> 16]->trans_cb(cpu_id & 0xffff);
+void Qsim::OSDomain::dep_begin(uint16_t i, uint64_t va, uint64_t pa,
+                               uint8_t l, enum inst_type type)
+{
+  dep_state &s(deps[i]);
+  s.open = true;
+  s.d.pc = va; s.d.paddr = pa; s.d.len = l; s.d.type = type;
+  memset(s.d.src, 0, sizeof(s.d.src));
+  memset(s.d.dst, 0, sizeof(s.d.dst));
+  s.d.fsrc = s.d.fdst = 0;
+}
+
+// Hand CPU i's finished dependency record to the dependency callbacks.
+void Qsim::OSDomain::dep_flush(uint16_t i) {
+  deps[i].open = false;
+  const reg_deps &d(deps[i].d);
+
+  prof_cpu *pc = prof_sample(i, PROF_DEP);
+  uint64_t t0 = prof_start(pc);
+
+  const std::vector<dep_cb_fn> &dep_list(dep_cbs.get());
+  std::vector<dep_cb_fn>::const_iterator j;
+  for (j = dep_list.begin(); j != dep_list.end(); ++j) {
+    uint64_t t = prof_start(pc);
+    (*j)(i, d);
+    prof_cb(pc, PROF_DEP, *j, t);
+  }
+
+  const std::vector<dep_cb_fn> &cpu_list(cpu_cbs[i].dep.get());
+  for (j = cpu_list.begin(); j != cpu_list.end(); ++j) {
+    uint64_t t = prof_start(pc);
+    (*j)(i, d);
+    prof_cb(pc, PROF_DEP, *j, t);
+  }
+
+  prof_done(pc, PROF_DEP, t0);
+}
+
+template <unsigned D> void Qsim::OSDomain::trans_cb_s(int cpu_id) {
+  osdomains[D]->trans_cb(cpu_id & 0xffff);
 }
 
 void Qsim::OSDomain::trans_cb(int cpu_id) {
   cpu_id &= 0xffff;
 
-  std::vector<trans_cb_obj_base*>::iterator i;
-  for (i = trans_cbs.begin(); i != trans_cbs.end(); ++i)
-    (**i)(cpu_id);
+  prof_cpu *pc = prof_sample(cpu_id, PROF_TRANS);
+  uint64_t t0 = prof_start(pc);
+
+  const std::vector<trans_cb_fn> &trans_list(trans_cbs.get());
+  std::vector<trans_cb_fn>::const_iterator i;
+  for (i = trans_list.begin(); i != trans_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    (*i)(cpu_id);
+    prof_cb(pc, PROF_TRANS, *i, t);
+  }
+
+  prof_done(pc, PROF_TRANS, t0);
 }
 
-int Qsim::OSDomain::magic_cb_s(int cpu_id, uint64_t rax) {
-  return osdomains[cpu_id >> 16]->magic_cb(cpu_id & 0xffff, rax);
+template <unsigned D>
+  int Qsim::OSDomain::magic_cb_s(int cpu_id, uint64_t rax)
+{
+  return osdomains[D]->magic_cb(cpu_id & 0xffff, rax);
 }
 
 int Qsim::OSDomain::magic_cb(int cpu_id, uint64_t rax) {
   int rval = 0;
 
   // Start by calling other registered magic instruction callbacks. 
-  std::vector<magic_cb_obj_base*>::iterator i;
- 
-  for (i = magic_cbs.begin(); i != magic_cbs.end(); ++i)
-    if ((**i)(cpu_id, rax)) rval = 1;
+  const std::vector<magic_cb_fn> &magic_list(magic_cbs.get());
+  std::vector<magic_cb_fn>::const_iterator i;
+
+  prof_cpu *pc = prof_sample(cpu_id, PROF_MAGIC);
+  uint64_t t0 = prof_start(pc);
+
+  for (i = magic_list.begin(); i != magic_list.end(); ++i) {
+    uint64_t t = prof_start(pc);
+    if ((*i)(cpu_id, rax)) rval = 1;
+    prof_cb(pc, PROF_MAGIC, *i, t);
+  }
+
+  prof_done(pc, PROF_MAGIC, t0);
 
   // If this is a "CD Ignore" magic instruction, ignore it.
   if ((rax&0xffff0000) == 0xcd160000) return rval;
@@ -769,10 +2062,21 @@ int Qsim::OSDomain::magic_cb(int cpu_id, uint64_t rax) {
   } else if ( (rax & 0xffffffff) == 0x1d1e1d1e ) {
     // This CPU is now in the idle loop.
     idlevec[cpu_id] = true;
+    parked[cpu_id].parked.store(true, std::memory_order_release);
+    if (skipping()) rval = 1;
   } else if ( (rax & 0xffff0000) == 0xc75c0000 ) {
     // Context switch
     idlevec[cpu_id] = false;
+    parked[cpu_id].parked.store(false, std::memory_order_release);
     tids[cpu_id] = rax & 0xffff;
+    ctx[cpu_id].valid = false;
+    if (roi_gating) roi_update(cpu_id);
+  } else if ( (rax & 0xffff0000) == 0xb10c0000 ) {
+    // Region of interest begin
+    roi_mark(cpu_id, rax & 0xffff, true);
+  } else if ( (rax & 0xffff0000) == 0xe10c0000 ) {
+    // Region of interest end
+    roi_mark(cpu_id, rax & 0xffff, false);
   } else if ( (rax & 0xffff0000) == 0xb0070000 ) {
     // CPU bootstrap
     running[rax&0xffff] = true;
@@ -780,7 +2084,7 @@ int Qsim::OSDomain::magic_cb(int cpu_id, uint64_t rax) {
     // Inter-processor interrupt
     uint16_t cpu = (rax & 0x00ffff00)>>8;
     uint8_t  vec = (rax & 0x000000ff);
-    rval = cpus[cpu]->interrupt(vec);
+    rval = post_int(cpu, vec);
   } else if ( (rax & 0xffffffff) == 0xc7c7c7c7 ) {
     // CPU count request
     cpus[cpu_id]->set_reg(cpu_id, QSIM_X86_RAX, (uint64_t)n_cpus);
@@ -789,16 +2093,18 @@ int Qsim::OSDomain::magic_cb(int cpu_id, uint64_t rax) {
     //cpus[cpu_id]->set_reg(QSIM_RAX, ram_size_mb);
   } else if ( (rax & 0xffffffff) == 0xaaaaaaaa ) {
     // Application start marker.
-    std::vector<start_cb_obj_base*>::iterator i;
-    for (i = start_cbs.begin(); i != start_cbs.end(); ++i) {
-      if ((**i)(cpu_id)) rval = 1;
+    const std::vector<start_cb_fn> &start_list(start_cbs.get());
+    std::vector<start_cb_fn>::const_iterator i;
+    for (i = start_list.begin(); i != start_list.end(); ++i) {
+      if ((*i)(cpu_id)) rval = 1;
     }
 
   } else if ( (rax & 0xffffffff) == 0xfa11dead ) {
     // Shutdown/application end marker.
-    std::vector<end_cb_obj_base*>::iterator i;
-    for (i = end_cbs.begin(); i != end_cbs.end(); ++i) {
-      if ((**i)(cpu_id)) rval = 1;
+    const std::vector<end_cb_fn> &end_list(end_cbs.get());
+    std::vector<end_cb_fn>::const_iterator i;
+    for (i = end_list.begin(); i != end_list.end(); ++i) {
+      if ((*i)(cpu_id)) rval = 1;
     }
     if (mode == QSIM_HEADLESS) {
       for (unsigned i = 0; i < n_cpus; i++) running[i] = false;
@@ -815,34 +2121,40 @@ int Qsim::OSDomain::magic_cb(int cpu_id, uint64_t rax) {
 
 void Qsim::OSDomain::lock_addr(uint64_t pa) {}
 void Qsim::OSDomain::unlock_addr(uint64_t pa) {}
-std::vector<Queue*> *Qsim::Queue::queues;
-
-Qsim::Queue::Queue(OSDomain &cd, int cpu, bool h): cd(&cd), cpu(cpu), hlt(h) {
-  // Create a way for the callbacks to find us.
-  if (queues == NULL)
-    queues = new vector<Queue*>(cd.get_n());
-  (*queues)[cpu] = this;
+Qsim::Queue::Queue(OSDomain &cd, int cpu, bool h):
+  cd(&cd), cpu(cpu), hlt(h), flt_tid(-1), flt_krnl(true), flt_user(true),
+  flt_prot(true), flt_real(true), icb_handle(NULL), mcb_handle(NULL),
+  intcb_handle(NULL)
+{
   // Connect the callbacks
-  cd.set_inst_cb(cpu, h?inst_cb_hlt:inst_cb);
-  cd.set_mem_cb (cpu, mem_cb               );
-  cd.set_int_cb (cpu, int_cb               );
+  connect(false);
 }
 
 Qsim::Queue::~Queue() {
   // Disconnect the callbacks
-  cd->set_inst_cb(cpu, NULL);
-  cd->set_mem_cb (cpu, NULL);
-  cd->set_int_cb (cpu, NULL);
+  disconnect();
+}
 
-  // Remove this queue from the vector.
-  (*queues)[cpu] = NULL;
+void Qsim::Queue::connect(bool filtered) {
+  disconnect();
 
-  // If there are no queues left, delete queues.
-  bool queues_all_null = true;
-  for (int i = 0; i < cd->get_n(); i++) {
-    if ((*queues)[i]) queues_all_null = false;
+  if (filtered) {
+    icb_handle   = cd->set_inst_cb<Queue, &Queue::inst_cb_flt>(cpu, this);
+    mcb_handle   = cd->set_mem_cb <Queue, &Queue::mem_cb_flt >(cpu, this);
+    intcb_handle = cd->set_int_cb <Queue, &Queue::int_cb_flt >(cpu, this);
+  } else {
+    icb_handle = hlt ? cd->set_inst_cb<Queue, &Queue::inst_cb_hlt>(cpu, this)
+                     : cd->set_inst_cb<Queue, &Queue::inst_cb    >(cpu, this);
+    mcb_handle   = cd->set_mem_cb <Queue, &Queue::mem_cb>(cpu, this);
+    intcb_handle = cd->set_int_cb <Queue, &Queue::int_cb>(cpu, this);
   }
-  if (queues_all_null) delete queues;
+}
+
+void Qsim::Queue::disconnect() {
+  if (icb_handle)   cd->unset_inst_cb(cpu, icb_handle);
+  if (mcb_handle)   cd->unset_mem_cb (cpu, mcb_handle);
+  if (intcb_handle) cd->unset_int_cb (cpu, intcb_handle);
+  icb_handle = NULL; mcb_handle = NULL; intcb_handle = NULL;
 }
 
 void Qsim::Queue::set_filt(bool user, bool krnl, bool prot,
@@ -856,17 +2168,17 @@ void Qsim::Queue::set_filt(bool user, bool krnl, bool prot,
   flt_user = user;
 
   // Set callbacks appropriately
-  if (flt_krnl && flt_prot && flt_real && flt_user && flt_tid == -1) {
-    cd->set_inst_cb(cpu, hlt?inst_cb_hlt:inst_cb);
-    cd->set_mem_cb (cpu, mem_cb                 );
-    cd->set_int_cb (cpu, int_cb                 );
-  } else {
-    cd->set_inst_cb(cpu, inst_cb_flt            );
-    cd->set_mem_cb (cpu, mem_cb_flt             );
-    cd->set_int_cb (cpu, int_cb_flt             );
-  }
+  connect(!(flt_krnl && flt_prot && flt_real && flt_user && flt_tid == -1));
 }
 
+// Whether the current state of our CPU passes the filter.
+bool Qsim::Queue::pass() {
+  return (flt_tid == -1 || cd->get_tid (cpu) == flt_tid           ) && (
+           (flt_krnl    && cd->get_prot(cpu) == OSDomain::PROT_KERN) ||
+           (flt_user    && cd->get_prot(cpu) == OSDomain::PROT_USER) ||
+           (flt_prot    && cd->get_mode(cpu) == OSDomain::MODE_PROT) ||
+           (flt_real    && cd->get_mode(cpu) == OSDomain::MODE_REAL));
+}
 
 void Qsim::Queue::inst_cb(int cpu_id,
                           uint64_t vaddr,
@@ -875,7 +2187,7 @@ void Qsim::Queue::inst_cb(int cpu_id,
                           const uint8_t *bytes,
                           enum inst_type type)
 {
-  (*queues)[cpu_id]->push(QueueItem(cpu_id, vaddr, paddr, len, bytes, type));
+  push(QueueItem(cpu_id, vaddr, paddr, len, bytes, type));
 }
 
 void Qsim::Queue::inst_cb_hlt(int cpu_id,
@@ -885,8 +2197,8 @@ void Qsim::Queue::inst_cb_hlt(int cpu_id,
                               const uint8_t *bytes,
                               enum inst_type type)
 {
-  if (len == 1 && *bytes == 0xf4) (*queues)[cpu_id]->cd->timer_interrupt();
-  (*queues)[cpu_id]->push(QueueItem(cpu_id, vaddr, paddr, len, bytes, type));
+  if (len == 1 && *bytes == 0xf4) cd->timer_interrupt();
+  push(QueueItem(cpu_id, vaddr, paddr, len, bytes, type));
 }
 
 void Qsim::Queue::inst_cb_flt(int cpu_id,
@@ -896,21 +2208,8 @@ void Qsim::Queue::inst_cb_flt(int cpu_id,
                               const uint8_t *bytes,
                               enum inst_type type)
 {
-  Queue   *q        = (*queues)[cpu_id];
-  OSDomain *cd       = q->cd      ;
-  int      cpu      = q->cpu     ;
-  int      flt_tid  = q->flt_tid ;
-  bool     flt_krnl = q->flt_krnl;
-  bool     flt_user = q->flt_user;
-  bool     flt_prot = q->flt_prot;
-  bool     flt_real = q->flt_real;
-  if ( (flt_tid == -1 || cd->get_tid (cpu) == flt_tid           ) && (
-         (flt_krnl      && cd->get_prot(cpu) == OSDomain::PROT_KERN) ||
-         (flt_user      && cd->get_prot(cpu) == OSDomain::PROT_USER) ||
-         (flt_prot      && cd->get_mode(cpu) == OSDomain::MODE_PROT) ||
-         (flt_real      && cd->get_mode(cpu) == OSDomain::MODE_REAL)))
-    (*queues)[cpu_id]->push(QueueItem(cpu_id, vaddr, paddr, len, bytes, type));
-  if (q->hlt && len == 1 && *bytes == 0xf4) cd->timer_interrupt();
+  if (pass()) push(QueueItem(cpu_id, vaddr, paddr, len, bytes, type));
+  if (hlt && len == 1 && *bytes == 0xf4) cd->timer_interrupt();
 }
 
 void Qsim::Queue::mem_cb(int cpu_id,
@@ -919,7 +2218,7 @@ void Qsim::Queue::mem_cb(int cpu_id,
                          uint8_t size,
                          int type)
 {
-  (*queues)[cpu_id]->push(QueueItem(cpu_id, vaddr, paddr, size, type));
+  push(QueueItem(cpu_id, vaddr, paddr, size, type));
 }
 
 void Qsim::Queue::mem_cb_flt(int cpu_id,
@@ -928,43 +2227,17 @@ void Qsim::Queue::mem_cb_flt(int cpu_id,
                              uint8_t size,
                              int type)
 {
-  Queue   *q        = (*queues)[cpu_id];
-  OSDomain *cd       = q->cd      ;
-  int      cpu      = q->cpu     ;
-  int      flt_tid  = q->flt_tid ;
-  bool     flt_krnl = q->flt_krnl;
-  bool     flt_user = q->flt_user;
-  bool     flt_prot = q->flt_prot;
-  bool     flt_real = q->flt_real;
-  if ( (flt_tid == -1 || cd->get_tid (cpu) == flt_tid           ) && (
-         (flt_krnl      && cd->get_prot(cpu) == OSDomain::PROT_KERN) ||
-         (flt_user      && cd->get_prot(cpu) == OSDomain::PROT_USER) ||
-         (flt_prot      && cd->get_mode(cpu) == OSDomain::MODE_PROT) ||
-	 (flt_real      && cd->get_mode(cpu) == OSDomain::MODE_REAL)))
-    (*queues)[cpu_id]->push(QueueItem(cpu_id, vaddr, paddr, size, type));
+  if (pass()) push(QueueItem(cpu_id, vaddr, paddr, size, type));
 }
 
 int Qsim::Queue::int_cb(int cpu_id, uint8_t vec)
 {
-  (*queues)[cpu_id]->push(QueueItem(cpu_id, vec));
+  push(QueueItem(cpu_id, vec));
   return 0;
 }
 
 int Qsim::Queue::int_cb_flt(int cpu_id, uint8_t vec)
 {
-  Queue   *q        = (*queues)[cpu_id];
-  OSDomain *cd       = q->cd      ;
-  int      cpu      = q->cpu     ;
-  int      flt_tid  = q->flt_tid ;
-  bool     flt_krnl = q->flt_krnl;
-  bool     flt_user = q->flt_user;
-  bool     flt_prot = q->flt_prot;
-  bool     flt_real = q->flt_real;
-  if ( (flt_tid == -1 || cd->get_tid (cpu) == flt_tid           ) && (
-         (flt_krnl      && cd->get_prot(cpu) == OSDomain::PROT_KERN) ||
-         (flt_user      && cd->get_prot(cpu) == OSDomain::PROT_USER) ||
-         (flt_prot      && cd->get_mode(cpu) == OSDomain::MODE_PROT) ||
-         (flt_real      && cd->get_mode(cpu) == OSDomain::MODE_REAL)))
-    (*queues)[cpu_id]->push(QueueItem(cpu_id, vec));
+  if (pass()) push(QueueItem(cpu_id, vec));
   return 0;
 }
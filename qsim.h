@@ -9,10 +9,16 @@
 * COPYING file in the top-level directory.                                    *
 \*****************************************************************************/
 #include <map>
+#include <unordered_map>
+#include <algorithm>
 #include <vector>
 #include <sstream>
 #include <string>
 #include <queue>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <type_traits>
 #include <stdint.h>
 #include <string.h>
 
@@ -83,6 +89,270 @@ namespace Qsim {
     int id;
   };
 
+  // Compact, fixed-size event record filled by OSDomain's batched callback
+  // mode. Instruction bytes are not carried; consumers that need them should
+  // use the per-event instruction callback.
+  struct BatchItem {
+    enum {INST, MEM, INTR, REG};
+
+    uint8_t  cb_type; // One of INST, MEM, INTR, REG
+    uint8_t  size;    // Instruction length, access size or register size
+    uint16_t type;    // inst_type, access type (1 = write), or flag mask
+    uint32_t data;    // Interrupt vector or register index
+    uint64_t vaddr;
+    uint64_t paddr;
+  };
+
+  // A callback as a plain function (the thunk) plus the object it is called
+  // on. Dispatching one is a single indirect call, with no virtual call or
+  // member-function-pointer indirection. For handlers bound at compile time
+  // (bind<T, &T::f>) the member call is inlined into the thunk; handlers only
+  // known at run time are wrapped in a heap-allocated member, which del frees.
+  template <typename R, typename... A> struct Callback {
+    typedef R (*thunk_t)(void*, A...);
+    typedef R (*fn_t)(A...);
+
+    // method<T>::type is a pointer to a handler in T. It is only defined for
+    // class types, so overloads taking one drop out for function pointers.
+    template <typename T, bool = std::is_class<T>::value> struct method {};
+    template <typename T> struct method<T, true> {
+      typedef R (T::*type)(A...);
+    };
+
+    template <typename T> struct member {
+      typedef typename method<T>::type fn_t;
+      member(T* p, fn_t f): p(p), f(f) {}
+      T* p; fn_t f;
+    };
+
+    Callback(thunk_t t, void *o, void (*d)(void*) = NULL):
+      thunk(t), obj(o), del(d) {}
+
+    R operator()(A... a) const { return thunk(obj, a...); }
+
+    // Free the state owned by this callback, if any.
+    void release() const { if (del) del(obj); }
+
+    template <typename T, typename method<T>::type F>
+      static Callback bind(T* p) { return Callback(call_bound<T, F>, p); }
+
+    template <typename T>
+      static Callback bind(T* p, typename method<T>::type f)
+    {
+      return Callback(call_member<T>, new member<T>(p, f), del_member<T>);
+    }
+
+    static Callback bind(fn_t f) {
+      return Callback(call_fn, new fn_t(f), del_fn);
+    }
+
+    thunk_t thunk;
+    void *obj;
+    void (*del)(void*);
+
+  private:
+    template <typename T, typename method<T>::type F>
+      static R call_bound(void *o, A... a)
+    {
+      return (static_cast<T*>(o)->*F)(a...);
+    }
+
+    template <typename T> static R call_member(void *o, A... a) {
+      member<T> *m = static_cast<member<T>*>(o);
+      return ((m->p)->*(m->f))(a...);
+    }
+
+    template <typename T> static void del_member(void *o) {
+      delete static_cast<member<T>*>(o);
+    }
+
+    static R call_fn(void *o, A... a) { return (*static_cast<fn_t*>(o))(a...); }
+    static void del_fn(void *o) { delete static_cast<fn_t*>(o); }
+  };
+
+  // Epoch-based reclamation for data shared with dispatching threads. Each
+  // reader (in OSDomain, one per CPU) marks the span in which it may hold
+  // references with enter()/exit(); this costs one store each and never
+  // blocks. Writers serialize on lock, retire() what they unlinked, and the
+  // memory is freed by a later reclaim() once every reader that could still
+  // see it has left its read section. synchronize() waits for that to happen
+  // to everything unlinked so far, for writers that must know no reader is
+  // still using what they removed.
+  class Epoch {
+  public:
+    Epoch(): global(1), slots(NULL), n_slots(0) {}
+    ~Epoch() { reclaim(true); delete[] slots; }
+
+    void set_readers(unsigned n) {
+      delete[] slots;
+      slots = new slot[n];
+      n_slots = n;
+    }
+
+    void enter(unsigned r) {
+      slots[r].owner.store(std::this_thread::get_id(),
+                           std::memory_order_relaxed);
+      slots[r].active.store(global.load(std::memory_order_seq_cst),
+                            std::memory_order_seq_cst);
+    }
+
+    void exit(unsigned r) {
+      slots[r].active.store(0, std::memory_order_release);
+    }
+
+    // Writer side; lock must be held.
+    void retire(void (*f)(void*), void *p) {
+      retired.push_back(garbage(global.fetch_add(1), f, p));
+    }
+
+    // Wait until every reader that entered before the call has exited.
+    // Read sections held by the calling thread are skipped, so a callback
+    // may remove itself (or others) without deadlocking; it must then not
+    // touch the removed objects after it returns. Lock must not be held.
+    void synchronize() {
+      uint64_t e = global.fetch_add(1, std::memory_order_seq_cst) + 1;
+      std::thread::id self = std::this_thread::get_id();
+      for (unsigned i = 0; i < n_slots; ++i) {
+        for (;;) {
+          uint64_t a = slots[i].active.load(std::memory_order_seq_cst);
+          if (!a || a >= e ||
+              slots[i].owner.load(std::memory_order_relaxed) == self) break;
+          std::this_thread::yield();
+        }
+      }
+    }
+
+    void reclaim(bool all = false) {
+      uint64_t oldest = 0;
+      for (unsigned i = 0; i < n_slots; ++i) {
+        uint64_t a = slots[i].active.load(std::memory_order_seq_cst);
+        if (a && (!oldest || a < oldest)) oldest = a;
+      }
+
+      std::vector<garbage>::iterator g = retired.begin();
+      while (g != retired.end()) {
+        if (all || !oldest || g->epoch < oldest) {
+          g->f(g->p);
+          g = retired.erase(g);
+        } else {
+          ++g;
+        }
+      }
+    }
+
+    std::mutex lock;
+
+  private:
+    struct slot {
+      slot(): active(0), owner(std::thread::id()) {}
+      std::atomic<uint64_t> active;   // Epoch at enter(), or 0 when outside
+      std::atomic<std::thread::id> owner;   // Thread of the last enter()
+      unsigned char pad[64 - sizeof(uint64_t) - sizeof(std::thread::id)];
+    };
+
+    struct garbage {
+      garbage(uint64_t e, void (*f)(void*), void *p): epoch(e), f(f), p(p) {}
+      uint64_t epoch;
+      void (*f)(void*);
+      void *p;
+    };
+
+    std::atomic<uint64_t> global;
+    slot *slots;
+    unsigned n_slots;
+    std::vector<garbage> retired;
+  };
+
+  // Handle to an entry of a CallbackList. Lists with different tags K hand
+  // out handles of different types, so that a handle cannot be passed to the
+  // unset function of the wrong kind of list. A default handle is null.
+  template <typename C, typename K> class CallbackHandle {
+  public:
+    CallbackHandle(const C *p = NULL): p(p) {}
+    explicit operator bool() const { return p != NULL; }
+
+  private:
+    const C *p;
+    template <typename, typename> friend class CallbackList;
+  };
+
+  // Copy-on-write list of callbacks. Readers iterate the current snapshot
+  // from get() without locking; add() and remove() build a new snapshot,
+  // publish it and retire the old one through an Epoch. Handles point to the
+  // registered entry and stay valid until that entry is removed. remove()
+  // returns once no other thread can still be calling the removed entry, so
+  // its object may be destroyed right away.
+  template <typename C, typename K = void> class CallbackList {
+  public:
+    typedef CallbackHandle<C, K> handle_t;
+
+    CallbackList(): cur(new snapshot) {}
+
+    ~CallbackList() {
+      snapshot *s = cur.load();
+      for (unsigned i = 0; i < s->ids.size(); ++i) {
+        s->ids[i]->release();
+        delete s->ids[i];
+      }
+      delete s;
+    }
+
+    const std::vector<C> &get() const {
+      return cur.load(std::memory_order_acquire)->cbs;
+    }
+
+    bool empty() const { return get().empty(); }
+
+    handle_t add(Epoch &e, const C &c) {
+      std::lock_guard<std::mutex> l(e.lock);
+      C *node = new C(c);
+      snapshot *s = new snapshot(*cur.load());
+      s->cbs.push_back(c);
+      s->ids.push_back(node);
+      publish(e, s);
+      return node;
+    }
+
+    bool remove(Epoch &e, handle_t h) {
+      {
+        std::lock_guard<std::mutex> l(e.lock);
+        snapshot *s = new snapshot(*cur.load());
+        unsigned i;
+        for (i = 0; i < s->ids.size() && s->ids[i] != h.p; ++i);
+        if (i == s->ids.size()) { delete s; return false; }
+        s->cbs.erase(s->cbs.begin() + i);
+        s->ids.erase(s->ids.begin() + i);
+        publish(e, s);
+        e.retire(del_node, const_cast<C*>(h.p));
+        e.reclaim();
+      }
+
+      e.synchronize();
+      return true;
+    }
+
+  private:
+    struct snapshot {
+      std::vector<C>        cbs;
+      std::vector<const C*> ids;  // Registered node of each entry in cbs
+    };
+
+    std::atomic<snapshot*> cur;
+
+    void publish(Epoch &e, snapshot *s) {
+      snapshot *old = cur.exchange(s, std::memory_order_seq_cst);
+      e.retire(del_snapshot, old);
+      e.reclaim();
+    }
+
+    static void del_snapshot(void *p) { delete static_cast<snapshot*>(p); }
+    static void del_node(void *p) {
+      C *c = static_cast<C*>(p);
+      c->release();
+      delete c;
+    }
+  };
+
   class Cpu {
   public:
     // Initialize with named parameter set p.
@@ -130,6 +400,7 @@ namespace Qsim {
     void (*qemu_set_sys_cbs)  (bool state);
 
     uint64_t (*qemu_get_reg) (int c, int r);
+    void     (*qemu_get_regs)(int c, const int *r, int n, uint64_t *out);
     void     (*qemu_set_reg) (int c, int r, uint64_t val );
 
     uint8_t  (*qemu_mem_rd)  (uint64_t paddr);
@@ -137,6 +408,21 @@ namespace Qsim {
     uint8_t  (*qemu_mem_rd_virt) (int c, uint64_t vaddr);
     void     (*qemu_mem_wr_virt) (int c, uint64_t vaddr, uint8_t data);
 
+    // Block transfers; NULL if the library does not export them.
+    void (*qemu_mem_rd_block)     (uint64_t paddr, void *buf, size_t len);
+    void (*qemu_mem_wr_block)     (uint64_t paddr, const void *buf,
+                                   size_t len);
+    void (*qemu_mem_rd_virt_block)(int c, uint64_t vaddr, void *buf,
+                                   size_t len);
+    void (*qemu_mem_wr_virt_block)(int c, uint64_t vaddr, const void *buf,
+                                   size_t len);
+    int  (*qemu_get_ram_regions)  (qsim_ram_region *r, int max);
+
+    // Targeted interrupt and per-CPU callback generation; NULL if the
+    // library only has the global forms.
+    int  (*qemu_interrupt_cpu)    (int c, uint8_t vec);
+    void (*qemu_set_gen_cbs_cpu)  (int c, bool state);
+
     int      (*qsim_savevm_state) (const char *filename);
     int      (*qsim_loadvm_state) (const char *filename);
 
@@ -194,6 +480,14 @@ namespace Qsim {
       qemu_set_gen_cbs(state);
     }
 
+    // Turn callback generation on or off for CPU c alone, where the library
+    // can; otherwise for all CPUs.
+    void set_gen_cbs_cpu(int c, bool state) {
+      if (qemu_set_gen_cbs_cpu) qemu_set_gen_cbs_cpu(c, state);
+      else qemu_set_gen_cbs(state);
+    }
+    bool has_gen_cbs_cpu() const { return qemu_set_gen_cbs_cpu != NULL; }
+
     virtual void set_sys_cbs(bool state) {
       qemu_set_sys_cbs(state);
     }
@@ -213,12 +507,56 @@ namespace Qsim {
       qemu_mem_wr_virt(c, va, val);
     }
 
+    // Copy len bytes between guest memory and buf in a single call into the
+    // library, if it supports it.
+    void mem_rd_block(uint64_t pa, void *buf, size_t len) {
+      if (qemu_mem_rd_block) { qemu_mem_rd_block(pa, buf, len); return; }
+      uint8_t *b = (uint8_t*)buf;
+      while (len--) *(b++) = qemu_mem_rd(pa++);
+    }
+
+    void mem_wr_block(uint64_t pa, const void *buf, size_t len) {
+      if (qemu_mem_wr_block) { qemu_mem_wr_block(pa, buf, len); return; }
+      const uint8_t *b = (const uint8_t*)buf;
+      while (len--) qemu_mem_wr(pa++, *(b++));
+    }
+
+    void mem_rd_virt_block(int c, uint64_t va, void *buf, size_t len) {
+      if (qemu_mem_rd_virt_block) {
+        qemu_mem_rd_virt_block(c, va, buf, len);
+        return;
+      }
+      uint8_t *b = (uint8_t*)buf;
+      while (len--) *(b++) = qemu_mem_rd_virt(c, va++);
+    }
+
+    void mem_wr_virt_block(int c, uint64_t va, const void *buf, size_t len) {
+      if (qemu_mem_wr_virt_block) {
+        qemu_mem_wr_virt_block(c, va, buf, len);
+        return;
+      }
+      const uint8_t *b = (const uint8_t*)buf;
+      while (len--) qemu_mem_wr_virt(c, va++, *(b++));
+    }
+
+    // Host mappings of guest RAM; returns the number of regions written to r,
+    // or 0 if the library does not provide them.
+    int get_ram_regions(qsim_ram_region *r, int max) {
+      return qemu_get_ram_regions ? qemu_get_ram_regions(r, max) : 0;
+    }
+
     virtual int  interrupt    (uint8_t   vec)   { 
       int r;
       r = qemu_interrupt(vec);
       return r;
     }
 
+    // Raise vec on CPU c, where the library can aim interrupts.
+    int interrupt_cpu(int c, uint8_t vec) {
+      if (qemu_interrupt_cpu) return qemu_interrupt_cpu(c, vec);
+      return qemu_interrupt(vec);
+    }
+
     virtual uint64_t get_reg (int c, int r)      {
       uint64_t v; 
       v = qemu_get_reg(c, r);
@@ -228,22 +566,177 @@ namespace Qsim {
     virtual void     set_reg (int c, int r, uint64_t v) {
       qemu_set_reg(c, r, v);
     }
+
+    // Several registers in one call; falls back to one get_reg per register.
+    virtual void get_regs(int c, const int *r, int n, uint64_t *out) {
+      if (qemu_get_regs) { qemu_get_regs(c, r, n, out); return; }
+      for (int i = 0; i < n; ++i) out[i] = qemu_get_reg(c, r[i]);
+    }
   };
 
+  // Snapshots of the full architectural register state of one CPU, indexed by
+  // qsim_x86_reg or qsim_arm64_reg respectively.
+  struct X86Context {
+    uint64_t reg[QSIM_X86_N_REGS];
+    uint64_t operator[](int r) const { return reg[r]; }
+  };
+
+  struct Arm64Context {
+    uint64_t reg[QSIM_ARM64_ENDING];
+    uint64_t operator[](int r) const { return reg[r]; }
+  };
 
-  // Coherence domain singleton-- encapsulates a set of CPUs and the needed 
-  // virtual hardware (of which there is little). Limit of one per process to
-  // simplify the design of the magic instruction callback. If there's a need
-  // for more OSDomains, the cpu id could be expanded to provide both a OSDomain
-  // ID and a CPU index in the upper and lower 16 bits respectively.
+
+  // Coherence domain-- encapsulates a set of CPUs and the needed virtual
+  // hardware (of which there is little). Each OSDomain runs its own private
+  // copy of the QEMU library, so up to MAX_DOMAINS of them can exist in one
+  // process, each driven from its own host thread.
   class OSDomain {
   public:
+    static const unsigned MAX_DOMAINS = 64;
+
     // CPU modes
     enum cpu_mode { MODE_REAL, MODE_PROT, MODE_LONG };
 
     // CPU protection rings
     enum cpu_prot { PROT_KERN, PROT_USER };
 
+    // Memory access as seen by the extended memory callbacks (set_mem_cb_ex).
+    struct mem_access {
+      uint64_t vaddr, paddr;
+      uint64_t pc;              // Virtual address of the issuing instruction
+      uint8_t  size;
+      int      type;            // 0 for reads, 1 for writes
+      cpu_prot prot;
+      int      tid;
+    };
+
+    // Registers used by one instruction, as seen by the dependency callbacks
+    // (set_dep_cb). Register r (enum regs) is bit r%64 of word r/64 of src
+    // if the instruction reads it and of dst if it writes it; fsrc and fdst
+    // hold the condition flags (enum flags) it reads and writes.
+    struct reg_deps {
+      static const unsigned WORDS = 5;
+      uint64_t pc, paddr;
+      uint8_t  len;
+      enum inst_type type;
+      uint64_t src[WORDS], dst[WORDS];
+      uint32_t fsrc, fdst;
+
+      bool reads(int r) const  { return (src[r/64] >> (r%64)) & 1; }
+      bool writes(int r) const { return (dst[r/64] >> (r%64)) & 1; }
+    };
+
+    // Declarative filter attached to an object callback registration. Events
+    // that fail it are dropped in the trampoline before the handler is
+    // called. Each criterion left unset matches everything; set criteria must
+    // all match. Address ranges apply to instruction and memory events and
+    // instruction types to instruction events only.
+    //   osd.set_mem_cb(Qsim::OSDomain::cb_filter().prot(PROT_USER).tid(42),
+    //                  &tracer, &Tracer::mem);
+    class cb_filter {
+    public:
+      cb_filter(): prots(0), inst_types(0) {}
+
+      cb_filter &prot(cpu_prot p) { prots |= 1 << p; return *this; }
+
+      cb_filter &tid(int t) {
+        std::vector<int>::iterator i(std::lower_bound(tids.begin(),
+                                                      tids.end(), t));
+        if (i == tids.end() || *i != t) tids.insert(i, t);
+        return *this;
+      }
+
+      // Accept accesses and instructions starting in [start, end), rounded
+      // out to whole pages.
+      cb_filter &vaddr(uint64_t start, uint64_t end) {
+        vpages.add(start, end);
+        return *this;
+      }
+
+      cb_filter &paddr(uint64_t start, uint64_t end) {
+        ppages.add(start, end);
+        return *this;
+      }
+
+      cb_filter &inst(enum inst_type t) { inst_types |= 1 << t; return *this; }
+
+      bool match_prot(cpu_prot p) const { return !prots || (prots >> p & 1); }
+
+      bool match_tid(int t) const {
+        return tids.empty() || std::binary_search(tids.begin(), tids.end(), t);
+      }
+
+      bool match_addr(uint64_t va, uint64_t pa) const {
+        return (vpages.empty() || vpages.has(va)) &&
+               (ppages.empty() || ppages.has(pa));
+      }
+
+      bool match_inst(enum inst_type t) const {
+        return !inst_types || (inst_types >> t & 1);
+      }
+
+      bool needs_prot() const { return prots; }
+      bool needs_tid()  const { return !tids.empty(); }
+
+    private:
+      // Set of 4kB pages, as sorted runs of page numbers, [first, last]
+      // inclusive. Runs that overlap or touch are merged as they are added, so
+      // both the memory used and the lookup cost depend on the number of
+      // ranges given, not on how large they are.
+      class page_set {
+      public:
+        void add(uint64_t start, uint64_t end) {
+          if (end <= start) return;
+          uint64_t first = start >> 12, last = (end - 1) >> 12;
+
+          // Absorb every run from the first that reaches the new one to the
+          // last that it reaches.
+          std::vector<run>::iterator i(ranges.begin());
+          while (i != ranges.end() && i->second + 1 < first) ++i;
+          std::vector<run>::iterator j(i);
+          for (; j != ranges.end() && j->first <= last + 1; ++j) {
+            first = std::min(first, j->first);
+            last = std::max(last, j->second);
+          }
+          ranges.insert(ranges.erase(i, j), run(first, last));
+        }
+
+        bool has(uint64_t a) const {
+          uint64_t p = a >> 12;
+          std::vector<run>::const_iterator
+            i(std::upper_bound(ranges.begin(), ranges.end(), p, starts_after));
+          return i != ranges.begin() && p <= (--i)->second;
+        }
+
+        bool empty() const { return ranges.empty(); }
+
+      private:
+        typedef std::pair<uint64_t, uint64_t> run;
+
+        static bool starts_after(uint64_t p, const run &r) {
+          return p < r.first;
+        }
+
+        std::vector<run> ranges;
+      };
+
+      unsigned prots, inst_types;
+      std::vector<int> tids;        // Sorted
+      page_set vpages, ppages;
+    };
+
+    // An object callback together with the filter it was registered with.
+    template <typename C> struct filtered_cb {
+      filtered_cb(const C &cb, const cb_filter &f):
+        cb(cb), filt(new cb_filter(f)) {}
+
+      void release() const { cb.release(); delete filt; }
+
+      C cb;
+      const cb_filter *filt;
+    };
+
     // Create a OSDomain with n CPUs, booting the kernel at the given path
     OSDomain(uint16_t n, std::string kernel_path, const std::string& cpu_type, qsim_mode mode = QSIM_HEADLESS, unsigned ram_mb = 1024);
 
@@ -255,10 +748,37 @@ namespace Qsim {
     void save_state(std::ostream &outfile);
     void save_state(const char* filename);
 
-    // Get the current mode, protection ring, or Linux task ID for CPU i
-    int           get_tid (uint16_t i);
-    enum cpu_mode get_mode(uint16_t i);
-    enum cpu_prot get_prot(uint16_t i);
+    // Get the current mode, protection ring, or Linux task ID for CPU i. Mode
+    // and ring are cached per CPU. While instructions on a CPU are being
+    // observed the cache is refreshed only after interrupts, context switches
+    // and instructions that can change privilege or mode; otherwise every
+    // read goes to QEMU.
+    int get_tid(uint16_t i) { return running[i] ? tids[i] : -1; }
+
+    enum cpu_mode get_mode(uint16_t i) {
+      if (!ctx[i].valid) refresh_ctx(i);
+      return ctx[i].mode;
+    }
+
+    enum cpu_prot get_prot(uint16_t i) {
+      if (!ctx[i].valid) refresh_ctx(i);
+      return ctx[i].prot;
+    }
+
+    // Keep the context cache informed of instructions and interrupts seen by
+    // callbacks installed directly on a CPU (the set_*_cb(i, cb) forms). The
+    // object callbacks do this already.
+    void note_inst(uint16_t i, uint64_t va, const uint8_t *bytes,
+                   uint8_t len)
+    {
+      cpu_ctx &c(ctx[i]);
+      c.pc = va;
+      c.tracking = true;
+      if (c.pending) c.valid = false;
+      c.pending = ctx_changing_inst(bytes, len);
+    }
+
+    void note_int(uint16_t i) { ctx[i].valid = false; ctx[i].pending = true; }
 
     std::string getCpuType(uint16_t i);
     
@@ -276,8 +796,41 @@ namespace Qsim {
     // Timer interrupt should come at 100Hz
     void timer_interrupt();
 
+    // Have run() raise timer interrupts by itself every insts instructions,
+    // so that their cadence no longer depends on how the caller slices its
+    // runs; 0 turns this off. With per_cpu, each running CPU is interrupted
+    // after every insts of its own instructions run through run(i, n), but
+    // until the secondary CPUs are up only CPU 0 gets the PIT. Otherwise
+    // timer_interrupt() is called every insts instructions run by the whole
+    // domain, which is also what run(n) counts in either mode. run() stops
+    // QEMU at each deadline and carries on, so it still runs n instructions.
+    void set_timer(uint64_t insts, bool per_cpu = true);
+    uint64_t get_timer() const { return timer_insts; }
+
     // Other interrupts can be sent as needed.
-    void interrupt(unsigned i, uint8_t vec) { cpus[i]->interrupt(vec); }
+    void interrupt(unsigned i, uint8_t vec) { post_int(i, vec); }
+
+    // Instructions CPU i has run through run(i, n), including any skipped in
+    // idle skip mode.
+    uint64_t get_icount(uint16_t i) const { return icounts[i]; }
+
+    // Record/replay of the inputs that make parallel runs diverge: timer
+    // interrupts, IPIs, interrupts sent with interrupt(), and I/O callback
+    // values. While recording, interrupts are held until the target CPU's
+    // next run(i, n) and logged with its instruction count. A replay of the
+    // log, from the same starting state, ignores those sources and raises
+    // each logged interrupt at exactly the same count, stopping QEMU there
+    // within run(). I/O values are matched in order per CPU and handed back to
+    // QEMU as the io_cb_t result (see qsim-vm.h), so replaying I/O needs a
+    // backend that uses it. Only run(i, n) is supported. The start
+    // functions return false if the log cannot be opened or does not match
+    // the domain.
+    bool start_record(const char *filename);
+    void end_record();
+    bool start_replay(const char *filename);
+
+    // Stop replaying; returns false if the run diverged from the log.
+    bool end_replay();
 
     // Return true if CPU i has been bootstrapped.
     bool runnable(unsigned i) const { return running[i]; }
@@ -290,318 +843,520 @@ namespace Qsim {
 
     // Return true if CPU i is executing in its idle loop.
     bool idle(unsigned i) const { return idlevec[i]; }
+
+    // Idle skip mode. A CPU that enters its idle loop ends its slice there
+    // and is parked until the next interrupt aimed at it; meanwhile run(i, n)
+    // does not emulate it, but advances its instruction count as if it had
+    // run, up to its next timer deadline or replayed interrupt. get_skipped()
+    // counts the instructions skipped this way; get_icount() includes them.
+    // Only interrupts sent through the OSDomain (interrupt(), the timer,
+    // IPIs and replays) unpark a CPU. One raised by a device inside QEMU
+    // waits for the next timer tick, so CPUs are only parked while the
+    // automatic timer (set_timer()) is on, which bounds that wait to one
+    // timer period.
+    void set_idle_skip(bool on) { idle_skip = on; }
+    uint64_t get_skipped(uint16_t i) const { return skipped[i]; }
+
+    // Regions of interest, marked in the guest with QSIM_ROI_BEGIN(id) and
+    // QSIM_ROI_END(id) from qsim_magic.h. Regions nest and follow the guest
+    // task that entered them across CPUs. Once a region is instrumented with
+    // add_roi(), instruction, memory and register callbacks are generated
+    // only on CPUs whose current task is inside an instrumented region. QEMU
+    // libraries without per-CPU generation keep it on for every CPU while
+    // any is inside one, and the events of the others are dropped here.
+    // Call add_roi() while no CPU is running.
+    void add_roi(uint16_t id);
+    bool in_roi(uint16_t i) const { return !roi_gating || roi_in[i]; }
+
+    // Callback profiling, to see where a run's time goes: QEMU, qsim's
+    // dispatch, or the callbacks themselves. While on, every run() is timed
+    // with the host's cycle counter and, on each CPU, one event in every
+    // sample_period of each callback type has its dispatch and each callback
+    // it reaches timed as well; the other events are only counted. Counters
+    // are kept per CPU and written only by the thread running that CPU.
+    // prof_report() prints the time split, events/sec, ns/event with a
+    // histogram per callback type, and the cost of each registered callback
+    // (by object and handler address). With a dump stream the report is
+    // also printed there every dump_ms milliseconds, by the first thread to
+    // finish a run() after each deadline. Timed events include the cost of
+    // timing them. prof_report() may be called while CPUs run, from any
+    // thread; such reports are approximate, as the counters of a running CPU
+    // are not read all at the same instant. Turn profiling on and off while
+    // no CPU is running.
+    void enable_prof(unsigned sample_period = 64, std::ostream *dump = NULL,
+                     unsigned dump_ms = 1000);
+    void disable_prof();
+    void prof_report(std::ostream &os);
     
-    // Set callbacks for specific CPU i, or for all CPUs [deprecated]
-    void set_atomic_cb(uint16_t i, atomic_cb_t cb){cpus[i]->set_atomic_cb(cb);}
+    // Set callbacks for specific CPU i, or for all CPUs [deprecated]. QEMU has
+    // a single hook of each kind, so a function set through either form
+    // receives the events of every CPU and replaces the OSDomain trampoline;
+    // use the object forms below for per-CPU callbacks.
+    void set_atomic_cb(uint16_t i, atomic_cb_t cb){cpus[0]->set_atomic_cb(cb);}
     void set_atomic_cb(atomic_cb_t cb);
-    void set_inst_cb  (uint16_t i, inst_cb_t cb)  {cpus[i]->set_inst_cb  (cb);}
+    void set_inst_cb  (uint16_t i, inst_cb_t cb)  {cpus[0]->set_inst_cb  (cb);}
     void set_inst_cb  (inst_cb_t   cb);
-    void set_mem_cb   (uint16_t i, mem_cb_t  cb)  {cpus[i]->set_mem_cb   (cb);}
+    void set_mem_cb   (uint16_t i, mem_cb_t  cb)  {cpus[0]->set_mem_cb   (cb);}
     void set_mem_cb   (mem_cb_t    cb);
-    void set_int_cb   (uint16_t i, int_cb_t  cb)  {cpus[i]->set_int_cb   (cb);}
+    void set_int_cb   (uint16_t i, int_cb_t  cb)  {cpus[0]->set_int_cb   (cb);}
     void set_int_cb   (int_cb_t    cb);
-    void set_io_cb    (uint16_t i, io_cb_t   cb)  {cpus[i]->set_io_cb    (cb);}
+    void set_io_cb    (uint16_t i, io_cb_t   cb)  {cpus[0]->set_io_cb    (cb);}
     void set_io_cb    (io_cb_t     cb);
-    void set_reg_cb   (uint16_t i, reg_cb_t cb)   {cpus[i]->set_reg_cb   (cb);}
+    void set_reg_cb   (uint16_t i, reg_cb_t cb)   {cpus[0]->set_reg_cb   (cb);}
     void set_reg_cb   (reg_cb_t    cb);
-    void set_trans_cb (uint16_t i, trans_cb_t cb) {cpus[i]->set_trans_cb (cb);}
+    void set_trans_cb (uint16_t i, trans_cb_t cb) {cpus[0]->set_trans_cb (cb);}
     void set_trans_cb (trans_cb_t  cb);
-    void set_gen_cbs  (uint16_t i,  bool state) {cpus[i]->set_gen_cbs (state);}
+    void set_gen_cbs  (uint16_t i,  bool state) {
+      cpus[0]->set_gen_cbs_cpu(i, state);
+      reset_ctx(i);
+    }
     void set_gen_cbs  (bool  state);
-    void set_sys_cbs  (uint16_t i,  bool state) {cpus[i]->set_sys_cbs (state);}
+    void set_sys_cbs  (uint16_t i,  bool state) {cpus[0]->set_sys_cbs (state);}
     void set_sys_cbs  (bool  state);
 
-    // Better callback support. Variadic templates would make this prettier.
-    struct atomic_cb_obj_base { 
-      virtual ~atomic_cb_obj_base() {} 
-      virtual int operator()(int)=0;
-    };
+    // Object callbacks. Each kind keeps a flat list of Callbacks that the
+    // static trampolines below walk.
+    typedef Callback<int, int>                                   atomic_cb_fn;
+    typedef Callback<int, int, uint64_t>                         magic_cb_fn;
+    typedef Callback<uint32_t*, int, uint64_t, uint8_t, int, uint32_t>
+                                                                 io_cb_fn;
+    typedef Callback<void, int, uint64_t, uint64_t, uint8_t, int> mem_cb_fn;
+    typedef Callback<void, int, const mem_access&>               mem_ex_cb_fn;
+    typedef Callback<int, int, uint8_t>                          int_cb_fn;
+    typedef Callback<void, int, uint64_t, uint64_t, uint8_t, const uint8_t*,
+                     enum inst_type>                             inst_cb_fn;
+    typedef Callback<void, int, int, uint8_t, int>               reg_cb_fn;
+    typedef Callback<int, int>                                   start_cb_fn;
+    typedef Callback<int, int>                                   end_cb_fn;
+    typedef Callback<void, int>                                  trans_cb_fn;
+    typedef Callback<void, int, const BatchItem*, unsigned>      batch_cb_fn;
+    typedef Callback<void, int, const reg_deps&>                 dep_cb_fn;
+
+    CallbackList<atomic_cb_fn> atomic_cbs;
+    CallbackList<magic_cb_fn>  magic_cbs;
+    CallbackList<io_cb_fn>     io_cbs;
+    CallbackList<mem_cb_fn>    mem_cbs;
+    CallbackList<mem_ex_cb_fn> mem_ex_cbs;
+    CallbackList<int_cb_fn>    int_cbs;
+    CallbackList<inst_cb_fn>   inst_cbs;
+    CallbackList<reg_cb_fn>    reg_cbs;
+    CallbackList<start_cb_fn>  start_cbs;
+    CallbackList<end_cb_fn>    end_cbs;
+    CallbackList<trans_cb_fn>  trans_cbs;
+    CallbackList<batch_cb_fn>  batch_cbs;
+    CallbackList<dep_cb_fn>    dep_cbs;
+
+    CallbackList<filtered_cb<mem_cb_fn> >    mem_flt_cbs;
+    CallbackList<filtered_cb<mem_ex_cb_fn> > mem_ex_flt_cbs;
+    CallbackList<filtered_cb<int_cb_fn> >    int_flt_cbs;
+    CallbackList<filtered_cb<inst_cb_fn> >   inst_flt_cbs;
+    CallbackList<filtered_cb<reg_cb_fn> >    reg_flt_cbs;
+
+    // Handles stay valid until passed to the matching unset_*_cb(). Callbacks
+    // may be set and unset from any thread while CPUs are running.
+    typedef CallbackList<atomic_cb_fn>::handle_t atomic_cb_handle_t;
+    typedef CallbackList<magic_cb_fn>::handle_t  magic_cb_handle_t;
+    typedef CallbackList<io_cb_fn>::handle_t     io_cb_handle_t;
+    typedef CallbackList<mem_cb_fn>::handle_t    mem_cb_handle_t;
+    typedef CallbackList<mem_ex_cb_fn>::handle_t mem_ex_cb_handle_t;
+    typedef CallbackList<int_cb_fn>::handle_t    int_cb_handle_t;
+    typedef CallbackList<inst_cb_fn>::handle_t   inst_cb_handle_t;
+    typedef CallbackList<reg_cb_fn>::handle_t    reg_cb_handle_t;
+    typedef CallbackList<start_cb_fn>::handle_t  start_cb_handle_t;
+    typedef CallbackList<end_cb_fn>::handle_t    end_cb_handle_t;
+    typedef CallbackList<trans_cb_fn>::handle_t  trans_cb_handle_t;
+    typedef CallbackList<batch_cb_fn>::handle_t  batch_cb_handle_t;
+    typedef CallbackList<dep_cb_fn>::handle_t    dep_cb_handle_t;
+
+    typedef CallbackList<filtered_cb<mem_cb_fn> >::handle_t
+                                                 mem_flt_handle_t;
+    typedef CallbackList<filtered_cb<mem_ex_cb_fn> >::handle_t
+                                                 mem_ex_flt_handle_t;
+    typedef CallbackList<filtered_cb<int_cb_fn> >::handle_t
+                                                 int_flt_handle_t;
+    typedef CallbackList<filtered_cb<inst_cb_fn> >::handle_t
+                                                 inst_flt_handle_t;
+    typedef CallbackList<filtered_cb<reg_cb_fn> >::handle_t
+                                                 reg_flt_handle_t;
+
+    // Callbacks registered for a single CPU get handles of their own types.
+    struct cpu_tag;
+    typedef CallbackList<mem_cb_fn, cpu_tag>::handle_t    mem_cpu_handle_t;
+    typedef CallbackList<mem_ex_cb_fn, cpu_tag>::handle_t mem_ex_cpu_handle_t;
+    typedef CallbackList<int_cb_fn, cpu_tag>::handle_t    int_cpu_handle_t;
+    typedef CallbackList<inst_cb_fn, cpu_tag>::handle_t   inst_cpu_handle_t;
+    typedef CallbackList<reg_cb_fn, cpu_tag>::handle_t    reg_cpu_handle_t;
+    typedef CallbackList<dep_cb_fn, cpu_tag>::handle_t    dep_cpu_handle_t;
 
-    struct magic_cb_obj_base {
-      virtual ~magic_cb_obj_base() {}
-      virtual int operator()(int, uint64_t)=0;
-    };
- 
-    struct io_cb_obj_base {
-      virtual ~io_cb_obj_base() {}
-      virtual void operator()(int, uint64_t, uint8_t, int, uint32_t)=0;
-    };
+    template <typename T>
+      atomic_cb_handle_t
+      set_atomic_cb(T* p, typename atomic_cb_fn::method<T>::type f)
+    {
+      set_atomic_cb(tramp->atomic);
+      return atomic_cbs.add(rcu, atomic_cb_fn::bind(p, f));
+    }
 
-    struct mem_cb_obj_base {
-      virtual ~mem_cb_obj_base() {}
-      virtual void operator()(int, uint64_t, uint64_t, uint8_t, int)=0;
-    };
- 
-    struct int_cb_obj_base {
-      virtual ~int_cb_obj_base() {}
-      virtual int operator()(int, uint8_t)=0;
-    };
+    template <typename T>
+      magic_cb_handle_t
+        set_magic_cb(T* p, typename magic_cb_fn::method<T>::type f)
+    {
+      return magic_cbs.add(rcu, magic_cb_fn::bind(p, f));
+    }
 
-    struct inst_cb_obj_base {
-      virtual ~inst_cb_obj_base() {}
-      virtual 
-      void operator()(int, uint64_t, uint64_t, uint8_t, const uint8_t*, 
-                      enum inst_type)=0;
-    };
+    template <typename T>
+      io_cb_handle_t set_io_cb(T* p, typename io_cb_fn::method<T>::type f)
+    {
+      set_io_cb(tramp->io);
+      return io_cbs.add(rcu, io_cb_fn::bind(p, f));
+    }
 
-    struct reg_cb_obj_base {
-      virtual ~reg_cb_obj_base() {}
-      virtual void operator()(int, int, uint8_t, int)=0;
-    };
+    template <typename T>
+      mem_cb_handle_t set_mem_cb(T* p, typename mem_cb_fn::method<T>::type f)
+    {
+      return add_mem_cb(mem_cbs, mem_cb_fn::bind(p, f));
+    }
 
-    struct start_cb_obj_base {
-      virtual ~start_cb_obj_base() {}
-      virtual int operator()(int)=0;
-    };
+    // Memory callback that also receives the PC of the issuing instruction,
+    // the protection ring and the current TID, saving the get_reg()/get_prot()
+    // calls a handler would otherwise make. Instruction callbacks are enabled
+    // as well so the PC and ring can be tracked.
+    template <typename T>
+      mem_ex_cb_handle_t
+        set_mem_cb_ex(T* p, typename mem_ex_cb_fn::method<T>::type f)
+    {
+      return add_mem_cb_ex(mem_ex_cbs, mem_ex_cb_fn::bind(p, f));
+    }
 
-    struct end_cb_obj_base {
-      virtual ~end_cb_obj_base() {}
-      virtual int operator()(int)=0;
-    };
+    template <typename T>
+      int_cb_handle_t set_int_cb(T* p, typename int_cb_fn::method<T>::type f)
+    {
+      return add_int_cb(int_cbs, int_cb_fn::bind(p, f));
+    }
 
-    struct trans_cb_obj_base {
-      virtual ~trans_cb_obj_base() {}
-      virtual void operator()(int)=0;
-    };
+    template <typename T>
+      inst_cb_handle_t
+        set_inst_cb(T* p, typename inst_cb_fn::method<T>::type f)
+    {
+      return add_inst_cb(inst_cbs, inst_cb_fn::bind(p, f));
+    }
 
-    template <typename T> struct atomic_cb_obj : public atomic_cb_obj_base {
-      typedef int (T::*atomic_cb_t)(int);
-      T* p; atomic_cb_t f;
-      atomic_cb_obj(T* p, atomic_cb_t f) : p(p), f(f) {}
-      int operator()(int cpu_id) { return ((p)->*(f))(cpu_id); }
-    };
+    template <typename T>
+      reg_cb_handle_t set_reg_cb(T* p, typename reg_cb_fn::method<T>::type f)
+    {
+      return add_reg_cb(reg_cbs, reg_cb_fn::bind(p, f));
+    }
 
-    template <typename T> struct magic_cb_obj : public magic_cb_obj_base {
-      typedef int (T::*magic_cb_t)(int, uint64_t);
-      T* p; magic_cb_t f;
-      magic_cb_obj(T* p, magic_cb_t f) : p(p), f(f) {}
-      int operator()(int cpu_id, uint64_t rax) {
-        return ((p)->*(f))(cpu_id, rax);
-      }
-    };
+    // The same for handlers named at compile time, e.g.
+    //   osd.set_inst_cb<Tracer, &Tracer::inst>(&tracer);
+    // Dispatch then calls straight into a thunk with the handler inlined.
+    template <typename T, typename mem_cb_fn::method<T>::type F>
+      mem_cb_handle_t set_mem_cb(T* p)
+    {
+      return add_mem_cb(mem_cbs, mem_cb_fn::bind<T, F>(p));
+    }
 
-    template <typename T> struct io_cb_obj : public io_cb_obj_base {
-      typedef uint32_t *(T::*io_cb_t)(int, uint64_t, uint8_t, int, uint32_t);
-      T* p; io_cb_t f;
-      io_cb_obj(T* p, io_cb_t f) : p(p), f(f) {}
-      void operator()
-        (int cpu_id, uint64_t port, uint8_t size, int type, uint32_t val)
-      {
-        ((p)->*(f))(cpu_id, port, size, type, val);
-      }
-    };
+    template <typename T, typename mem_ex_cb_fn::method<T>::type F>
+      mem_ex_cb_handle_t set_mem_cb_ex(T* p)
+    {
+      return add_mem_cb_ex(mem_ex_cbs, mem_ex_cb_fn::bind<T, F>(p));
+    }
 
-    template <typename T> struct mem_cb_obj : public mem_cb_obj_base {
-      typedef void (T::*mem_cb_t)(int, uint64_t, uint64_t, uint8_t, int);
-      T* p; mem_cb_t f;
-      mem_cb_obj(T* p, mem_cb_t f) : p(p), f(f) {}
-      void operator()(int cpu_id, uint64_t va, uint64_t pa, uint8_t s, int t) {
-        ((p)->*(f))(cpu_id, va, pa, s, t);
-      }
-    };
+    template <typename T, typename int_cb_fn::method<T>::type F>
+      int_cb_handle_t set_int_cb(T* p)
+    {
+      return add_int_cb(int_cbs, int_cb_fn::bind<T, F>(p));
+    }
 
-    template <typename T> struct int_cb_obj : public int_cb_obj_base {
-      typedef int (T::*int_cb_t)(int, uint8_t);
-      T* p; int_cb_t f;
-      int_cb_obj(T* p, int_cb_t f) : p(p), f(f) {}
-      int operator()(int cpu_id, uint8_t vec) { 
-        return ((p)->*(f))(cpu_id, vec); 
-      }
-    };
+    template <typename T, typename inst_cb_fn::method<T>::type F>
+      inst_cb_handle_t set_inst_cb(T* p)
+    {
+      return add_inst_cb(inst_cbs, inst_cb_fn::bind<T, F>(p));
+    }
 
-    template <typename T> struct inst_cb_obj : public inst_cb_obj_base {
-      typedef void(T::*inst_cb_t)(int, uint64_t, uint64_t,
-                                  uint8_t, const uint8_t*, enum inst_type);
-      T* p; inst_cb_t f;
-      inst_cb_obj(T* p, inst_cb_t f) : p(p), f(f) {}
-      void operator()(int cpu_id,
-                      uint64_t va,
-                      uint64_t pa,
-                      uint8_t l,
-                      const uint8_t* b,
-                      enum inst_type t) {
-        ((p)->*(f))(cpu_id, va, pa, l, b, t);
-      }
-    };
+    template <typename T, typename reg_cb_fn::method<T>::type F>
+      reg_cb_handle_t set_reg_cb(T* p)
+    {
+      return add_reg_cb(reg_cbs, reg_cb_fn::bind<T, F>(p));
+    }
 
-    template <typename T> struct reg_cb_obj : public reg_cb_obj_base {
-      typedef void(T::*reg_cb_t)(int, int, uint8_t, int);
-      T* p; reg_cb_t f;
-      reg_cb_obj(T* p, reg_cb_t f) : p(p), f(f) {}
-      void operator()(int cpu_id, int reg, uint8_t size, int type) {
-        ((p)->*(f))(cpu_id, reg, size, type);
-      }
-    };
+    // Per-CPU forms: the callback only receives events from CPU i, and a CPU
+    // with no callbacks of a kind skips that kind's dispatch loop. Remove
+    // them with the unset_*_cb(i, handle) overloads.
+    template <typename T>
+      mem_cpu_handle_t
+        set_mem_cb(uint16_t i, T* p, typename mem_cb_fn::method<T>::type f)
+    {
+      return add_mem_cb(cpu_cbs[i].mem, mem_cb_fn::bind(p, f));
+    }
 
-    template <typename T> struct start_cb_obj : public start_cb_obj_base {
-      typedef int(T::*start_cb_t)(int);
-      T* p; start_cb_t f;
-      start_cb_obj(T* p, start_cb_t f) : p(p), f(f) {}
-      int operator()(int cpu_id) {
-        return ((p)->*(f))(cpu_id);
-      }
-    };
+    template <typename T>
+      mem_ex_cpu_handle_t
+        set_mem_cb_ex(uint16_t i, T* p,
+                      typename mem_ex_cb_fn::method<T>::type f)
+    {
+      return add_mem_cb_ex(cpu_cbs[i].mem_ex, mem_ex_cb_fn::bind(p, f));
+    }
 
-    template <typename T> struct end_cb_obj : public end_cb_obj_base {
-      typedef int(T::*end_cb_t)(int);
-      T* p; end_cb_t f;
-      end_cb_obj(T* p, end_cb_t f) : p(p), f(f) {}
-      int operator()(int cpu_id) {
-        return ((p)->*(f))(cpu_id);
-      }
-    };
+    template <typename T>
+      int_cpu_handle_t
+        set_int_cb(uint16_t i, T* p, typename int_cb_fn::method<T>::type f)
+    {
+      return add_int_cb(cpu_cbs[i].intr, int_cb_fn::bind(p, f));
+    }
 
-    template <typename T> struct trans_cb_obj : public trans_cb_obj_base {
-      typedef void(T::*trans_cb_t)(int);
-      T* p; trans_cb_t f;
-      trans_cb_obj(T* p, trans_cb_t f): p(p), f(f) {}
-      void operator()(int cpu_id) {
-        ((p)->*(f))(cpu_id);
-      }
-    };
+    template <typename T>
+      inst_cpu_handle_t
+        set_inst_cb(uint16_t i, T* p, typename inst_cb_fn::method<T>::type f)
+    {
+      return add_inst_cb(cpu_cbs[i].inst, inst_cb_fn::bind(p, f));
+    }
 
-    struct start_cb_obj_s : public start_cb_obj_base {
-      typedef int(*start_cb_t)(int);
-      start_cb_t f;
-      start_cb_obj_s(start_cb_t f): f(f) {}
-      int operator()(int cpu_id) {
-        return f(cpu_id);
-      }
-    };
+    template <typename T>
+      reg_cpu_handle_t
+        set_reg_cb(uint16_t i, T* p, typename reg_cb_fn::method<T>::type f)
+    {
+      return add_reg_cb(cpu_cbs[i].reg, reg_cb_fn::bind(p, f));
+    }
 
-    struct end_cb_obj_s : public end_cb_obj_base {
-      typedef int(*end_cb_t)(int);
-      end_cb_t f;
-      end_cb_obj_s(end_cb_t f): f(f) {}
-      int operator()(int cpu_id) {
-        return f(cpu_id);
-      }
-    };
+    template <typename T, typename mem_cb_fn::method<T>::type F>
+      mem_cpu_handle_t set_mem_cb(uint16_t i, T* p)
+    {
+      return add_mem_cb(cpu_cbs[i].mem, mem_cb_fn::bind<T, F>(p));
+    }
 
-    std::vector<atomic_cb_obj_base*> atomic_cbs;
-    std::vector<magic_cb_obj_base*>  magic_cbs;
-    std::vector<io_cb_obj_base*>     io_cbs;
-    std::vector<mem_cb_obj_base*>    mem_cbs;
-    std::vector<int_cb_obj_base*>    int_cbs;
-    std::vector<inst_cb_obj_base*>   inst_cbs;
-    std::vector<reg_cb_obj_base*>    reg_cbs;
-    std::vector<start_cb_obj_base*>  start_cbs;
-    std::vector<end_cb_obj_base*>    end_cbs;
-    std::vector<trans_cb_obj_base*>  trans_cbs;
-
-    typedef std::vector<atomic_cb_obj_base*>::iterator atomic_cb_handle_t;
-    typedef std::vector<magic_cb_obj_base*>::iterator  magic_cb_handle_t;
-    typedef std::vector<io_cb_obj_base*>::iterator     io_cb_handle_t;
-    typedef std::vector<mem_cb_obj_base*>::iterator    mem_cb_handle_t;
-    typedef std::vector<int_cb_obj_base*>::iterator    int_cb_handle_t;
-    typedef std::vector<inst_cb_obj_base*>::iterator   inst_cb_handle_t;
-    typedef std::vector<reg_cb_obj_base*>::iterator    reg_cb_handle_t;
-    typedef std::vector<start_cb_obj_base*>::iterator  start_cb_handle_t;
-    typedef std::vector<end_cb_obj_base*>::iterator    end_cb_handle_t;
-    typedef std::vector<trans_cb_obj_base*>::iterator  trans_cb_handle_t;
+    template <typename T, typename mem_ex_cb_fn::method<T>::type F>
+      mem_ex_cpu_handle_t set_mem_cb_ex(uint16_t i, T* p)
+    {
+      return add_mem_cb_ex(cpu_cbs[i].mem_ex, mem_ex_cb_fn::bind<T, F>(p));
+    }
 
-    template <typename T>
-      atomic_cb_handle_t
-      set_atomic_cb(T* p, typename atomic_cb_obj<T>::atomic_cb_t f)
+    template <typename T, typename int_cb_fn::method<T>::type F>
+      int_cpu_handle_t set_int_cb(uint16_t i, T* p)
     {
-      atomic_cbs.push_back(new atomic_cb_obj<T>(p, f));
-      set_atomic_cb(atomic_cb_s);
-      return atomic_cbs.end() - 1;
+      return add_int_cb(cpu_cbs[i].intr, int_cb_fn::bind<T, F>(p));
     }
 
-    template <typename T>
-      magic_cb_handle_t
-        set_magic_cb(T* p, typename magic_cb_obj<T>::magic_cb_t f) 
+    template <typename T, typename inst_cb_fn::method<T>::type F>
+      inst_cpu_handle_t set_inst_cb(uint16_t i, T* p)
     {
-      magic_cbs.push_back(new magic_cb_obj<T>(p, f));
-      return magic_cbs.end() - 1;
+      return add_inst_cb(cpu_cbs[i].inst, inst_cb_fn::bind<T, F>(p));
     }
 
+    template <typename T, typename reg_cb_fn::method<T>::type F>
+      reg_cpu_handle_t set_reg_cb(uint16_t i, T* p)
+    {
+      return add_reg_cb(cpu_cbs[i].reg, reg_cb_fn::bind<T, F>(p));
+    }
+
+    // Filtered forms: the handler only sees events that pass f (see
+    // cb_filter). Remove them with the unset_*_cb overloads taking the
+    // returned handle.
     template <typename T>
-      io_cb_handle_t set_io_cb(T* p, typename io_cb_obj<T>::io_cb_t f)
+      mem_flt_handle_t set_mem_cb(const cb_filter &f, T* p,
+                                  typename mem_cb_fn::method<T>::type m)
     {
-      io_cbs.push_back(new io_cb_obj<T>(p, f));
-      set_io_cb(io_cb_s);
-      return io_cbs.end() - 1;
+      return add_mem_cb(mem_flt_cbs, filtered_cb<mem_cb_fn>(
+                          mem_cb_fn::bind(p, m), f));
     }
 
     template <typename T>
-      mem_cb_handle_t set_mem_cb(T* p, typename mem_cb_obj<T>::mem_cb_t f)
+      mem_ex_flt_handle_t
+        set_mem_cb_ex(const cb_filter &f, T* p,
+                      typename mem_ex_cb_fn::method<T>::type m)
     {
-      mem_cbs.push_back(new mem_cb_obj<T>(p, f));
-      set_mem_cb(mem_cb_s);
-      return mem_cbs.end() - 1;
+      return add_mem_cb_ex(mem_ex_flt_cbs, filtered_cb<mem_ex_cb_fn>(
+                             mem_ex_cb_fn::bind(p, m), f));
     }
 
     template <typename T>
-      int_cb_handle_t set_int_cb(T* p, typename int_cb_obj<T>::int_cb_t f)
+      int_flt_handle_t set_int_cb(const cb_filter &f, T* p,
+                                  typename int_cb_fn::method<T>::type m)
     {
-      int_cbs.push_back(new int_cb_obj<T>(p, f));
-      set_int_cb(int_cb_s);
-      return int_cbs.end() - 1;
+      return add_int_cb(int_flt_cbs, filtered_cb<int_cb_fn>(
+                          int_cb_fn::bind(p, m), f));
     }
 
     template <typename T>
-      inst_cb_handle_t set_inst_cb(T* p, typename inst_cb_obj<T>::inst_cb_t f)
+      inst_flt_handle_t set_inst_cb(const cb_filter &f, T* p,
+                                    typename inst_cb_fn::method<T>::type m)
     {
-      inst_cbs.push_back(new inst_cb_obj<T>(p, f));
-      set_inst_cb(inst_cb_s);
-      return inst_cbs.end() - 1;
+      return add_inst_cb(inst_flt_cbs, filtered_cb<inst_cb_fn>(
+                           inst_cb_fn::bind(p, m), f));
     }
 
     template <typename T>
-      reg_cb_handle_t set_reg_cb(T* p, typename reg_cb_obj<T>::reg_cb_t f)
+      reg_flt_handle_t set_reg_cb(const cb_filter &f, T* p,
+                                  typename reg_cb_fn::method<T>::type m)
+    {
+      return add_reg_cb(reg_flt_cbs, filtered_cb<reg_cb_fn>(
+                          reg_cb_fn::bind(p, m), f));
+    }
+
+    template <typename T, typename mem_cb_fn::method<T>::type F>
+      mem_flt_handle_t set_mem_cb(const cb_filter &f, T* p)
+    {
+      return add_mem_cb(mem_flt_cbs, filtered_cb<mem_cb_fn>(
+                          mem_cb_fn::bind<T, F>(p), f));
+    }
+
+    template <typename T, typename mem_ex_cb_fn::method<T>::type F>
+      mem_ex_flt_handle_t set_mem_cb_ex(const cb_filter &f, T* p)
+    {
+      return add_mem_cb_ex(mem_ex_flt_cbs, filtered_cb<mem_ex_cb_fn>(
+                             mem_ex_cb_fn::bind<T, F>(p), f));
+    }
+
+    template <typename T, typename int_cb_fn::method<T>::type F>
+      int_flt_handle_t set_int_cb(const cb_filter &f, T* p)
+    {
+      return add_int_cb(int_flt_cbs, filtered_cb<int_cb_fn>(
+                          int_cb_fn::bind<T, F>(p), f));
+    }
+
+    template <typename T, typename inst_cb_fn::method<T>::type F>
+      inst_flt_handle_t set_inst_cb(const cb_filter &f, T* p)
+    {
+      return add_inst_cb(inst_flt_cbs, filtered_cb<inst_cb_fn>(
+                           inst_cb_fn::bind<T, F>(p), f));
+    }
+
+    template <typename T, typename reg_cb_fn::method<T>::type F>
+      reg_flt_handle_t set_reg_cb(const cb_filter &f, T* p)
     {
-      reg_cbs.push_back(new reg_cb_obj<T>(p, f));
-      set_reg_cb(reg_cb_s);
-      return reg_cbs.end() - 1;
+      return add_reg_cb(reg_flt_cbs, filtered_cb<reg_cb_fn>(
+                          reg_cb_fn::bind<T, F>(p), f));
     }
 
     template <typename T>
       start_cb_handle_t
-        set_app_start_cb(T* p, typename start_cb_obj<T>::start_cb_t f)
+        set_app_start_cb(T* p, typename start_cb_fn::method<T>::type f)
     {
-      start_cbs.push_back(new start_cb_obj<T>(p, f));
-      return start_cbs.end() - 1;
+      return start_cbs.add(rcu, start_cb_fn::bind(p, f));
     }
 
     template <typename T>
-      end_cb_handle_t set_app_end_cb(T* p, typename end_cb_obj<T>::end_cb_t f)
+      end_cb_handle_t
+        set_app_end_cb(T* p, typename end_cb_fn::method<T>::type f)
     {
-      end_cbs.push_back(new end_cb_obj<T>(p, f));
-      return end_cbs.end() - 1;
+      return end_cbs.add(rcu, end_cb_fn::bind(p, f));
     }
 
     template <typename T>
       trans_cb_handle_t
-        set_trans_cb(T* p, typename trans_cb_obj<T>::trans_cb_t f)
+        set_trans_cb(T* p, typename trans_cb_fn::method<T>::type f)
+    {
+      set_trans_cb(tramp->trans);
+      return trans_cbs.add(rcu, trans_cb_fn::bind(p, f));
+    }
+
+    // Batch callbacks receive the contents of a CPU's event ring (see
+    // enable_batching()) whenever it fills and at the end of each run().
+    template <typename T>
+      batch_cb_handle_t
+        set_batch_cb(T* p, typename batch_cb_fn::method<T>::type f)
     {
-      trans_cbs.push_back(new trans_cb_obj<T>(p, f));
-      set_trans_cb(trans_cb_s);
-      return trans_cbs.end() - 1;
+      return batch_cbs.add(rcu, batch_cb_fn::bind(p, f));
+    }
+
+    // Dependency callbacks receive one reg_deps per instruction in place of
+    // the instruction's individual register callbacks. A record is delivered
+    // once the instruction is complete: when the CPU's next instruction
+    // starts, an interrupt arrives or run() returns.
+    template <typename T>
+      dep_cb_handle_t set_dep_cb(T* p, typename dep_cb_fn::method<T>::type f)
+    {
+      return add_dep_cb(dep_cbs, dep_cb_fn::bind(p, f));
+    }
+
+    template <typename T, typename dep_cb_fn::method<T>::type F>
+      dep_cb_handle_t set_dep_cb(T* p)
+    {
+      return add_dep_cb(dep_cbs, dep_cb_fn::bind<T, F>(p));
+    }
+
+    template <typename T>
+      dep_cpu_handle_t
+        set_dep_cb(uint16_t i, T* p, typename dep_cb_fn::method<T>::type f)
+    {
+      return add_dep_cb(cpu_cbs[i].dep, dep_cb_fn::bind(p, f));
+    }
+
+    template <typename T, typename dep_cb_fn::method<T>::type F>
+      dep_cpu_handle_t set_dep_cb(uint16_t i, T* p)
+    {
+      return add_dep_cb(cpu_cbs[i].dep, dep_cb_fn::bind<T, F>(p));
     }
 
     void unset_atomic_cb(atomic_cb_handle_t);
     void unset_magic_cb(magic_cb_handle_t);
     void unset_io_cb(io_cb_handle_t);
     void unset_mem_cb(mem_cb_handle_t);
+    void unset_mem_cb_ex(mem_ex_cb_handle_t);
+    void unset_int_cb(int_cb_handle_t);
     void unset_inst_cb(inst_cb_handle_t);
     void unset_reg_cb(reg_cb_handle_t);
+    void unset_mem_cb(uint16_t i, mem_cpu_handle_t);
+    void unset_mem_cb_ex(uint16_t i, mem_ex_cpu_handle_t);
+    void unset_int_cb(uint16_t i, int_cpu_handle_t);
+    void unset_inst_cb(uint16_t i, inst_cpu_handle_t);
+    void unset_reg_cb(uint16_t i, reg_cpu_handle_t);
+    void unset_mem_cb(mem_flt_handle_t);
+    void unset_mem_cb_ex(mem_ex_flt_handle_t);
+    void unset_int_cb(int_flt_handle_t);
+    void unset_inst_cb(inst_flt_handle_t);
+    void unset_reg_cb(reg_flt_handle_t);
     void unset_app_start_cb(start_cb_handle_t);
     void unset_app_end_cb(end_cb_handle_t);
     void unset_trans_cb(trans_cb_handle_t);
+    void unset_batch_cb(batch_cb_handle_t);
+    void unset_dep_cb(dep_cb_handle_t);
+    void unset_dep_cb(uint16_t i, dep_cpu_handle_t);
+
+    // The unset_*_cb() functions return once no CPU thread can still be
+    // running the removed callback, except the calling thread itself when it
+    // is dispatching callbacks; the callback's object may then be destroyed.
+    // synchronize_cbs() waits the same way for everything removed so far.
+    // Neither may be called while holding a lock a running callback needs.
+    void synchronize_cbs() { rcu.synchronize(); }
+
+    // Batched event mode. Instead of (or in addition to) the per-event
+    // callbacks, each CPU appends a BatchItem for every event selected by
+    // mask to a preallocated ring of ring_size entries. The ring is handed to
+    // the batch callbacks when it fills and at the end of every run(), or can
+    // be drained explicitly with pull_batch(). Without a batch callback, events
+    // arriving at a full ring are dropped and counted in batch_dropped().
+    enum batch_mask {
+      BATCH_INST = 0x01, BATCH_MEM = 0x02, BATCH_INT = 0x04, BATCH_REG = 0x08
+    };
+    void enable_batching(unsigned ring_size = 4096,
+                         int mask = BATCH_INST|BATCH_MEM);
+    void disable_batching();
+
+    // Copy up to n of CPU i's pending records to out, oldest first. Returns the
+    // number of records copied.
+    unsigned pull_batch(uint16_t i, BatchItem *out, unsigned n);
+
+    // Deliver CPU i's pending records to the batch callbacks.
+    void flush_batch(uint16_t i);
+
+    uint64_t batch_dropped(uint16_t i) const {
+      return i < batch_rings.size() ? batch_rings[i].dropped : 0;
+    }
 
     // Set the "application start" and "application end" callbacks.
     void set_app_start_cb(int f(int))
     {
-      start_cbs.push_back(new start_cb_obj_s(f));
+      start_cbs.add(rcu, start_cb_fn::bind(f));
     }
 
     void set_app_end_cb  (int f(int))
     {
-      end_cbs.push_back(new end_cb_obj_s(f));
+      end_cbs.add(rcu, end_cb_fn::bind(f));
     }
 
+    // Index of this domain among those alive in the process.
+    int get_id() const { return id; }
+
     // Get the number of CPUs
     int get_n() const { return n_cpus; }
     // Set the number of CPUs
@@ -609,50 +1364,89 @@ namespace Qsim {
 
     // Retreive/set register contents.
     uint64_t get_reg(int c, int r) { return cpus[0]->get_reg(c, r); }
-    void     set_reg(int c, int r, uint64_t v) { cpus[0]->set_reg(c, r, v); }
+    void     set_reg(int c, int r, uint64_t v) {
+      cpus[0]->set_reg(c, r, v);
+      ctx[c].valid = false;
+    }
 
-    // Get/set memory contents (physical address)
+    // Read the n registers listed in r into out with a single call into QEMU.
+    void get_regs(int c, const int *r, int n, uint64_t *out) {
+      cpus[0]->get_regs(c, r, n, out);
+    }
+
+    // Read every register of CPU c.
+    void get_context(int c, X86Context &ctx);
+    void get_context(int c, Arm64Context &ctx);
+
+    // Get/set memory contents (physical address). Guest and host are both
+    // little-endian, so a value is a straight copy of its bytes.
     template <typename T> void mem_rd(T& d, uint64_t paddr) {
-      size_t sz = sizeof(T);
-      paddr += sz - 1;
-      d = 0;
-      while (sz--) {
-        d <<= 8;
-        d |= cpus[0]->mem_rd(paddr--);
-      }
+      mem_rd_block(paddr, &d, sizeof(T));
     }
 
     template <typename T> void mem_wr(T d, uint64_t paddr) {
-      size_t sz = sizeof(T);
-      while (sz--) {
-        cpus[0]->mem_wr(paddr++, (d)&0xff);
-        d >>= 8;
-      }
+      mem_wr_block(paddr, &d, sizeof(T));
     }
 
     // Get/set memory contents (virtual address)
     template <typename T> void mem_rd_virt(unsigned cpu, T& d, uint64_t vaddr)
     {
-      size_t sz = sizeof(T);
-      vaddr += sz - 1;
-      d = 0;
-      while (sz--) {
-        d <<= 8;
-        d |= cpus[0]->mem_rd_virt(cpu, vaddr--);
-      }
+      mem_rd_virt_block(cpu, vaddr, &d, sizeof(T));
     }
 
     template <typename T> void mem_wr_virt(unsigned cpu, T d, uint64_t vaddr)
     {
-      size_t sz = sizeof(T);
-      while (sz--) {
-        cpus[0]->mem_wr_virt(cpu, vaddr++, d&0xff);
-        d >>= 8;
-      }
+      mem_wr_virt_block(cpu, vaddr, &d, sizeof(T));
+    }
+
+    // Copy len bytes between guest memory and a host buffer. Reads are served
+    // straight from the RAM mappings when the library provides them.
+    void mem_rd_block(uint64_t paddr, void *buf, size_t len) {
+      if (const uint8_t *p = ram_ptr(paddr, len)) memcpy(buf, p, len);
+      else cpus[0]->mem_rd_block(paddr, buf, len);
+    }
+
+    void mem_wr_block(uint64_t paddr, const void *buf, size_t len) {
+      cpus[0]->mem_wr_block(paddr, buf, len);
+    }
+
+    void mem_rd_virt_block(unsigned cpu, uint64_t vaddr, void *buf, size_t len)
+    {
+      cpus[0]->mem_rd_virt_block(cpu, vaddr, buf, len);
+    }
+
+    void mem_wr_virt_block(unsigned cpu, uint64_t vaddr, const void *buf,
+                           size_t len)
+    {
+      cpus[0]->mem_wr_virt_block(cpu, vaddr, buf, len);
     }
 
     size_t   mem_sz()  { return ram_size_mb; }
 
+    // Read-only, zero-copy view of guest physical RAM. Each region maps a
+    // contiguous range of guest physical addresses to host memory. The
+    // mappings live as long as the OSDomain, but their contents are only
+    // stable while no CPU is running. The regions are sorted by address.
+    // Returns an empty list if the QEMU library does not export its RAM
+    // layout.
+    const std::vector<qsim_ram_region> &get_ram_regions();
+
+    // Host pointer to guest physical range [paddr, paddr+len), or NULL if the
+    // range is not wholly inside one RAM region.
+    const uint8_t *ram_ptr(uint64_t paddr, size_t len = 1) {
+      const std::vector<qsim_ram_region> &r(ram_regions_valid ?
+                                            ram_regions : get_ram_regions());
+
+      // The last region starting at or below paddr is the only candidate.
+      std::vector<qsim_ram_region>::const_iterator i =
+        std::upper_bound(r.begin(), r.end(), paddr, region_before);
+      if (i == r.begin()) return NULL;
+      --i;
+
+      if (len > i->size || paddr - i->paddr > i->size - len) return NULL;
+      return i->host + (paddr - i->paddr);
+    }
+
     void lock_addr(uint64_t pa);
     void unlock_addr(uint64_t pa);
 
@@ -668,6 +1462,64 @@ namespace Qsim {
     int bench_pid;
     void assign_id();
 
+    // Append an object callback and make sure QEMU calls our trampoline.
+    template <typename C, typename K>
+      typename CallbackList<C, K>::handle_t
+        add_mem_cb(CallbackList<C, K> &l, const C &c)
+    {
+      set_mem_cb(tramp->mem);
+      return l.add(rcu, c);
+    }
+
+    template <typename C, typename K>
+      typename CallbackList<C, K>::handle_t
+        add_mem_cb_ex(CallbackList<C, K> &l, const C &c)
+    {
+      set_mem_cb(tramp->mem);
+      set_inst_cb(tramp->inst);
+      return l.add(rcu, c);
+    }
+
+    template <typename C, typename K>
+      typename CallbackList<C, K>::handle_t
+        add_int_cb(CallbackList<C, K> &l, const C &c)
+    {
+      set_int_cb(tramp->intr);
+      return l.add(rcu, c);
+    }
+
+    template <typename C, typename K>
+      typename CallbackList<C, K>::handle_t
+        add_inst_cb(CallbackList<C, K> &l, const C &c)
+    {
+      set_inst_cb(tramp->inst);
+      return l.add(rcu, c);
+    }
+
+    template <typename C, typename K>
+      typename CallbackList<C, K>::handle_t
+        add_reg_cb(CallbackList<C, K> &l, const C &c)
+    {
+      set_reg_cb(tramp->reg);
+      return l.add(rcu, c);
+    }
+
+    template <typename C, typename K>
+      typename CallbackList<C, K>::handle_t
+        add_dep_cb(CallbackList<C, K> &l, const C &c)
+    {
+      set_inst_cb(tramp->inst);
+      set_reg_cb(tramp->reg);
+      return l.add(rcu, c);
+    }
+
+    // Whether CPU i's current ring and TID pass f. Only the criteria f sets
+    // are looked up.
+    bool filt_ctx(const cb_filter &f, uint16_t i) {
+      return (!f.needs_prot() || f.match_prot(get_prot(i))) &&
+             (!f.needs_tid()  || f.match_tid(get_tid(i)));
+    }
+
     void init(const char* filename);
 
     std::string linebuf;
@@ -677,40 +1529,233 @@ namespace Qsim {
     std::vector<uint16_t> tids   ;       // Current tid of each CPU
     std::vector<bool>     running;       // Whether CPU is running.
 
+    // Reclamation for the callback lists; each CPU is a reader for the
+    // duration of run().
+    Epoch rcu;
+
+    // Callbacks registered for a single CPU.
+    struct cpu_cb_lists {
+      CallbackList<mem_cb_fn, cpu_tag>    mem;
+      CallbackList<mem_ex_cb_fn, cpu_tag> mem_ex;
+      CallbackList<int_cb_fn, cpu_tag>    intr;
+      CallbackList<inst_cb_fn, cpu_tag>   inst;
+      CallbackList<reg_cb_fn, cpu_tag>    reg;
+      CallbackList<dep_cb_fn, cpu_tag>    dep;
+    };
+    cpu_cb_lists *cpu_cbs;
+
+    // Register dependency records being built, one per CPU. open is set while
+    // the CPU's current instruction is being tracked for the dependency
+    // callbacks; its register callbacks are then ORed into d.
+    struct dep_state {
+      dep_state(): open(false) {}
+      bool open;
+      reg_deps d;
+    };
+    std::vector<dep_state> deps;
+
+    bool dep_wanted(uint16_t i) {
+      return !dep_cbs.empty() || !cpu_cbs[i].dep.empty();
+    }
+    void dep_begin(uint16_t i, uint64_t va, uint64_t pa, uint8_t l,
+                   enum inst_type type);
+    void dep_add(uint16_t i, int reg, uint8_t size, int type) {
+      reg_deps &d(deps[i].d);
+      if (size == 0) {
+        (type ? d.fdst : d.fsrc) |= reg;
+      } else if (unsigned(reg) < 64*reg_deps::WORDS) {
+        (type ? d.dst : d.src)[reg/64] |= uint64_t(1) << (reg%64);
+      }
+    }
+    void dep_flush(uint16_t i);
+
+    // Record/replay state; NULL unless recording or replaying.
+    struct replay_state;
+    replay_state *rr;
+    std::vector<uint64_t> icounts;
+
+    int  post_int(uint16_t i, uint8_t vec);
+    void rr_deliver(uint16_t i);
+    unsigned rr_limit(uint16_t i, unsigned n);
+    uint32_t *rr_io(uint16_t i, uint64_t port, uint8_t s, int type,
+                    uint32_t data);
+
+    // Automatic timer (set_timer()). timer_next holds each CPU's next
+    // deadline; the domain-wide timer fires whenever timer_count crosses a
+    // multiple of timer_insts past timer_start.
+    uint64_t timer_insts;
+    bool timer_per_cpu;
+    std::vector<uint64_t> timer_next;
+    std::atomic<uint64_t> timer_count;
+    uint64_t timer_start;
+
+    uint8_t timer_vec() const;
+    unsigned timer_limit(int i, unsigned n) const;
+    void timer_tick(int i, unsigned ran);
+    unsigned run_slice(uint16_t i, unsigned n);
+
+    // Idle skip mode. A CPU is parked when it reports entering its idle loop
+    // and unparked by any interrupt posted to it, from any thread. wakes
+    // counts those interrupts, so that one arriving while the CPU runs is
+    // not lost to an idle report later in the same run.
+    struct park_state {
+      park_state(): parked(false), wakes(0) {}
+      std::atomic<bool> parked;
+      std::atomic<unsigned> wakes;
+    };
+    bool idle_skip;
+    park_state *parked;
+    std::vector<uint64_t> skipped;
+
+    // Region of interest gating. roi_depth counts the instrumented regions
+    // each task is inside, under roi_lock; roi_in is whether CPU i is
+    // generating callbacks, only written by the thread running CPU i.
+    bool roi_gating;
+    std::vector<bool> roi_ids;
+    std::unordered_map<uint16_t, unsigned> roi_depth;
+    std::mutex roi_lock;
+    std::vector<char> roi_in;
+    unsigned roi_cpus;          // CPUs in roi_in, for global generation
+
+    void roi_mark(uint16_t i, uint16_t id, bool begin);
+    void roi_update(uint16_t i);
+    bool roi_drop(uint16_t i) const { return roi_gating && !roi_in[i]; }
+
+    bool skipping() const { return idle_skip && timer_insts; }
+    void unpark(uint16_t i) {
+      parked[i].wakes.fetch_add(1, std::memory_order_relaxed);
+      parked[i].parked.store(false, std::memory_order_release);
+    }
+
+    // Callback profiling state; NULL unless enable_prof() is in effect.
+    // prof_sample() counts an event of kind k on CPU i and returns the CPU's
+    // counters if this one is to be timed.
+    struct prof_state;
+    struct prof_cpu;
+    prof_state *prof;
+
+    prof_cpu *prof_sample(uint16_t i, unsigned k) {
+      return prof ? prof_tick(i, k) : NULL;
+    }
+    prof_cpu *prof_tick(uint16_t i, unsigned k);
+    void prof_done(prof_cpu *p, unsigned k, uint64_t start);
+    void prof_call(prof_cpu *p, unsigned k, void (*fn)(), const void *obj,
+                   uint64_t start);
+    template <typename C> void prof_cb(prof_cpu *p, unsigned k, const C &c,
+                                       uint64_t start)
+    {
+      if (p) prof_call(p, k, reinterpret_cast<void (*)()>(c.thunk), c.obj,
+                       start);
+    }
+    void prof_run(uint16_t i, unsigned insts, uint64_t start);
+
+    // Cached privilege level and mode. The cache is only trusted (valid) while
+    // tracking, i.e. while every instruction of the CPU goes past note_inst().
+    // pending marks that the current instruction may change the context, so
+    // the cache goes stale when the next one starts. Turning generation on or
+    // off for a CPU resets its cache: instructions run with generation off
+    // are never noted, and one of them may have been a syscall or eret.
+    struct cpu_ctx {
+      cpu_ctx(): valid(false), pending(false), tracking(false),
+                 mode(MODE_REAL), prot(PROT_KERN), pc(0) {}
+      bool valid, pending, tracking;
+      cpu_mode mode;
+      cpu_prot prot;
+      uint64_t pc;              // Address of the current instruction
+    };
+    std::vector<cpu_ctx> ctx;
+    bool ctx_a64;
+
+    void refresh_ctx(uint16_t i);
+    void reset_ctx(uint16_t i) { ctx[i] = cpu_ctx(); }
+    bool ctx_changing_inst(const uint8_t *bytes, uint8_t len);
+
     int (*app_start_cb)(int);  // Call this when the app starts running
     int (*app_end_cb  )(int);  // Call this when the app finishes
 
     std::vector<std::ostream *>       consoles;
-   
+
     unsigned ram_size_mb;
+
+    std::vector<qsim_ram_region> ram_regions;
+    bool ram_regions_valid;
+    static bool region_before(uint64_t paddr, const qsim_ram_region &r) {
+      return paddr < r.paddr;
+    }
+
+    // Per-CPU event rings for batched mode. head and tail count records ever
+    // written and consumed; the ring size is a power of two.
+    struct batch_ring {
+      batch_ring(): head(0), tail(0), dropped(0) {}
+      std::vector<BatchItem> buf;
+      uint64_t head, tail, dropped;
+    };
+    std::vector<batch_ring> batch_rings;
+    int batch_events;
+
+    BatchItem *batch_slot(uint16_t i) {
+      batch_ring &r(batch_rings[i]);
+      if (r.head - r.tail == r.buf.size()) {
+        if (batch_cbs.empty()) { ++r.dropped; return NULL; }
+        flush_batch(i);
+      }
+      return &r.buf[(r.head++) & (r.buf.size() - 1)];
+    }
     
-    static int magic_cb_s(int cpu_id, uint64_t rax);
+    // QEMU calls back through plain functions that only carry a CPU index,
+    // so the trampolines are instantiated once per domain ID D and find their
+    // OSDomain in osdomains[D].
+    template <unsigned D> static int magic_cb_s(int cpu_id, uint64_t rax);
     int waiting_for_eip;
     int  magic_cb(int cpu_id, uint64_t rax);
-    static int atomic_cb_s(int cpu_id);
+    template <unsigned D> static int atomic_cb_s(int cpu_id);
     int  atomic_cb(int cpu_id);
 
-    static void inst_cb_s(int cpu_id, uint64_t va, uint64_t pa, 
-                          uint8_t l, const uint8_t *bytes,
-                          enum inst_type type);
+    template <unsigned D>
+      static void inst_cb_s(int cpu_id, uint64_t va, uint64_t pa,
+                            uint8_t l, const uint8_t *bytes,
+                            enum inst_type type);
     void inst_cb(int cpu_id, uint64_t va, uint64_t pa,
                  uint8_t l, const uint8_t *bytes, enum inst_type type);
-    static void mem_cb_s(int cpu_id, uint64_t va, uint64_t pa,
-                        uint8_t size, int type);
+    template <unsigned D>
+      static void mem_cb_s(int cpu_id, uint64_t va, uint64_t pa,
+                           uint8_t size, int type);
     void mem_cb(int cpu_id, uint64_t va, uint64_t pa,
                uint8_t size, int type);
-    static uint32_t *io_cb_s(int cpu_id, uint64_t port, uint8_t s, int type,
-                             uint32_t data);
+    template <unsigned D>
+      static uint32_t *io_cb_s(int cpu_id, uint64_t port, uint8_t s,
+                               int type, uint32_t data);
     uint32_t *io_cb(int cpu_id, uint64_t port, uint8_t s, int type,
                     uint32_t data);
-    static int int_cb_s(int cpu_id, uint8_t vec);
+    template <unsigned D> static int int_cb_s(int cpu_id, uint8_t vec);
     int int_cb(int cpu_id, uint8_t vec);
-    static void reg_cb_s(int cpu_id, int reg, uint8_t size, int type);
+    template <unsigned D>
+      static void reg_cb_s(int cpu_id, int reg, uint8_t size, int type);
     void reg_cb(int cpu_id, int reg, uint8_t size, int type);
-    static void trans_cb_s(int cpu_id);
+    template <unsigned D> static void trans_cb_s(int cpu_id);
     void trans_cb(int cpu_id);
 
-    static std::vector<OSDomain *> osdomains;
+    // The trampolines of one domain.
+    struct trampolines {
+      atomic_cb_t atomic;
+      magic_cb_t  magic;
+      inst_cb_t   inst;
+      mem_cb_t    mem;
+      io_cb_t     io;
+      int_cb_t    intr;
+      reg_cb_t    reg;
+      trans_cb_t  trans;
+    };
+    template <unsigned D> struct trampoline_table;
+    static trampolines tramps[MAX_DOMAINS];
+    const trampolines *tramp;   // &tramps[id]
+
+    // Live domains by ID. Slots are claimed and released under
+    // osdomains_lock; the trampolines read them without locking, which is
+    // safe since a domain's hooks are only installed after it claimed its ID.
+    static OSDomain *osdomains[MAX_DOMAINS];
+    static std::mutex osdomains_lock;
+    void release_id();
 
     qsim_mode mode;
 
@@ -737,21 +1782,29 @@ namespace Qsim {
     bool     flt_prot;
     bool     flt_real;
 
-    static std::vector<Queue*> *queues;
-
-    // The callbacks; static. Use queues[cpuid] to find the appropriate queue.
-    static void inst_cb_flt(int, uint64_t, uint64_t, uint8_t, const uint8_t *,
-                            enum inst_type);
-    static void inst_cb_hlt(int, uint64_t, uint64_t, uint8_t, const uint8_t *,
-                            enum inst_type);
-    static void inst_cb    (int, uint64_t, uint64_t, uint8_t, const uint8_t *,
-                            enum inst_type);
-
-    static void mem_cb     (int, uint64_t, uint64_t, uint8_t, int            );
-    static void mem_cb_flt (int, uint64_t, uint64_t, uint8_t, int            );
-
-    static int  int_cb     (int, uint8_t                                     );
-    static int  int_cb_flt (int, uint8_t                                     );
+    OSDomain::inst_cpu_handle_t icb_handle;
+    OSDomain::mem_cpu_handle_t  mcb_handle;
+    OSDomain::int_cpu_handle_t  intcb_handle;
+
+    // Register the callbacks matching the filter settings, replacing any
+    // registered before.
+    void connect(bool filtered);
+    void disconnect();
+    bool pass();
+
+    // The callbacks, registered for this queue's CPU only.
+    void inst_cb_flt(int, uint64_t, uint64_t, uint8_t, const uint8_t *,
+                     enum inst_type);
+    void inst_cb_hlt(int, uint64_t, uint64_t, uint8_t, const uint8_t *,
+                     enum inst_type);
+    void inst_cb    (int, uint64_t, uint64_t, uint8_t, const uint8_t *,
+                     enum inst_type);
+
+    void mem_cb     (int, uint64_t, uint64_t, uint8_t, int            );
+    void mem_cb_flt (int, uint64_t, uint64_t, uint8_t, int            );
+
+    int  int_cb     (int, uint8_t                                     );
+    int  int_cb_flt (int, uint8_t                                     );
   };
 
 };
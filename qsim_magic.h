@@ -11,6 +11,9 @@
 	asm volatile("msr pmcr_el0, %0" :: "r" (0xaaaaaaaa));
 #define qsim_magic_disable() 				\
 	asm volatile("msr pmcr_el0, %0" :: "r" (0xfa11dead));
+#define qsim_magic_roi(m, id)				\
+	asm volatile("msr pmcr_el0, %0" ::		\
+		     "r" ((unsigned long)((m) | ((id) & 0xffff))));
 
 #elif defined(__i386__) || defined(__x86_64__)
 
@@ -18,12 +21,20 @@
 	asm volatile("cpuid;"::"a"(0xaaaaaaaa):"ebx","ecx","edx");
 #define qsim_magic_disable()				\
 	asm volatile("cpuid;"::"a"(0xfa11dead):"ebx","ecx","edx");
+#define qsim_magic_roi(m, id)				\
+	asm volatile("cpuid;"::"a"((m) | ((id) & 0xffff))	\
+		     :"ebx","ecx","edx");
 
 #endif
 
 #define APP_START() qsim_magic_enable()
 #define APP_END()   qsim_magic_disable()
 
+/* Numbered regions of interest, 0-65535. They may nest. The host chooses
+ * which are instrumented with OSDomain::add_roi(). */
+#define QSIM_ROI_BEGIN(id) qsim_magic_roi(0xb10c0000u, id)
+#define QSIM_ROI_END(id)   qsim_magic_roi(0xe10c0000u, id)
+
 __attribute__((unused))
 static void qsim_sig_handler(int signo)
 {
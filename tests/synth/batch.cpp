@@ -0,0 +1,165 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Batched event mode: the records handed to batch callbacks, at ring flushes
+// and at the end of each run(), match the per-event callbacks one for one.
+#include <vector>
+
+#include <string.h>
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain; using Qsim::BatchItem;
+
+static const unsigned RING = 64;
+
+static BatchItem item(uint8_t t, uint8_t size, uint16_t type, uint32_t data,
+                      uint64_t va, uint64_t pa)
+{
+  BatchItem b;
+  b.cb_type = t; b.size = size; b.type = type; b.data = data;
+  b.vaddr = va; b.paddr = pa;
+  return b;
+}
+
+static bool same(const BatchItem &a, const BatchItem &b) {
+  return a.cb_type == b.cb_type && a.size == b.size && a.type == b.type &&
+         a.data == b.data && a.vaddr == b.vaddr && a.paddr == b.paddr;
+}
+
+struct Recorder {
+  Recorder(int n): want(n), got(n), flushes(0), big(0) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    want[c].push_back(item(BatchItem::INST, l, t, 0, va, pa));
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    want[c].push_back(item(BatchItem::MEM, s, t, 0, va, pa));
+  }
+
+  int intr(int c, uint8_t v) {
+    want[c].push_back(item(BatchItem::INTR, 0, 0, v, 0, 0));
+    return 0;
+  }
+
+  void reg(int c, int r, uint8_t s, int t) {
+    want[c].push_back(item(BatchItem::REG, s, t, r, 0, 0));
+  }
+
+  void batch(int c, const BatchItem *b, unsigned n) {
+    ++flushes;
+    if (n > RING) ++big;
+    got[c].insert(got[c].end(), b, b + n);
+  }
+
+  std::vector<std::vector<BatchItem> > want, got;
+  unsigned flushes, big;
+};
+
+// Every selected event reaches the batch callback, in order and with the
+// fields the per-event callback saw, and nothing is left in the ring when
+// run() returns.
+static void test_contents() {
+  OSDomain osd(2, "mem=0.4,regs=3", "synth");
+  Recorder r(2);
+
+  osd.set_inst_cb(&r, &Recorder::inst);
+  osd.set_mem_cb(&r, &Recorder::mem);
+  osd.set_int_cb(&r, &Recorder::intr);
+  osd.set_reg_cb(&r, &Recorder::reg);
+  OSDomain::batch_cb_handle_t h(osd.set_batch_cb(&r, &Recorder::batch));
+  osd.enable_batching(RING, OSDomain::BATCH_INST | OSDomain::BATCH_MEM |
+                            OSDomain::BATCH_INT | OSDomain::BATCH_REG);
+
+  for (int k = 0; k < 10; ++k) {
+    osd.interrupt(0, 0x40 + k);
+    osd.run(0, 333);
+    osd.run(1, 333);
+
+    BatchItem left;
+    CHECK_EQ(osd.pull_batch(0, &left, 1), 0u);
+    CHECK_EQ(osd.pull_batch(1, &left, 1), 0u);
+    CHECK_EQ(r.got[0].size(), r.want[0].size());
+    CHECK_EQ(r.got[1].size(), r.want[1].size());
+  }
+
+  CHECK(r.want[0].size() > 3330);
+  CHECK(r.want[1].size() > 3330);
+  CHECK(r.flushes > 2 * r.want[0].size() / RING);
+  CHECK_EQ(r.big, 0u);
+
+  unsigned ints = 0;
+  for (int c = 0; c < 2; ++c) {
+    size_t bad = 0;
+    for (size_t i = 0; i < r.want[c].size() && i < r.got[c].size(); ++i) {
+      if (!same(r.want[c][i], r.got[c][i])) ++bad;
+      if (r.got[c][i].cb_type == BatchItem::INTR) ++ints;
+    }
+    CHECK_EQ(bad, 0u);
+    CHECK_EQ(osd.batch_dropped(c), 0u);
+  }
+  CHECK_EQ(ints, 10u);
+
+  // Only the selected kinds are recorded.
+  osd.enable_batching(RING, OSDomain::BATCH_MEM);
+  size_t before = r.got[0].size(), mems = 0;
+  osd.run(0, 500);
+  for (size_t i = before; i < r.got[0].size(); ++i)
+    if (r.got[0][i].cb_type == BatchItem::MEM) ++mems;
+  CHECK(r.got[0].size() > before);
+  CHECK_EQ(mems, r.got[0].size() - before);
+
+  osd.unset_batch_cb(h);
+  osd.disable_batching();
+  before = r.got[0].size();
+  osd.run(0, 500);
+  CHECK_EQ(r.got[0].size(), before);
+}
+
+// Without a batch callback the ring fills and drops; pull_batch() returns
+// the oldest records and flush_batch() delivers the rest.
+static void test_pull() {
+  OSDomain osd(1, "mem=0", "synth");
+  Recorder r(1);
+
+  osd.set_inst_cb(&r, &Recorder::inst);
+  osd.enable_batching(RING, OSDomain::BATCH_INST);
+  osd.run(0, 1000);
+
+  CHECK_EQ(r.want[0].size(), 1000u);
+  CHECK_EQ(osd.batch_dropped(0), 1000u - RING);
+
+  BatchItem out[RING / 2];
+  CHECK_EQ(osd.pull_batch(0, out, RING / 2), RING / 2);
+  size_t bad = 0;
+  for (unsigned i = 0; i < RING / 2; ++i)
+    if (!same(out[i], r.want[0][i])) ++bad;
+  CHECK_EQ(bad, 0u);
+
+  osd.set_batch_cb(&r, &Recorder::batch);
+  osd.flush_batch(0);
+  CHECK_EQ(r.got[0].size(), RING / 2);
+  bad = 0;
+  for (unsigned i = 0; i < r.got[0].size(); ++i)
+    if (!same(r.got[0][i], r.want[0][RING / 2 + i])) ++bad;
+  CHECK_EQ(bad, 0u);
+  CHECK_EQ(osd.pull_batch(0, out, 1), 0u);
+}
+
+int main() {
+  test_contents();
+  test_pull();
+
+  return check_result("batch");
+}
@@ -0,0 +1,110 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Block memory access: mem_rd_block() and mem_wr_block(), physical and
+// virtual, round-trip data across page boundaries, agree with single-value
+// reads and writes, and reach what the guest executes. A block that runs off
+// the end of RAM takes the library's own path, which wraps on synth.
+#include <vector>
+
+#include <string.h>
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const uint64_t PAGE = 4096;
+
+static std::vector<uint8_t> pattern(size_t n, uint8_t seed) {
+  std::vector<uint8_t> v(n);
+  for (size_t i = 0; i < n; ++i) v[i] = seed + i * 7 + (i >> 8);
+  return v;
+}
+
+struct Bytes {
+  Bytes(): seen(0) { memset(at, 0, sizeof at); }
+
+  // Keep the bytes of the four instructions around the first page boundary.
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    if (va >= PAGE - 8 && va < PAGE + 8) {
+      memcpy(at + (va - (PAGE - 8)), b, l);
+      ++seen;
+    }
+  }
+
+  uint8_t at[16];
+  unsigned seen;
+};
+
+int main() {
+  OSDomain osd(1, "br=0,mem=0", "synth");
+
+  // Nearly three pages, starting just short of a page boundary.
+  const uint64_t base = 0x200000 - 123;
+  std::vector<uint8_t> in(pattern(3 * PAGE - 5, 11)), out(in.size());
+  osd.mem_wr_block(base, &in[0], in.size());
+  osd.mem_rd_block(base, &out[0], out.size());
+  CHECK(in == out);
+
+  size_t bad = 0;
+  for (size_t i = 0; i < in.size(); ++i) {
+    uint8_t b;
+    osd.mem_rd(b, base + i);
+    if (b != in[i]) ++bad;
+  }
+  CHECK_EQ(bad, 0u);
+
+  // Virtual blocks; synth maps virtual addresses one to one.
+  std::vector<uint8_t> vin(pattern(PAGE + 33, 99)), vout(vin.size());
+  osd.mem_wr_virt_block(0, base + 1000, &vin[0], vin.size());
+  osd.mem_rd_block(base + 1000, &out[0], vin.size());
+  CHECK(!memcmp(&out[0], &vin[0], vin.size()));
+  osd.mem_rd_virt_block(0, base + 1000, &vout[0], vout.size());
+  CHECK(vin == vout);
+
+  // Typed values are little-endian copies, straddling a page boundary too.
+  const uint64_t edge = 0x300000 - 3;
+  osd.mem_wr<uint64_t>(0x0123456789abcdefull, edge);
+  uint64_t v;
+  osd.mem_rd(v, edge);
+  CHECK_EQ(v, 0x0123456789abcdefull);
+  uint8_t lo, hi;
+  osd.mem_rd(lo, edge);
+  osd.mem_rd(hi, edge + 7);
+  CHECK_EQ(lo, 0xef);
+  CHECK_EQ(hi, 0x01);
+  uint32_t w;
+  osd.mem_rd_virt(0, w, edge + 2);
+  CHECK_EQ(w, 0x456789abu);
+
+  // Past the end of RAM no single mapping covers the block, so it goes
+  // through the library, which wraps to address 0.
+  const uint64_t ram = uint64_t(osd.get_ram_size_mb()) << 20;
+  std::vector<uint8_t> wrap(pattern(16, 200)), back(16), low(8);
+  osd.mem_wr_block(ram - 8, &wrap[0], 16);
+  osd.mem_rd_block(ram - 8, &back[0], 16);
+  CHECK(wrap == back);
+  osd.mem_rd_block(0, &low[0], 8);
+  CHECK(!memcmp(&low[0], &wrap[8], 8));
+
+  // Code written across the first page boundary is what CPU 0 then runs.
+  std::vector<uint8_t> code(pattern(16, 0x40));
+  osd.mem_wr_block(PAGE - 8, &code[0], 16);
+  Bytes b;
+  osd.set_inst_cb(&b, &Bytes::inst);
+  osd.run(0, PAGE / 4 + 2);
+  CHECK_EQ(b.seen, 4u);
+  CHECK(!memcmp(b.at, &code[0], 16));
+
+  return check_result("blocks");
+}
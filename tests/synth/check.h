@@ -0,0 +1,35 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Assertions for the synthetic backend tests. A failed CHECK() reports itself
+// and the test carries on; check_result() prints the verdict and gives the
+// exit status.
+#ifndef __QSIM_TEST_CHECK_H
+#define __QSIM_TEST_CHECK_H
+
+#include <iostream>
+
+static unsigned check_failures;
+
+#define CHECK(c) do { if (!(c)) {                                        \
+  std::cerr << __FILE__ << ':' << __LINE__ << ": CHECK(" #c ") failed\n"; \
+  ++check_failures;                                                       \
+} } while (0)
+
+#define CHECK_EQ(a, b) do { if (!((a) == (b))) {                          \
+  std::cerr << __FILE__ << ':' << __LINE__ << ": CHECK_EQ(" #a ", " #b    \
+               ") failed: " << (a) << " != " << (b) << '\n';              \
+  ++check_failures;                                                       \
+} } while (0)
+
+static inline int check_result(const char *name) {
+  std::cout << name << ": " << (check_failures ? "FAILED" : "ok") << '\n';
+  return check_failures ? 1 : 0;
+}
+
+#endif
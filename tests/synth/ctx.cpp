@@ -0,0 +1,100 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Context cache: get_prot(), get_mode() and get_tid() inside callbacks agree
+// with the CPU's registers as system calls move it between user mode and the
+// kernel, including when callback generation is turned off partway through a
+// slice and back on after system calls the cache never saw.
+#include <vector>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const int CPUS = 2;
+static const char *SPEC = "sys=0.02,roi=50,mem=0.2";
+
+enum toggle { NONE, PER_CPU, GLOBAL, ROI };
+
+struct Checker {
+  Checker(OSDomain &osd, toggle how):
+    osd(osd), how(how), last(CPUS, 2), bad(0), insts(0), kern(0), changed(0)
+  {
+    osd.set_inst_cb(this, &Checker::inst);
+    osd.set_magic_cb(this, &Checker::magic);
+  }
+
+  // CS is even in the kernel, odd in user mode.
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    int user = osd.get_reg(c, QSIM_X86_CS) & 1;
+    if (osd.get_prot(c) != (user ? OSDomain::PROT_USER : OSDomain::PROT_KERN))
+      ++bad;
+    if (osd.get_mode(c) != OSDomain::MODE_PROT) ++bad;
+    if (osd.get_tid(c) != c + 1) ++bad;
+
+    ++insts;
+    if (!user) ++kern;
+    if (last[c] != 2 && last[c] != user) ++changed;
+    last[c] = user;
+  }
+
+  // Generation goes off at begin 1 and comes back at end 1, 150
+  // instructions later, in the same slice.
+  int magic(int c, uint64_t rax) {
+    bool on;
+    if (rax == 0xb10c0001) on = false;
+    else if (rax == 0xe10c0001) on = true;
+    else return 0;
+
+    if (how == PER_CPU) osd.set_gen_cbs(c, on);
+    else if (how == GLOBAL) osd.set_gen_cbs(on);
+    return 0;
+  }
+
+  OSDomain &osd;
+  toggle how;
+  std::vector<int> last;  // Mode at the last callback; 2 before the first
+  unsigned bad, insts, kern, changed;
+};
+
+static void check(toggle how) {
+  OSDomain osd(CPUS, SPEC, "synth");
+  Checker k(osd, how);
+  if (how == ROI) osd.add_roi(2);
+
+  for (int i = 0; i < 20; ++i)
+    for (int c = 0; c < CPUS; ++c) osd.run(c, 1000);
+
+  CHECK_EQ(k.bad, 0u);
+  CHECK(k.insts >= 10000u);
+  CHECK(k.kern > k.insts / 4);
+  CHECK(k.kern < k.insts * 3 / 4);
+  CHECK(k.changed > 50u);
+
+  // Between runs the cache is rebuilt from the registers.
+  for (int c = 0; c < CPUS; ++c) {
+    int user = osd.get_reg(c, QSIM_X86_CS) & 1;
+    CHECK_EQ(osd.get_prot(c), user ? OSDomain::PROT_USER
+                                   : OSDomain::PROT_KERN);
+  }
+}
+
+int main() {
+  check(NONE);
+  check(PER_CPU);
+  check(GLOBAL);
+  check(ROI);
+
+  return check_result("ctx");
+}
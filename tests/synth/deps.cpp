@@ -0,0 +1,171 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Dependency callbacks: each instruction's reg_deps holds exactly the
+// registers and flags its register callbacks report, in every word of the
+// masks, and is delivered once, before the CPU's next instruction or
+// interrupt or when run() returns, whether or not register callbacks are
+// registered alongside.
+#include <vector>
+
+#include <stdint.h>
+#include <string.h>
+
+#include <qsim.h>
+#include <qsim-x86-regs.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+typedef OSDomain::reg_deps reg_deps;
+
+static const int CPUS = 2;
+static const unsigned N = 5000;
+
+// Every register, eight of them per instruction, and the flags.
+static const char *SPEC = "regs=8,reg_set=75,flags=1";
+
+static uint64_t mix(uint64_t h, uint64_t v) {
+  return (h ^ v) * 0x100000001b3ull;
+}
+
+static uint64_t hash(const reg_deps &d) {
+  uint64_t h = mix(mix(mix(0xcbf29ce484222325ull, d.pc), d.len), d.type);
+  for (unsigned w = 0; w < reg_deps::WORDS; ++w)
+    h = mix(mix(h, d.src[w]), d.dst[w]);
+  return mix(mix(h, d.fsrc), d.fdst);
+}
+
+// Builds each instruction's record from the instruction and register
+// callbacks and compares it with the one the dependency callback gets.
+struct Checker {
+  Checker(): cur(CPUS), open(CPUS), insts(CPUS), deps(CPUS), bad(0),
+             upper(0), flags(0), traces(CPUS) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    // The previous instruction's record has been delivered already.
+    if (open[c]) ++bad;
+    reg_deps &d(cur[c]);
+    memset(&d, 0, sizeof d);
+    d.pc = va; d.paddr = pa; d.len = l; d.type = t;
+    open[c] = true;
+    ++insts[c];
+  }
+
+  void reg(int c, int r, uint8_t size, int type) {
+    reg_deps &d(cur[c]);
+    if (size == 0) (type ? d.fdst : d.fsrc) |= r;
+    else (type ? d.dst : d.src)[r/64] |= uint64_t(1) << (r%64);
+    if (size == 0) ++flags;
+    else if (r >= 64) ++upper;
+  }
+
+  void dep(int c, const reg_deps &d) {
+    const reg_deps &e(cur[c]);
+    if (!open[c]) ++bad;
+    open[c] = false;
+    ++deps[c];
+    traces[c] = mix(traces[c], hash(d));
+
+    if (d.pc != e.pc || d.paddr != e.paddr || d.len != e.len ||
+        d.type != e.type || d.fsrc != e.fsrc || d.fdst != e.fdst ||
+        memcmp(d.src, e.src, sizeof d.src) ||
+        memcmp(d.dst, e.dst, sizeof d.dst)) ++bad;
+
+    for (int r = 0; r < 64*int(reg_deps::WORDS); ++r)
+      if (d.reads(r) != bool((e.src[r/64] >> (r%64)) & 1) ||
+          d.writes(r) != bool((e.dst[r/64] >> (r%64)) & 1)) ++bad;
+  }
+
+  // Interrupts come between instructions, after the last one's record.
+  int intr(int c, uint8_t v) {
+    if (open[c]) ++bad;
+    return 0;
+  }
+
+  std::vector<reg_deps> cur;
+  std::vector<bool> open;
+  std::vector<uint64_t> insts, deps;
+  unsigned bad;
+  uint64_t upper, flags;        // Registers past the first word, flags
+  std::vector<uint64_t> traces;
+};
+
+// Records only: what the checker's domain delivered, without register
+// callbacks to compare with.
+struct Trace {
+  Trace(): deps(CPUS), traces(CPUS) {}
+
+  void dep(int c, const reg_deps &d) {
+    ++deps[c];
+    traces[c] = mix(traces[c], hash(d));
+  }
+
+  std::vector<uint64_t> deps, traces;
+};
+
+static void test_stream(Checker &k) {
+  OSDomain osd(CPUS, SPEC, "synth");
+  osd.set_inst_cb(&k, &Checker::inst);
+  osd.set_reg_cb(&k, &Checker::reg);
+  osd.set_dep_cb(&k, &Checker::dep);
+  osd.set_int_cb(&k, &Checker::intr);
+
+  for (unsigned i = 0; i < 10; ++i) {
+    for (int c = 0; c < CPUS; ++c) {
+      osd.run(c, N / 10);
+      // Each run's last record is delivered as it returns.
+      CHECK_EQ(k.deps[c], k.insts[c]);
+    }
+    if (i == 5) osd.interrupt(1, 0x41);
+  }
+
+  CHECK_EQ(k.bad, 0u);
+  CHECK(k.upper > 0);
+  CHECK(k.flags > 0);
+  for (int c = 0; c < CPUS; ++c) CHECK(k.insts[c] >= N);
+}
+
+// Without register callbacks the records are the same, and per-CPU
+// registrations see their own CPU only.
+static void test_alone(const Checker &k) {
+  OSDomain osd(CPUS, SPEC, "synth");
+  Trace all, one;
+  osd.set_dep_cb(&all, &Trace::dep);
+  OSDomain::dep_cpu_handle_t h = osd.set_dep_cb(1, &one, &Trace::dep);
+
+  for (unsigned i = 0; i < 10; ++i) {
+    for (int c = 0; c < CPUS; ++c) osd.run(c, N / 10);
+    if (i == 5) osd.interrupt(1, 0x41);
+  }
+
+  for (int c = 0; c < CPUS; ++c) {
+    CHECK_EQ(all.deps[c], k.deps[c]);
+    CHECK_EQ(all.traces[c], k.traces[c]);
+  }
+  CHECK_EQ(one.deps[0], 0u);
+  CHECK_EQ(one.deps[1], k.deps[1]);
+  CHECK_EQ(one.traces[1], k.traces[1]);
+
+  // Unregistered, they get nothing more.
+  osd.unset_dep_cb(1, h);
+  osd.run(1, 100);
+  CHECK_EQ(one.deps[1], k.deps[1]);
+  CHECK(all.deps[1] > k.deps[1]);
+}
+
+int main() {
+  Checker k;
+  test_stream(k);
+  test_alone(k);
+
+  return check_result("deps");
+}
@@ -0,0 +1,134 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Callback binding: handlers bound at compile time, through a member
+// function pointer at run time, or as plain functions are all called with
+// the same arguments and results, in registration order, domain-wide before
+// per-CPU, and each form can be removed on its own.
+#include <vector>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain; using Qsim::Callback;
+
+typedef Callback<int, int, uint8_t> int_fn;
+
+static int plain_calls;
+static int plain(int c, uint8_t v) { ++plain_calls; return v == 7; }
+
+struct Handler {
+  Handler(char tag, std::vector<char> *log):
+    tag(tag), log(log), insts(0), mems(0), ints(0), regs(0) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    log->push_back(tag);
+    ++insts;
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) { ++mems; }
+  int intr(int c, uint8_t v) { ++ints; return v == tag; }
+  void reg(int c, int r, uint8_t s, int t) { ++regs; }
+
+  char tag;
+  std::vector<char> *log;
+  uint64_t insts, mems, ints, regs;
+};
+
+// The three forms of Callback on their own.
+static void test_bind() {
+  std::vector<char> log;
+  Handler h(7, &log);
+
+  int_fn bound(int_fn::bind<Handler, &Handler::intr>(&h)),
+         member(int_fn::bind(&h, &Handler::intr)),
+         fn(int_fn::bind(plain));
+
+  CHECK_EQ(bound(0, 7), 1);
+  CHECK_EQ(member(0, 8), 0);
+  CHECK_EQ(fn(0, 7), 1);
+  CHECK_EQ(h.ints, 2u);
+  CHECK_EQ(plain_calls, 1);
+
+  // Only the run-time forms own heap state.
+  CHECK(bound.del == NULL);
+  CHECK(bound.obj == &h);
+  CHECK(member.del != NULL);
+  CHECK(fn.del != NULL);
+  member.release();
+  fn.release();
+}
+
+static void test_domain() {
+  OSDomain osd(2, "mem=0.5,regs=2", "synth");
+  std::vector<char> log;
+  Handler a('a', &log), b('b', &log), c('c', &log);
+
+  // Registered out of the order they are called in: domain-wide a then b,
+  // then c on CPU 0 only.
+  OSDomain::inst_cpu_handle_t hc(
+    osd.set_inst_cb<Handler, &Handler::inst>(0, &c));
+  OSDomain::inst_cb_handle_t ha(osd.set_inst_cb<Handler, &Handler::inst>(&a));
+  OSDomain::inst_cb_handle_t hb(osd.set_inst_cb(&b, &Handler::inst));
+  osd.set_mem_cb<Handler, &Handler::mem>(&a);
+  osd.set_mem_cb(&b, &Handler::mem);
+  osd.set_int_cb<Handler, &Handler::intr>(&a);
+  osd.set_int_cb(&b, &Handler::intr);
+  osd.set_reg_cb<Handler, &Handler::reg>(&a);
+  osd.set_reg_cb(&b, &Handler::reg);
+
+  osd.interrupt(0, 'a');
+  osd.run(0, 1000);
+
+  CHECK_EQ(a.insts, 1000u);
+  CHECK_EQ(b.insts, 1000u);
+  CHECK_EQ(c.insts, 1000u);
+  CHECK_EQ(a.mems, b.mems);
+  CHECK(a.mems > 0);
+  CHECK_EQ(a.regs, 2000u);
+  CHECK_EQ(b.regs, 2000u);
+  CHECK_EQ(a.ints, 1u);
+  CHECK_EQ(b.ints, 1u);
+
+  size_t bad = 0;
+  for (size_t i = 0; i < log.size(); ++i)
+    if (log[i] != "abc"[i % 3]) ++bad;
+  CHECK_EQ(log.size(), 3000u);
+  CHECK_EQ(bad, 0u);
+
+  // CPU 1 only reaches the domain-wide handlers.
+  osd.run(1, 500);
+  CHECK_EQ(a.insts, 1500u);
+  CHECK_EQ(c.insts, 1000u);
+
+  // Removing one form leaves the others in place.
+  osd.unset_inst_cb(ha);
+  osd.run(0, 100);
+  CHECK_EQ(a.insts, 1500u);
+  CHECK_EQ(b.insts, 1600u);
+  CHECK_EQ(c.insts, 1100u);
+
+  osd.unset_inst_cb(hb);
+  osd.unset_inst_cb(0, hc);
+  log.clear();
+  osd.run(0, 100);
+  CHECK(log.empty());
+  CHECK_EQ(a.regs, 3400u);
+}
+
+int main() {
+  test_bind();
+  test_domain();
+
+  return check_result("dispatch");
+}
@@ -0,0 +1,162 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Several OSDomains in one process: each has its own ID, CPU count and
+// instruction stream, identical to what it produces alone, whether the
+// domains run one after another or on host threads of their own, and
+// whether they are created up front or by those threads.
+#include <vector>
+#include <thread>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const int DOMAINS = 3;
+static const unsigned SLICE = 1000, SLICES = 5;
+
+// Domain d has d + 1 CPUs and its own seed.
+static int cpus(int d) { return d + 1; }
+static const char *spec(int d) {
+  static const char *s[DOMAINS] = {
+    "mem=0.5,wr=0.3,seed=1", "mem=0.5,wr=0.3,seed=2", "mem=0.5,wr=0.3,seed=3"
+  };
+  return s[d];
+}
+
+// A digest of everything a domain's callbacks report.
+struct Trace {
+  Trace(OSDomain &osd): insts(0), mems(0), hash(0) {
+    osd.set_inst_cb(this, &Trace::inst);
+    osd.set_mem_cb(this, &Trace::mem);
+  }
+
+  void mix(uint64_t v) { hash = (hash ^ v) * 0x100000001b3ull; }
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++insts;
+    mix(c); mix(va); mix(pa); mix(t);
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    ++mems;
+    mix(va); mix(s); mix(t);
+  }
+
+  uint64_t insts, mems, hash;
+};
+
+struct Result { uint64_t insts, mems, hash; int n_cpus; };
+
+static Result run(OSDomain &osd, Trace &t) {
+  for (unsigned k = 0; k < SLICES; ++k)
+    for (int c = 0; c < osd.get_n(); ++c) osd.run(c, SLICE);
+  Result r = { t.insts, t.mems, t.hash, osd.get_n() };
+  return r;
+}
+
+static Result alone(int d) {
+  OSDomain osd(cpus(d), spec(d), "synth");
+  Trace t(osd);
+  return run(osd, t);
+}
+
+static bool same(const Result &a, const Result &b) {
+  return a.insts == b.insts && a.mems == b.mems && a.hash == b.hash &&
+         a.n_cpus == b.n_cpus;
+}
+
+// Created up front, then each run by a thread of its own.
+static void run_on(OSDomain *osd, Trace *t, Result *r) { *r = run(*osd, *t); }
+
+static void test_threads(const Result *ref) {
+  std::vector<OSDomain*> osd;
+  std::vector<Trace*> t;
+  for (int d = 0; d < DOMAINS; ++d) {
+    osd.push_back(new OSDomain(cpus(d), spec(d), "synth"));
+    t.push_back(new Trace(*osd[d]));
+  }
+
+  for (int d = 0; d < DOMAINS; ++d)
+    for (int e = 0; e < d; ++e) CHECK(osd[d]->get_id() != osd[e]->get_id());
+
+  Result r[DOMAINS];
+  std::vector<std::thread> th;
+  for (int d = 0; d < DOMAINS; ++d)
+    th.push_back(std::thread(run_on, osd[d], t[d], &r[d]));
+  for (int d = 0; d < DOMAINS; ++d) th[d].join();
+
+  for (int d = 0; d < DOMAINS; ++d) {
+    CHECK_EQ(r[d].insts, uint64_t(cpus(d)) * SLICE * SLICES);
+    CHECK(same(r[d], ref[d]));
+    delete t[d];
+    delete osd[d];
+  }
+}
+
+// Created, run and destroyed by each thread, twice over.
+static void own(int d, Result *r) {
+  for (int k = 0; k < 2; ++k) r[k] = alone(d);
+}
+
+static void test_create(const Result *ref) {
+  Result r[DOMAINS][2];
+  std::vector<std::thread> th;
+  for (int d = 0; d < DOMAINS; ++d) th.push_back(std::thread(own, d, r[d]));
+  for (int d = 0; d < DOMAINS; ++d) th[d].join();
+
+  for (int d = 0; d < DOMAINS; ++d)
+    for (int k = 0; k < 2; ++k) CHECK(same(r[d][k], ref[d]));
+}
+
+// A destroyed domain's ID goes to the next one created, and Queue only sees
+// its own domain.
+static void test_reuse() {
+  OSDomain *a = new OSDomain(cpus(0), spec(0), "synth");
+  OSDomain b(cpus(1), spec(1), "synth");
+  int id = a->get_id();
+  CHECK(b.get_id() != id);
+  delete a;
+
+  OSDomain c(cpus(0), spec(0), "synth");
+  CHECK_EQ(c.get_id(), id);
+
+  Qsim::Queue qc(c, 0, false), qb(b, 1, false);
+  c.run(0, SLICE);
+  CHECK(qb.empty());
+  b.run(0, SLICE);
+  b.run(1, SLICE);
+  CHECK(qc.size() > SLICE);
+  CHECK(qb.size() > SLICE);
+
+  unsigned insts = 0, bad = 0;
+  for (; !qb.empty(); qb.pop()) {
+    if (qb.front().id != 1) ++bad;
+    if (qb.front().cb_type == Qsim::QueueItem::INST) ++insts;
+  }
+  CHECK_EQ(insts, SLICE);
+  CHECK_EQ(bad, 0u);
+}
+
+int main() {
+  Result ref[DOMAINS];
+  for (int d = 0; d < DOMAINS; ++d) ref[d] = alone(d);
+  CHECK(ref[0].hash != ref[1].hash);
+
+  test_threads(ref);
+  test_create(ref);
+  test_reuse();
+
+  return check_result("domains");
+}
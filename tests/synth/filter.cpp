@@ -0,0 +1,195 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Callback filters: each registration only sees the events its cb_filter
+// accepts, as worked out by hand from an unfiltered reference, and address
+// ranges cost the same however large they are.
+#include <vector>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const unsigned CODE_FP = 64 << 10;   // Synth default code_fp
+
+// Reference for the filter test: every event, with the predicates the
+// filters should apply computed by hand.
+struct FilterRef {
+  FilterRef(): insts(0), page1(0), span(0), brs(0), cpu1(0), mem_pages(0) {
+    pc[0] = pc[1] = 0;
+  }
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++insts;
+    if (va >> 12 == 1) ++page1;
+    if (va >> 12 == 2 || va >> 12 == 3) ++span;
+    if (t == QSIM_INST_BR) ++brs;
+    if (c == 1) ++cpu1;
+    pc[c] = va;
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    if (pa >> 12 == 2*CODE_FP >> 12) ++mem_pages;
+  }
+
+  uint64_t insts, page1, span, brs, cpu1, mem_pages;
+  uint64_t pc[2];
+};
+
+struct FilterCount {
+  FilterCount(FilterRef &r): n(0), bad(0), ref(r) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++n;
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) { ++n; }
+
+  // mem_access must agree with what the plain callbacks report.
+  void mem_ex(int c, const OSDomain::mem_access &a) {
+    ++n;
+    if (a.pc != ref.pc[c] || a.tid != c + 1 ||
+        a.prot != OSDomain::PROT_USER || a.vaddr != a.paddr)
+      ++bad;
+  }
+
+  uint64_t n, bad;
+  FilterRef &ref;
+};
+
+// Address ranges on their own. Overlapping and touching ranges merge, the
+// gaps between them stay out, and ranges spanning most of the address space
+// are no dearer than a page.
+static void test_ranges() {
+  OSDomain::cb_filter f;
+  f.vaddr(0x5000, 0x6000);
+  f.vaddr(0x1000, 0x2000);
+  f.vaddr(0x2000, 0x2001);                  // Touches the first run
+  f.vaddr(0x9000, 0x9000);                  // Empty
+  CHECK(!f.match_addr(0xfff, 0));
+  CHECK(f.match_addr(0x1000, 0));
+  CHECK(f.match_addr(0x2fff, 0));
+  CHECK(!f.match_addr(0x3000, 0));
+  CHECK(!f.match_addr(0x4fff, 0));
+  CHECK(f.match_addr(0x5000, 0));
+  CHECK(!f.match_addr(0x6000, 0));
+  CHECK(!f.match_addr(0x9000, 0));
+
+  f.vaddr(0x3800, 0x4100);                  // Bridges both runs
+  for (uint64_t a = 0x1000; a < 0x6000; a += 0x100)
+    CHECK(f.match_addr(a, 0));
+
+  OSDomain::cb_filter big;
+  big.vaddr(0, 1ull << 48);
+  big.paddr(1ull << 40, ~0ull);
+  CHECK(big.match_addr(0, 1ull << 40));
+  CHECK(big.match_addr((1ull << 48) - 1, ~0ull));
+  CHECK(!big.match_addr(1ull << 48, 1ull << 40));
+  CHECK(!big.match_addr(0, (1ull << 40) - 1));
+
+  // Many random ranges, against a linear search of what was added.
+  OSDomain::cb_filter r;
+  std::vector<std::pair<uint64_t, uint64_t> > added;
+  uint64_t x = 88172645463325252ull;
+  for (unsigned k = 0; k < 2000; ++k) {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    uint64_t start = x % (1ull << 32), len = (x >> 40) % (1 << 20);
+    r.vaddr(start, start + len);
+    if (len) added.push_back(std::make_pair(start >> 12,
+                                            (start + len - 1) >> 12));
+  }
+  size_t bad = 0;
+  for (unsigned k = 0; k < 20000; ++k) {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    uint64_t a = x % (1ull << 32) + (x >> 60), p = a >> 12;
+    bool in = false;
+    for (size_t i = 0; i < added.size() && !in; ++i)
+      in = p >= added[i].first && p <= added[i].second;
+    if (r.match_addr(a, 0) != in) ++bad;
+  }
+  CHECK_EQ(bad, 0u);
+}
+
+static void test_filter() {
+  // Two CPUs with the default 64K code footprint: CPU 0's code is at
+  // [0, 64K) and CPU 1's at [64K, 128K), and the shared data starts at 128K.
+  OSDomain osd(2, "mem=0.5,share=0.5,shared_fp=8K,br=0.3,taken=0.5",
+               "synth");
+  FilterRef ref;
+  FilterCount user(ref), kern(ref), page1(ref), span(ref), brs(ref),
+              cpu1(ref), mem_page(ref), ex(ref), all(ref);
+
+  // The reference callbacks are registered first so they run first.
+  osd.set_inst_cb(&ref, &FilterRef::inst);
+  osd.set_mem_cb(&ref, &FilterRef::mem);
+
+  OSDomain::cb_filter f_user, f_kern, f_page1, f_span, f_br, f_tid,
+                      f_mem, f_ex, f_all;
+  f_user.prot(OSDomain::PROT_USER);
+  f_kern.prot(OSDomain::PROT_KERN);
+  f_page1.vaddr(0x1ff0, 0x1ff4);            // Rounds out to page 1
+  f_span.vaddr(0x2ffc, 0x3004);             // Straddles pages 2 and 3
+  f_br.inst(QSIM_INST_BR);
+  f_tid.tid(2);                             // CPU 1's task
+  f_mem.paddr(2*CODE_FP + 0x800, 2*CODE_FP + 0x801);
+  f_ex.prot(OSDomain::PROT_USER).tid(1).tid(2);
+  f_all.vaddr(0, 1ull << 48).paddr(0, 1ull << 48);
+
+  osd.set_inst_cb(f_user, &user, &FilterCount::inst);
+  OSDomain::inst_flt_handle_t hk(
+    osd.set_inst_cb(f_kern, &kern, &FilterCount::inst));
+  osd.set_inst_cb(f_page1, &page1, &FilterCount::inst);
+  osd.set_inst_cb(f_span, &span, &FilterCount::inst);
+  osd.set_inst_cb(f_br, &brs, &FilterCount::inst);
+  OSDomain::inst_flt_handle_t ht(
+    osd.set_inst_cb(f_tid, &cpu1, &FilterCount::inst));
+  osd.set_mem_cb(f_mem, &mem_page, &FilterCount::mem);
+  osd.set_mem_cb_ex(f_ex, &ex, &FilterCount::mem_ex);
+  osd.set_inst_cb(f_all, &all, &FilterCount::inst);
+
+  for (int k = 0; k < 20; ++k) { osd.run(0, 1000); osd.run(1, 1000); }
+
+  CHECK_EQ(ref.insts, 40000u);
+  CHECK_EQ(user.n, ref.insts);
+  CHECK_EQ(all.n, ref.insts);
+  CHECK_EQ(kern.n, 0u);
+  CHECK(ref.page1 > 0);
+  CHECK_EQ(page1.n, ref.page1);
+  CHECK(ref.span > 0);
+  CHECK_EQ(span.n, ref.span);
+  CHECK(ref.brs > 0);
+  CHECK_EQ(brs.n, ref.brs);
+  CHECK_EQ(ref.cpu1, 20000u);
+  CHECK_EQ(cpu1.n, ref.cpu1);
+  CHECK(ref.mem_pages > 0);
+  CHECK_EQ(mem_page.n, ref.mem_pages);
+  CHECK(ex.n > 0);
+  CHECK_EQ(ex.bad, 0u);
+
+  // Unset filtered callbacks stop receiving events.
+  osd.unset_inst_cb(hk);
+  osd.unset_inst_cb(ht);
+  osd.run(0, 1000); osd.run(1, 1000);
+  CHECK_EQ(cpu1.n, 20000u);
+  CHECK_EQ(user.n, 42000u);
+}
+
+int main() {
+  test_ranges();
+  test_filter();
+
+  return check_result("filter");
+}
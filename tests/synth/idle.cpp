@@ -0,0 +1,152 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Idle skip: a CPU that enters its idle loop stops being emulated at once
+// and is skipped to its next timer tick or interrupt, with get_icount() and
+// get_skipped() accounting for every instruction, whatever slices run() is
+// given. Without the automatic timer nothing is skipped, and ParallelRunner
+// ends the quantum of a paced CPU that is only being skipped.
+#include <vector>
+
+#include <stdint.h>
+
+#include <qsim.h>
+#include <qsim-runner.h>
+
+#include "check.h"
+
+using Qsim::OSDomain; using Qsim::ParallelRunner;
+
+// Each CPU runs this many instructions after an interrupt, then idles.
+static const uint64_t BUSY = 300;
+static const char *SPEC = "idle=300";
+
+struct Events {
+  Events(int n): insts(n), ints(n) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++insts[c];
+  }
+
+  int intr(int c, uint8_t v) { ++ints[c]; return 0; }
+
+  std::vector<uint64_t> insts, ints;
+};
+
+static void attach(OSDomain &osd, Events &e) {
+  osd.set_inst_cb(&e, &Events::inst);
+  osd.set_int_cb(&e, &Events::intr);
+}
+
+// Without idle skip, or without the timer, idle CPUs are emulated.
+static void test_off() {
+  for (int timer = 0; timer < 2; ++timer) {
+    OSDomain osd(1, SPEC, "synth");
+    Events e(1);
+    attach(osd, e);
+    if (timer) osd.set_timer(1000);
+    else osd.set_idle_skip(true);
+
+    CHECK_EQ(osd.run(0, BUSY + 50), BUSY + 50);
+    CHECK(osd.idle(0));
+    CHECK_EQ(osd.run(0, 5000), 5000u);
+    CHECK_EQ(osd.get_skipped(0), 0u);
+    CHECK_EQ(e.insts[0], 5000u + BUSY + 50);
+  }
+}
+
+// Every timer period the CPU is woken, runs BUSY instructions and is
+// skipped to the next tick, however run() is sliced.
+static void test_timer(unsigned slice) {
+  const uint64_t PERIOD = 1000, N = 10000;
+  OSDomain osd(1, SPEC, "synth");
+  Events e(1);
+  attach(osd, e);
+  osd.set_timer(PERIOD);
+  osd.set_idle_skip(true);
+
+  unsigned short_runs = 0;
+  for (uint64_t done = 0; done < N; done += slice)
+    if (osd.run(0, slice) != slice) ++short_runs;
+
+  CHECK_EQ(short_runs, 0u);
+  CHECK_EQ(osd.get_icount(0), N);
+  CHECK_EQ(osd.get_skipped(0), N / PERIOD * (PERIOD - BUSY));
+  CHECK_EQ(e.insts[0], N / PERIOD * BUSY);
+  CHECK_EQ(e.ints[0], N / PERIOD - 1);
+}
+
+// interrupt() wakes a parked CPU before its timer does.
+static void test_interrupt() {
+  OSDomain osd(1, SPEC, "synth");
+  Events e(1);
+  attach(osd, e);
+  osd.set_timer(100000);
+  osd.set_idle_skip(true);
+
+  CHECK_EQ(osd.run(0, BUSY + 100), BUSY + 100);
+  CHECK_EQ(osd.get_skipped(0), 100u);
+  CHECK(osd.idle(0));
+
+  osd.interrupt(0, 0x41);
+  CHECK_EQ(osd.run(0, 100), 100u);
+  CHECK(!osd.idle(0));
+  CHECK_EQ(e.ints[0], 1u);
+  CHECK_EQ(e.insts[0], BUSY + 100);
+  CHECK_EQ(osd.get_skipped(0), 100u);
+}
+
+// A model that paces CPUs by instructions it sees, which never sees a
+// parked CPU reach the end of the quantum.
+struct Paced {
+  Paced(ParallelRunner &r, int n): r(r), seen(n) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++seen[c];
+  }
+
+  bool step(int c) { return seen[c] >= (r.get_quanta() + 1) * 1000; }
+
+  ParallelRunner &r;
+  std::vector<uint64_t> seen;
+};
+
+static void test_runner() {
+  const unsigned STEP = 100, QUANTA = 5;
+  OSDomain osd(1, SPEC, "synth");
+  osd.set_timer(1 << 20);
+  osd.set_idle_skip(true);
+
+  ParallelRunner r(osd);
+  Paced p(r, 1);
+  osd.set_inst_cb(&p, &Paced::inst);
+  r.set_step(STEP);
+  r.set_step_cb(&p, &Paced::step);
+
+  // The runner's timer wakes the CPU each quantum. It then runs until it
+  // idles, and ends the quantum at its first step spent parked.
+  CHECK_EQ(r.run(QUANTA), uint64_t(QUANTA));
+  CHECK_EQ(p.seen[0], QUANTA * BUSY);
+  CHECK_EQ(osd.get_skipped(0), QUANTA * STEP);
+  CHECK_EQ(r.get_icount(0), QUANTA * (BUSY + STEP));
+}
+
+int main() {
+  test_off();
+  test_timer(10000);
+  test_timer(125);
+  test_timer(1000);
+  test_interrupt();
+  test_runner();
+
+  return check_result("idle");
+}
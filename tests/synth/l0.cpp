@@ -0,0 +1,116 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Qcache's L0 filter: every read the CPU makes is either an L0 hit or an L1
+// access, and absorbing hits in the L0 leaves the L1's misses unchanged.
+// Two identical hierarchies, one behind L0 filters, are fed the same synthetic
+// stream, with stores to a shared region so that coherence invalidates lines
+// the L0s point to.
+#include <vector>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include <qcache.h>
+#include <qcache-moesi.h>
+#include <qcache-repl.h>
+#include <qcache-l0.h>
+#include <qdram-config.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+// The hierarchy of the benchmark's qcache configurations.
+typedef Qcache::CacheGrp< 0, Qcache::CPNull,     4, 7, 6, Qcache::ReplLRU>
+        l1i_t;
+typedef Qcache::CacheGrp< 0, Qcache::CPDirMoesi, 8, 6, 6, Qcache::ReplLRU>
+        l1d_t;
+typedef Qcache::CacheGrp<10, Qcache::CPNull,     8, 8, 6, Qcache::ReplLRU>
+        l2_t;
+typedef Qcache::Cache   <20, Qcache::CPNull,    16, 9, 6, Qcache::ReplLRU,
+                         true, true> l3_t;
+typedef Qcache::FuncDram<200, 100, 3, Qcache::Dim4GB2Rank,
+                         Qcache::AddrMappingA> mc_t;
+typedef Qcache::L0Grp<6, 0> l0_t;
+
+static const int CPUS = 2;
+
+struct Hierarchy {
+  Hierarchy():
+    l3(mc, "L3"), l2(CPUS, l3, "L2"), l1i(CPUS, l2, "L1i"),
+    l1d(CPUS, l2, "L1d") {}
+
+  mc_t mc;
+  l3_t l3;
+  l2_t l2;
+  l1i_t l1i;
+  l1d_t l1d;
+};
+
+struct Driver {
+  Driver(): l0i(CPUS, with.l1i, "L0i"), l0d(CPUS, with.l1d, "L0d"),
+            ireads(CPUS), dreads(CPUS), pc(CPUS) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    l0i.getFilter(c).access(pa, va, c, 0);
+    without.l1i.getCache(c).access(pa, va, c, 0);
+    ++ireads[c];
+    pc[c] = va;
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    l0d.getFilter(c).access(pa, pc[c], c, t);
+    without.l1d.getCache(c).access(pa, pc[c], c, t);
+    if (!t) ++dreads[c];
+  }
+
+  Hierarchy with, without;
+  l0_t l0i, l0d;
+  std::vector<uint64_t> ireads, dreads, pc;
+};
+
+int main() {
+  OSDomain osd(CPUS, "mem=0.5,wr=0.3,share=0.5,shared_fp=512,footprint=256K,"
+                     "br=0.1,taken=0.3", "synth");
+  Driver d;
+  osd.set_inst_cb(&d, &Driver::inst);
+  osd.set_mem_cb(&d, &Driver::mem);
+
+  // Short slices, so that the other CPU's stores often invalidate the line
+  // an L0 last saw before its next access.
+  for (int k = 0; k < 25000; ++k)
+    for (int c = 0; c < CPUS; ++c) osd.run(c, 4);
+
+  for (int c = 0; c < CPUS; ++c) {
+    Qcache::L0Filter<6, 0> &fi(d.l0i.getFilter(c)), &fd(d.l0d.getFilter(c));
+
+    CHECK_EQ(d.ireads[c], 100000u);
+    CHECK_EQ(fi.getAccesses(), d.ireads[c]);
+    CHECK_EQ(fd.getAccesses(), d.dreads[c]);
+    CHECK(fi.getHits() > 0);
+    CHECK(fd.getHits() > 0);
+
+    CHECK_EQ(d.with.l1i.getCache(c).getAccesses() + fi.getHits(),
+             d.ireads[c]);
+    CHECK_EQ(d.with.l1d.getCache(c).getAccesses() + fd.getHits(),
+             d.dreads[c]);
+    CHECK_EQ(d.without.l1i.getCache(c).getAccesses(), d.ireads[c]);
+    CHECK_EQ(d.without.l1d.getCache(c).getAccesses(), d.dreads[c]);
+
+    CHECK_EQ(d.with.l1i.getCache(c).getMisses(),
+             d.without.l1i.getCache(c).getMisses());
+    CHECK_EQ(d.with.l1d.getCache(c).getMisses(),
+             d.without.l1d.getCache(c).getMisses());
+  }
+
+  return check_result("l0");
+}
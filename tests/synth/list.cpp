@@ -0,0 +1,142 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// CallbackList: entries run in registration order, handles keep naming their
+// entry however the list changes, and once remove() returns no reader is
+// still calling the removed entry, even while other threads walk the list.
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+typedef Qsim::Callback<void, int> fn;
+typedef Qsim::CallbackList<fn> list;
+
+struct Logger {
+  Logger(std::vector<int> &log, int tag): log(log), tag(tag) {}
+  void f(int x) { log.push_back(tag + x); }
+  std::vector<int> &log;
+  int tag;
+};
+
+// Order and handles in a single thread; a handle is only good for one
+// removal.
+static void test_list() {
+  Qsim::Epoch e;
+  list l;
+  std::vector<int> log;
+  Logger a(log, 100), b(log, 200), c(log, 300);
+
+  list::handle_t ha(l.add(e, fn::bind<Logger, &Logger::f>(&a))),
+                 hb(l.add(e, fn::bind(&b, &Logger::f))),
+                 hc(l.add(e, fn::bind<Logger, &Logger::f>(&c))),
+                 hc2(l.add(e, fn::bind<Logger, &Logger::f>(&c)));
+  CHECK(ha && hb && hc && hc2);
+
+  const std::vector<fn> &v(l.get());
+  for (unsigned i = 0; i < v.size(); ++i) v[i](1);
+  CHECK_EQ(log.size(), 4u);
+  if (log.size() == 4) {
+    CHECK_EQ(log[0], 101); CHECK_EQ(log[1], 201);
+    CHECK_EQ(log[2], 301); CHECK_EQ(log[3], 301);
+  }
+
+  // Grow the list well past its old capacity, then remove from the middle;
+  // the earlier handles must still find their own entries.
+  std::vector<list::handle_t> more;
+  for (int i = 0; i < 100; ++i)
+    more.push_back(l.add(e, fn::bind<Logger, &Logger::f>(&a)));
+  CHECK_EQ(l.get().size(), 104u);
+
+  CHECK(l.remove(e, hb));
+  CHECK(!l.remove(e, hb));
+  CHECK(l.remove(e, hc));
+  for (unsigned i = 0; i < more.size(); ++i) CHECK(l.remove(e, more[i]));
+  CHECK(!l.remove(e, list::handle_t()));
+
+  log.clear();
+  const std::vector<fn> &w(l.get());
+  for (unsigned i = 0; i < w.size(); ++i) w[i](2);
+  CHECK_EQ(log.size(), 2u);
+  if (log.size() == 2) { CHECK_EQ(log[0], 102); CHECK_EQ(log[1], 302); }
+
+  CHECK(l.remove(e, hc2));
+  CHECK(l.remove(e, ha));
+  CHECK(l.empty());
+}
+
+// Handlers that count calls made after their removal returned.
+struct Target {
+  Target(): removed(false), calls(0), late(0) {}
+  void f(int) {
+    if (removed.load(std::memory_order_acquire)) ++late;
+    calls.fetch_add(1, std::memory_order_relaxed);
+  }
+  std::atomic<bool> removed;
+  std::atomic<uint64_t> calls, late;
+};
+
+static void reader(Qsim::Epoch *e, list *l, unsigned r,
+                   std::atomic<bool> *done)
+{
+  while (!done->load(std::memory_order_acquire)) {
+    e->enter(r);
+    const std::vector<fn> &v(l->get());
+    for (unsigned i = 0; i < v.size(); ++i) v[i](0);
+    e->exit(r);
+  }
+}
+
+// Two reader threads walk the list while this one adds and removes
+// handlers, each of which is marked removed as soon as remove() returns.
+static void test_concurrent() {
+  const unsigned READERS = 2, ROUNDS = 200;
+
+  Qsim::Epoch e;
+  e.set_readers(READERS);
+  list l;
+  std::atomic<bool> done(false);
+  std::vector<Target> t(ROUNDS);
+  Target keep;
+  list::handle_t hk(l.add(e, fn::bind<Target, &Target::f>(&keep)));
+
+  std::vector<std::thread> readers;
+  for (unsigned r = 0; r < READERS; ++r)
+    readers.push_back(std::thread(reader, &e, &l, r, &done));
+
+  for (unsigned i = 0; i < ROUNDS; ++i) {
+    list::handle_t h(i % 2 ? l.add(e, fn::bind(&t[i], &Target::f))
+                           : l.add(e, fn::bind<Target, &Target::f>(&t[i])));
+    while (!t[i].calls.load(std::memory_order_relaxed))
+      std::this_thread::yield();
+    CHECK(l.remove(e, h));
+    t[i].removed.store(true, std::memory_order_release);
+  }
+
+  done.store(true, std::memory_order_release);
+  for (unsigned r = 0; r < READERS; ++r) readers[r].join();
+
+  uint64_t late = 0;
+  for (unsigned i = 0; i < ROUNDS; ++i) late += t[i].late;
+  CHECK_EQ(late, 0u);
+  CHECK(keep.calls > ROUNDS);
+  CHECK(l.remove(e, hk));
+  CHECK(l.empty());
+}
+
+int main() {
+  test_list();
+  test_concurrent();
+
+  return check_result("list");
+}
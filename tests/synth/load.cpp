@@ -0,0 +1,123 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Library loading: every OSDomain gets a fresh private copy of the library,
+// however many were created and destroyed before it, through an anonymous
+// memory file that leaves no descriptor or temporary file behind, and
+// QSIM_LOAD_REPORT describes each load on stderr.
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <set>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const unsigned ROUNDS = 20;
+
+static unsigned open_fds() {
+  unsigned n = 0;
+  DIR *d = opendir("/proc/self/fd");
+  while (readdir(d)) ++n;
+  closedir(d);
+  return n;
+}
+
+static unsigned tmp_files() {
+  unsigned n = 0;
+  DIR *d = opendir("/tmp");
+  while (struct dirent *e = readdir(d))
+    if (!strncmp(e->d_name, "qsim_", 5)) ++n;
+  closedir(d);
+  return n;
+}
+
+// Sum of the stores' values, which a copy still holding an earlier domain's
+// RAM or counters would get wrong.
+struct Sum {
+  Sum(OSDomain &osd): osd(osd), sum(0) {
+    osd.set_mem_cb(this, &Sum::mem);
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    uint64_t v;
+    osd.mem_rd(v, pa);
+    sum += v;
+  }
+
+  OSDomain &osd;
+  uint64_t sum;
+};
+
+static uint64_t fresh() {
+  OSDomain osd(1, "mem=1,wr=1", "synth");
+  Sum s(osd);
+  osd.run(0, 2000);
+  return s.sum;
+}
+
+int main() {
+  // The first domain's load may open descriptors that stay open for good.
+  uint64_t ref = fresh();
+  unsigned fds = open_fds(), tmps = tmp_files();
+
+  unsigned bad = 0;
+  for (unsigned k = 0; k < ROUNDS; ++k)
+    if (fresh() != ref) ++bad;
+  CHECK_EQ(bad, 0u);
+  CHECK_EQ(open_fds(), fds);
+  CHECK_EQ(tmp_files(), tmps);
+
+  // Each live copy is a memory file of its own.
+  {
+    OSDomain a(1, "", "synth"), b(1, "", "synth");
+    std::ifstream maps("/proc/self/maps");
+    std::set<std::string> names;
+    std::string line;
+    while (std::getline(maps, line)) {
+      size_t p = line.find("/memfd:qsim-");
+      if (p != std::string::npos) names.insert(line.substr(p));
+    }
+    CHECK(names.size() >= ROUNDS + 3);
+  }
+
+  // The report goes to stderr, one line per load.
+  char log[] = "/tmp/load-test-XXXXXX";
+  int fd = mkstemp(log);
+  int err = dup(2);
+  dup2(fd, 2);
+  setenv("QSIM_LOAD_REPORT", "1", 1);
+  fresh();
+  setenv("QSIM_LOAD_REPORT", "0", 1);
+  fresh();
+  dup2(err, 2);
+  close(err);
+  close(fd);
+
+  std::ifstream in(log);
+  std::stringstream text;
+  text << in.rdbuf();
+  unlink(log);
+  const std::string s(text.str());
+  CHECK(s.find("Opening ") == 0);
+  CHECK(s.find("(memfd, ") != std::string::npos);
+  CHECK(s.find("/proc/self/fd/") != std::string::npos);
+  CHECK_EQ(s.find("Opening ", 1), std::string::npos);
+
+  return check_result("load");
+}
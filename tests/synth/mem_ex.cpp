@@ -0,0 +1,134 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Extended memory callbacks: each mem_access record carries the address of
+// the instruction that made the access, the ring the CPU was in and the
+// current task, with or without instruction callbacks of the caller's own.
+// The stream crosses in and out of the kernel through system calls.
+#include <vector>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const int CPUS = 2;
+static const char *SPEC = "sys=0.05,mem=0.5,wr=0.4";
+
+struct Access {
+  uint64_t pc, vaddr, paddr;
+  uint8_t size;
+  int type, prot, tid;
+
+  bool operator==(const Access &a) const {
+    return pc == a.pc && vaddr == a.vaddr && paddr == a.paddr &&
+           size == a.size && type == a.type && prot == a.prot && tid == a.tid;
+  }
+};
+
+// Build the expected records from plain callbacks and the registers.
+struct Reference {
+  Reference(OSDomain &osd): osd(osd), pc(CPUS), got(CPUS) {
+    osd.set_inst_cb(this, &Reference::inst);
+    osd.set_mem_cb(this, &Reference::mem);
+  }
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    pc[c] = va;
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    Access a = { pc[c], va, pa, s, t,
+                 osd.get_reg(c, QSIM_X86_CS) & 1 ? OSDomain::PROT_USER
+                                                 : OSDomain::PROT_KERN,
+                 c + 1 };
+    got[c].push_back(a);
+  }
+
+  OSDomain &osd;
+  std::vector<uint64_t> pc;
+  std::vector<std::vector<Access> > got;
+};
+
+struct Records {
+  Records(): got(CPUS) {}
+
+  void mem_ex(int c, const OSDomain::mem_access &m) {
+    Access a = { m.pc, m.vaddr, m.paddr, m.size, m.type, m.prot, m.tid };
+    got[c].push_back(a);
+  }
+
+  std::vector<std::vector<Access> > got;
+};
+
+static void run(OSDomain &osd) {
+  for (int i = 0; i < 10; ++i)
+    for (int c = 0; c < CPUS; ++c) osd.run(c, 1000);
+}
+
+static size_t mismatches(const std::vector<Access> &a,
+                         const std::vector<Access> &b)
+{
+  size_t bad = 0;
+  for (size_t i = 0; i < a.size() && i < b.size(); ++i)
+    if (!(a[i] == b[i])) ++bad;
+  return bad;
+}
+
+int main() {
+  OSDomain ref_osd(CPUS, SPEC, "synth");
+  Reference ref(ref_osd);
+  run(ref_osd);
+
+  // Kernel and user accesses both occur.
+  unsigned kern = 0;
+  for (size_t i = 0; i < ref.got[0].size(); ++i)
+    if (ref.got[0][i].prot == OSDomain::PROT_KERN) ++kern;
+  CHECK(ref.got[0].size() > 4000u);
+  CHECK(kern > ref.got[0].size() / 4);
+  CHECK(kern < ref.got[0].size() * 3 / 4);
+
+  // Domain-wide and per-CPU records, with no instruction callback of our
+  // own: the domain tracks the PC itself.
+  {
+    OSDomain osd(CPUS, SPEC, "synth");
+    Records all, one;
+    osd.set_mem_cb_ex(&all, &Records::mem_ex);
+    osd.set_mem_cb_ex(1, &one, &Records::mem_ex);
+    run(osd);
+
+    for (int c = 0; c < CPUS; ++c) {
+      CHECK_EQ(all.got[c].size(), ref.got[c].size());
+      CHECK_EQ(mismatches(all.got[c], ref.got[c]), 0u);
+    }
+    CHECK(one.got[0].empty());
+    CHECK_EQ(one.got[1].size(), ref.got[1].size());
+    CHECK_EQ(mismatches(one.got[1], ref.got[1]), 0u);
+  }
+
+  // Alongside the plain callbacks, the records match what they report.
+  {
+    OSDomain osd(CPUS, SPEC, "synth");
+    Reference plain(osd);
+    Records all;
+    osd.set_mem_cb_ex(&all, &Records::mem_ex);
+    run(osd);
+
+    for (int c = 0; c < CPUS; ++c) {
+      CHECK_EQ(all.got[c].size(), plain.got[c].size());
+      CHECK_EQ(mismatches(all.got[c], plain.got[c]), 0u);
+    }
+  }
+
+  return check_result("mem_ex");
+}
@@ -0,0 +1,175 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Packed encoding: zigzag and varint round trips, including deltas that only
+// fit in 64 bits, and PackedQueue against Queue on the same event stream.
+#include <vector>
+#include <queue>
+
+#include <string.h>
+#include <stdint.h>
+
+#include <qsim.h>
+#include <qsim-packed.h>
+
+#include "check.h"
+
+using Qsim::OSDomain; using Qsim::QueueItem;
+using Qsim::PackedEncoder; using Qsim::PackedDecoder;
+
+static bool same(const QueueItem &a, const QueueItem &b, bool bytes) {
+  if (a.cb_type != b.cb_type || a.id != b.id) return false;
+
+  switch (a.cb_type) {
+  case QueueItem::INST:
+    return a.data.inst.vaddr == b.data.inst.vaddr &&
+           a.data.inst.paddr == b.data.inst.paddr &&
+           a.data.inst.len == b.data.inst.len &&
+           a.data.inst.type == b.data.inst.type &&
+           (!bytes || !memcmp(a.data.inst.bytes, b.data.inst.bytes,
+                              a.data.inst.len));
+  case QueueItem::MEM:
+    return a.data.mem.vaddr == b.data.mem.vaddr &&
+           a.data.mem.paddr == b.data.mem.paddr &&
+           a.data.mem.size == b.data.mem.size &&
+           a.data.mem.type == b.data.mem.type;
+  case QueueItem::INTR:
+    return a.data.intr.vec == b.data.intr.vec;
+  case QueueItem::REG:
+    return a.data.reg.reg == b.data.reg.reg &&
+           a.data.reg.size == b.data.reg.size &&
+           a.data.reg.type == b.data.reg.type;
+  default:
+    return false;
+  }
+}
+
+static void test_zigzag() {
+  const int64_t v[] = {
+    0, 1, -1, 2, -2, 63, -64, 64, -65, 0x7fffffff, -0x80000000ll,
+    INT64_MAX, INT64_MIN, INT64_MIN + 1
+  };
+
+  for (unsigned i = 0; i < sizeof v / sizeof *v; i++) {
+    uint64_t z = PackedEncoder::zigzag(uint64_t(v[i]));
+    CHECK_EQ(int64_t(PackedDecoder::unzigzag(z)), v[i]);
+    // Small magnitudes of either sign get small codes.
+    CHECK_EQ(z, v[i] < 0 ? 2*~uint64_t(v[i]) + 1 : 2*uint64_t(v[i]));
+  }
+}
+
+static void test_encoding() {
+  const uint8_t code[15] = { 0x48, 0x8b, 0x04, 0x25, 0x00, 0x10, 0x00, 0x00 };
+  const uint64_t top = ~uint64_t(0);
+  std::vector<QueueItem> in;
+
+  // Forward and backward jumps across the whole address space, physical
+  // offsets of both signs, a CPU id that takes a two-byte varint and values
+  // at the edges of every field.
+  in.push_back(QueueItem(0, 0x1000, 0x1000, 4, code, QSIM_INST_INTBASIC));
+  in.push_back(QueueItem(0, 0x1004, 0x1004, 8, code, QSIM_INST_BR));
+  in.push_back(QueueItem(0, top - 3, 0x2000, 4, code, QSIM_INST_FPBASIC));
+  in.push_back(QueueItem(0, 0, top - 0xfff, 1, code, QSIM_INST_NULL));
+  in.push_back(QueueItem(0, 0x40000000, 0x40000000, 15, code,
+                         QSIM_INST_STACK));
+  in.push_back(QueueItem(1, 0x10, 0x10, 8, 0));
+  in.push_back(QueueItem(1, top - 7, 7, 8, 1));
+  in.push_back(QueueItem(1, 0x8000000000000000ull, 0, 1, 0));
+  in.push_back(QueueItem(300, 0xff));
+  in.push_back(QueueItem(300, 0));
+  in.push_back(QueueItem(300, 4095, 8, 2));
+  in.push_back(QueueItem(2, 0, 0, 0));
+  in.push_back(QueueItem(0, 0x40000004, 0x40000004, 4, code,
+                         QSIM_INST_INTBASIC));
+  in.push_back(QueueItem(0, 0x18, 0x18, 4, 15));
+
+  for (int keep = 0; keep < 2; keep++) {
+    std::vector<uint8_t> buf;
+    PackedEncoder enc(buf, keep);
+    for (size_t i = 0; i < in.size(); i++) enc.push(in[i]);
+
+    PackedDecoder dec(&buf[0], &buf[0] + buf.size());
+    QueueItem out;
+    size_t n = 0;
+    while (dec.next(out)) {
+      CHECK(n < in.size());
+      if (n < in.size()) CHECK(same(in[n], out, keep));
+      n++;
+    }
+    CHECK_EQ(n, in.size());
+    CHECK(dec.done());
+
+    // A sequential instruction on the same CPU and page is four bytes.
+    if (!keep) {
+      size_t before = buf.size();
+      enc.inst(0, 0x40000008, 0x40000008, 4, code, QSIM_INST_INTBASIC);
+      CHECK_EQ(buf.size() - before, 4u);
+    }
+  }
+}
+
+// PackedQueue and Queue attached to the same CPUs must see the same stream,
+// interrupts included.
+static void test_queue() {
+  OSDomain osd(2, "mem=0.5,br=0.3,taken=0.8,footprint=64M,share=0.3",
+               "synth");
+  Qsim::PackedQueue pq0(osd, 0, true), pq1(osd, 1);
+  Qsim::Queue q0(osd, 0, false), q1(osd, 1, false);
+
+  for (unsigned k = 0; k < 20; k++) {
+    osd.interrupt(0, 0x20 + k);
+    if (osd.runnable(1)) osd.interrupt(1, 0xff - k);
+    osd.run(0, 500);
+    osd.run(1, 500);
+  }
+
+  size_t n0 = pq0.size(), n1 = pq1.size();
+  CHECK_EQ(n0, q0.size());
+  CHECK_EQ(n1, q1.size());
+  CHECK(n0 > 10000);
+  CHECK(n1 > 10000);
+  CHECK(pq0.bytes() < n0 * sizeof(QueueItem));
+
+  // The iterator walks the same records front()/pop() will hand out.
+  size_t it_n = 0, it_bad = 0;
+  Qsim::PackedQueue::const_iterator it(pq1.begin());
+  std::queue<QueueItem> ref(q1);
+  for (; it != pq1.end(); ++it, ++it_n) {
+    if (ref.empty() || !same(*it, ref.front(), false)) ++it_bad;
+    if (!ref.empty()) ref.pop();
+  }
+  CHECK_EQ(it_n, n1);
+  CHECK_EQ(it_bad, 0u);
+
+  size_t bad = 0, ints = 0;
+  while (!pq0.empty() && !q0.empty()) {
+    if (!same(pq0.front(), q0.front(), true)) ++bad;
+    if (q0.front().cb_type == QueueItem::INTR) ++ints;
+    pq0.pop(); q0.pop();
+  }
+  CHECK(pq0.empty() && q0.empty());
+  CHECK_EQ(bad, 0u);
+  CHECK_EQ(ints, 20u);
+
+  bad = 0;
+  while (!pq1.empty() && !q1.empty()) {
+    if (!same(pq1.front(), q1.front(), false)) ++bad;
+    pq1.pop(); q1.pop();
+  }
+  CHECK(pq1.empty() && q1.empty());
+  CHECK_EQ(bad, 0u);
+  CHECK_EQ(pq1.bytes(), 0u);
+}
+
+int main() {
+  test_zigzag();
+  test_encoding();
+  test_queue();
+
+  return check_result("packed");
+}
@@ -0,0 +1,132 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Per-CPU callbacks only see their own CPU, domain-wide ones see every CPU,
+// each set can be removed without touching the other, and a callback may
+// remove itself while it runs.
+#include <vector>
+#include <thread>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+struct Counter {
+  Counter(int n): insts(n), mems(n), osd(NULL), limit(0), seen(0) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++insts[c];
+    if (limit && ++seen == limit) osd->unset_inst_cb(self);
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) { ++mems[c]; }
+
+  std::vector<uint64_t> insts, mems;
+
+  // Remove ourselves from within the callback after limit instructions.
+  OSDomain *osd;
+  OSDomain::inst_cb_handle_t self;
+  uint64_t limit, seen;
+};
+
+// Both kinds count exactly the instructions run().
+static void test_per_cpu() {
+  OSDomain osd(2, "", "synth");
+  Counter all(2), one(2), bound(2), stop(2);
+
+  OSDomain::inst_cb_handle_t ha(osd.set_inst_cb(&all, &Counter::inst));
+  OSDomain::mem_cb_handle_t hm(osd.set_mem_cb(&all, &Counter::mem));
+  OSDomain::inst_cpu_handle_t h1(osd.set_inst_cb(1, &one, &Counter::inst));
+  OSDomain::mem_cpu_handle_t hm1(osd.set_mem_cb(1, &one, &Counter::mem));
+  OSDomain::inst_cpu_handle_t hb(
+    osd.set_inst_cb<Counter, &Counter::inst>(0, &bound));
+
+  stop.osd = &osd;
+  stop.limit = 100;
+  stop.self = osd.set_inst_cb(&stop, &Counter::inst);
+
+  for (int k = 0; k < 10; ++k) { osd.run(0, 1000); osd.run(1, 1000); }
+
+  CHECK_EQ(osd.get_icount(0), 10000u);
+  CHECK_EQ(osd.get_icount(1), 10000u);
+  CHECK_EQ(all.insts[0], 10000u);
+  CHECK_EQ(all.insts[1], 10000u);
+  CHECK_EQ(one.insts[0], 0u);
+  CHECK_EQ(one.insts[1], 10000u);
+  CHECK_EQ(one.mems[0], 0u);
+  CHECK_EQ(one.mems[1], all.mems[1]);
+  CHECK(all.mems[1] > 0);
+  CHECK_EQ(bound.insts[0], 10000u);
+  CHECK_EQ(bound.insts[1], 0u);
+  CHECK_EQ(stop.insts[0] + stop.insts[1], 100u);
+
+  // Removing the per-CPU callbacks leaves the domain-wide ones alone, and
+  // the other way around.
+  uint64_t mems1 = all.mems[1];
+  osd.unset_inst_cb(1, h1);
+  osd.unset_mem_cb(1, hm1);
+  osd.unset_inst_cb(ha);
+  osd.run(0, 500); osd.run(1, 500);
+
+  CHECK_EQ(one.insts[1], 10000u);
+  CHECK_EQ(one.mems[1], mems1);
+  CHECK(all.mems[1] > mems1);
+  CHECK_EQ(all.insts[0], 10000u);
+  CHECK_EQ(bound.insts[0], 10500u);
+
+  osd.unset_inst_cb(0, hb);
+  osd.unset_mem_cb(hm);
+  osd.run(0, 500);
+  CHECK_EQ(bound.insts[0], 10500u);
+}
+
+static void run_cpu(OSDomain *osd, int c) {
+  for (int k = 0; k < 20; ++k) osd->run(c, 1000);
+}
+
+// Each CPU on its own host thread, with its own per-CPU counter and a
+// domain-wide one whose per-CPU slots only that thread touches.
+static void test_threads() {
+  OSDomain osd(2, "mem=0.3", "synth");
+  Counter all(2), own0(2), own1(2);
+  osd.set_inst_cb(&all, &Counter::inst);
+  osd.set_inst_cb(0, &own0, &Counter::inst);
+  osd.set_mem_cb(0, &own0, &Counter::mem);
+  osd.set_inst_cb(1, &own1, &Counter::inst);
+  osd.set_mem_cb(1, &own1, &Counter::mem);
+
+  // CPU 0 brings up CPU 1.
+  osd.run(0, 1);
+  std::thread t0(run_cpu, &osd, 0), t1(run_cpu, &osd, 1);
+  t0.join();
+  t1.join();
+
+  CHECK_EQ(all.insts[0], 20001u);
+  CHECK_EQ(all.insts[1], 20000u);
+  CHECK_EQ(own0.insts[0], 20001u);
+  CHECK_EQ(own0.insts[1], 0u);
+  CHECK_EQ(own1.insts[0], 0u);
+  CHECK_EQ(own1.insts[1], 20000u);
+  CHECK(own0.mems[0] > 0);
+  CHECK(own1.mems[1] > 0);
+  CHECK_EQ(own0.mems[1], 0u);
+  CHECK_EQ(own1.mems[0], 0u);
+}
+
+int main() {
+  test_per_cpu();
+  test_threads();
+
+  return check_result("per_cpu");
+}
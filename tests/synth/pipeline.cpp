@@ -0,0 +1,136 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Pipeline: each CPU's consumer thread receives that CPU's events in the
+// order they were generated, and a slow consumer holds the emulation back
+// rather than letting the producer run more than a ring ahead.
+#include <vector>
+#include <thread>
+#include <atomic>
+
+#include <stdint.h>
+#include <sched.h>
+
+#include <qsim.h>
+#include <qsim-pipeline.h>
+
+#include "check.h"
+
+using Qsim::OSDomain; using Qsim::Pipeline; using Qsim::QueueItem;
+
+static const unsigned CPUS = 2, RING = 64, INSTS = 20000;
+
+static bool same(const QueueItem &a, const QueueItem &b) {
+  if (a.cb_type != b.cb_type || a.id != b.id) return false;
+
+  switch (a.cb_type) {
+  case QueueItem::INST:
+    return a.data.inst.vaddr == b.data.inst.vaddr &&
+           a.data.inst.len == b.data.inst.len &&
+           a.data.inst.type == b.data.inst.type;
+  case QueueItem::MEM:
+    return a.data.mem.vaddr == b.data.mem.vaddr &&
+           a.data.mem.type == b.data.mem.type;
+  case QueueItem::INTR:
+    return a.data.intr.vec == b.data.intr.vec;
+  case QueueItem::REG:
+    return a.data.reg.reg == b.data.reg.reg &&
+           a.data.reg.type == b.data.reg.type;
+  default:
+    return false;
+  }
+}
+
+// Domain-wide callbacks run before the pipeline's per-CPU ones, so each sees
+// an event just before it is pushed, and can measure how far ahead of its
+// consumer the producer is.
+struct Reference {
+  Reference(): want(CPUS), popped(CPUS), ahead(0) {
+    for (unsigned c = 0; c < CPUS; ++c) popped[c] = 0;
+  }
+
+  void note(int c, const QueueItem &q) {
+    uint64_t d = want[c].size() - popped[c].load(std::memory_order_acquire);
+    if (d > ahead) ahead = d;
+    want[c].push_back(q);
+  }
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    note(c, QueueItem(c, va, pa, l, b, t));
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    note(c, QueueItem(c, va, pa, s, t));
+  }
+
+  int intr(int c, uint8_t v) { note(c, QueueItem(c, v)); return 0; }
+
+  void reg(int c, int r, uint8_t s, int t) { note(c, QueueItem(c, r, s, t)); }
+
+  std::vector<std::vector<QueueItem> > want;
+  std::vector<std::atomic<uint64_t> > popped;
+  uint64_t ahead;
+};
+
+// Drain CPU c, yielding now and then so that the ring fills.
+static void consume(Pipeline *p, Reference *r, int c,
+                    std::vector<QueueItem> *got)
+{
+  QueueItem q;
+  while (p->wait_pop(c, q)) {
+    got->push_back(q);
+    r->popped[c].store(got->size(), std::memory_order_release);
+    if (got->size() % 16 == 0) sched_yield();
+  }
+}
+
+int main() {
+  OSDomain osd(CPUS, "mem=0.5,regs=2", "synth");
+  Reference r;
+  osd.set_inst_cb(&r, &Reference::inst);
+  osd.set_mem_cb(&r, &Reference::mem);
+  osd.set_int_cb(&r, &Reference::intr);
+  osd.set_reg_cb(&r, &Reference::reg);
+
+  std::vector<std::vector<QueueItem> > got(CPUS);
+  {
+    Pipeline p(osd, RING, Pipeline::INST | Pipeline::MEM | Pipeline::INTR |
+                          Pipeline::REG);
+    std::vector<std::thread> consumers;
+    for (unsigned c = 0; c < CPUS; ++c)
+      consumers.push_back(std::thread(consume, &p, &r, c, &got[c]));
+
+    for (unsigned k = 0; k < INSTS / 1000; ++k) {
+      osd.interrupt(k % CPUS, 0x40 + k);
+      for (unsigned c = 0; c < CPUS; ++c) osd.run(c, 1000);
+    }
+
+    p.close();
+    for (unsigned c = 0; c < CPUS; ++c) consumers[c].join();
+
+    for (unsigned c = 0; c < CPUS; ++c) CHECK(p.stalls(c) > 0);
+  }
+
+  for (unsigned c = 0; c < CPUS; ++c) {
+    CHECK(r.want[c].size() > INSTS * 3);
+    CHECK_EQ(got[c].size(), r.want[c].size());
+    size_t bad = 0;
+    for (size_t i = 0; i < got[c].size() && i < r.want[c].size(); ++i)
+      if (!same(got[c][i], r.want[c][i])) ++bad;
+    CHECK_EQ(bad, 0u);
+  }
+
+  // The ring holds at most RING items and the producer blocks before more;
+  // one more may have been popped but not yet counted.
+  CHECK(r.ahead <= RING + 1);
+  CHECK(r.ahead >= RING / 2);
+
+  return check_result("pipeline");
+}
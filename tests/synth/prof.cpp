@@ -0,0 +1,201 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Callback profiler: prof_report() counts every run, instruction and event,
+// times one event in sample_period of each type on each CPU, and charges
+// each callback object for the events it handled, costliest first. Reports
+// are dumped periodically and may be taken while CPUs run.
+#include <sstream>
+#include <string>
+#include <vector>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const int CPUS = 2;
+static const unsigned PERIOD = 16, SLICE = 1000, SLICES = 10;
+
+struct Cheap {
+  Cheap(): insts(0) {}
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++insts;
+  }
+  uint64_t insts;
+};
+
+struct Dear {
+  Dear(): mems(CPUS), sink(0) {}
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    ++mems[c];
+    for (unsigned i = 0; i < 2000; ++i) sink = sink * 31 + i;
+  }
+  std::vector<uint64_t> mems;
+  volatile uint64_t sink;
+};
+
+// What the report says, by section.
+struct Report {
+  struct cpu_row { uint64_t runs, insts; };
+  struct handle_row { std::string type, obj; uint64_t calls; double ns; };
+
+  Report(const std::string &text): headers(0) {
+    std::istringstream in(text);
+    std::string line;
+    int section = 0;
+    while (std::getline(in, line)) {
+      std::istringstream f(line);
+      std::string t;
+      f >> t;
+      if (line.find("qsim callback profile") == 0) { ++headers; continue; }
+      if (t == "cpu") { section = 1; continue; }
+      if (t == "type") {
+        section = line.find("object") == std::string::npos ? 2 : 3;
+        continue;
+      }
+
+      if (section == 1) {
+        cpu_row r;
+        f >> r.runs >> r.insts;
+        cpus[t] = r;
+      } else if (section == 2 && t[0] != '<') {
+        f >> events[t];
+      } else if (section == 3) {
+        handle_row h;
+        h.type = t;
+        f >> h.obj >> t >> h.calls >> h.ns;
+        handles.push_back(h);
+      }
+    }
+  }
+
+  const handle_row *find(const std::string &type) const {
+    for (size_t i = 0; i < handles.size(); ++i)
+      if (handles[i].type == type) return &handles[i];
+    return NULL;
+  }
+
+  unsigned headers;
+  std::map<std::string, cpu_row> cpus;
+  std::map<std::string, uint64_t> events;
+  std::vector<handle_row> handles;
+};
+
+static void run(OSDomain &osd) {
+  for (unsigned k = 0; k < SLICES; ++k)
+    for (int c = 0; c < CPUS; ++c) osd.run(c, SLICE);
+}
+
+static void test_report() {
+  OSDomain osd(CPUS, "mem=0.3", "synth");
+  Cheap a;
+  Dear b;
+  osd.set_inst_cb(&a, &Cheap::inst);
+  osd.set_mem_cb(&b, &Dear::mem);
+
+  // Nothing is reported until profiling is on.
+  std::ostringstream off;
+  osd.prof_report(off);
+  CHECK(off.str().empty());
+
+  osd.run(0, 1);
+  osd.enable_prof(PERIOD);
+  b.mems.assign(CPUS, 0);
+  run(osd);
+
+  std::ostringstream text;
+  osd.prof_report(text);
+  Report r(text.str());
+
+  CHECK_EQ(r.headers, 1u);
+  for (int c = 0; c < CPUS; ++c) {
+    std::ostringstream id;
+    id << c;
+    CHECK_EQ(r.cpus[id.str()].runs, uint64_t(SLICES));
+    CHECK_EQ(r.cpus[id.str()].insts, uint64_t(SLICES * SLICE));
+  }
+  CHECK_EQ(r.cpus["all"].runs, uint64_t(CPUS * SLICES));
+  CHECK_EQ(r.events["inst"], uint64_t(CPUS * SLICES * SLICE));
+  CHECK_EQ(r.events["mem"], b.mems[0] + b.mems[1]);
+
+  // Each callback is charged for the timed events, one in PERIOD per CPU,
+  // and the dear one comes first.
+  CHECK_EQ(r.handles.size(), 2u);
+  const Report::handle_row *ha = r.find("inst"), *hb = r.find("mem");
+  CHECK(ha && hb);
+  if (ha && hb) {
+    CHECK_EQ(ha->calls, uint64_t(CPUS * SLICES * SLICE / PERIOD));
+    CHECK_EQ(hb->calls, b.mems[0] / PERIOD + b.mems[1] / PERIOD);
+    CHECK(hb->ns > ha->ns);
+    CHECK(&r.handles[0] == hb);
+  }
+
+  // Turning profiling off and on starts afresh.
+  osd.disable_prof();
+  std::ostringstream gone;
+  osd.prof_report(gone);
+  CHECK(gone.str().empty());
+
+  osd.enable_prof(PERIOD);
+  osd.run(0, SLICE);
+  std::ostringstream again;
+  osd.prof_report(again);
+  CHECK_EQ(Report(again.str()).cpus["all"].insts, uint64_t(SLICE));
+}
+
+// Reports dumped every millisecond, at the end of a run, and others taken
+// from a second thread while the CPUs run.
+static void reporter(OSDomain *osd, std::atomic<bool> *done, unsigned *n) {
+  while (!done->load()) {
+    std::ostringstream s;
+    osd->prof_report(s);
+    if (Report(s.str()).headers == 1) ++*n;
+    std::this_thread::yield();
+  }
+}
+
+static void test_dump() {
+  OSDomain osd(CPUS, "mem=0.3", "synth");
+  Dear b;
+  osd.set_mem_cb(&b, &Dear::mem);
+
+  std::ostringstream dump;
+  osd.run(0, 1);
+  osd.enable_prof(PERIOD, &dump, 1);
+
+  std::atomic<bool> done(false);
+  unsigned taken = 0;
+  std::thread t(reporter, &osd, &done, &taken);
+  for (unsigned k = 0; k < SLICES; ++k) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    for (int c = 0; c < CPUS; ++c) osd.run(c, SLICE);
+  }
+  done.store(true);
+  t.join();
+
+  CHECK(Report(dump.str()).headers >= SLICES - 1);
+  CHECK(taken > 0);
+}
+
+int main() {
+  test_report();
+  test_dump();
+
+  return check_result("prof");
+}
@@ -0,0 +1,118 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Zero-copy RAM view: get_ram_regions() lists the library's RAM in address
+// order, and ram_ptr() finds the one region holding a whole range, as a
+// linear search would, or returns NULL for ranges outside RAM or across two
+// regions. The view shows what the guest and mem_wr_block() wrote.
+#include <vector>
+
+#include <string.h>
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const unsigned REGIONS = 7;
+
+// What ram_ptr() should return, the slow way.
+static const uint8_t *lookup(const std::vector<qsim_ram_region> &r,
+                             uint64_t pa, size_t len)
+{
+  for (size_t i = 0; i < r.size(); ++i)
+    if (pa >= r[i].paddr && pa + len <= r[i].paddr + r[i].size)
+      return r[i].host + (pa - r[i].paddr);
+  return NULL;
+}
+
+struct Stores {
+  Stores(OSDomain &osd): osd(osd), insts(0), bad(0) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++insts;
+  }
+
+  // Each store writes the CPU's instruction count, from 0.
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    const uint8_t *p = osd.ram_ptr(pa, 8);
+    uint64_t v;
+    if (!p) { ++bad; return; }
+    memcpy(&v, p, 8);
+    if (v != insts - 1) ++bad;
+  }
+
+  OSDomain &osd;
+  uint64_t insts;
+  unsigned bad;
+};
+
+int main() {
+  OSDomain osd(1, "regions=7,mem=1,wr=1,share=0", "synth");
+  const uint64_t ram = uint64_t(osd.get_ram_size_mb()) << 20;
+
+  // The library lists its regions last to first; the domain sorts them.
+  const std::vector<qsim_ram_region> &r(osd.get_ram_regions());
+  CHECK_EQ(r.size(), size_t(REGIONS));
+  uint64_t next = 0;
+  for (size_t i = 0; i < r.size(); ++i) {
+    CHECK_EQ(r[i].paddr, next);
+    next = r[i].paddr + r[i].size;
+  }
+  CHECK_EQ(next, ram);
+
+  // Region edges: first and last bytes, whole regions, and ranges one byte
+  // too long or straddling the next region.
+  for (size_t i = 0; i < r.size(); ++i) {
+    uint64_t pa = r[i].paddr, sz = r[i].size;
+    CHECK(osd.ram_ptr(pa) == r[i].host);
+    CHECK(osd.ram_ptr(pa + sz - 1) == r[i].host + sz - 1);
+    CHECK(osd.ram_ptr(pa, sz) == r[i].host);
+    CHECK(osd.ram_ptr(pa, sz + 1) == NULL);
+    CHECK(osd.ram_ptr(pa + sz - 4, 8) == NULL);
+    CHECK(osd.ram_ptr(pa + sz - 8, 8) == r[i].host + sz - 8);
+  }
+  CHECK(osd.ram_ptr(ram) == NULL);
+  CHECK(osd.ram_ptr(~0ull) == NULL);
+  CHECK(osd.ram_ptr(~0ull - 3, 8) == NULL);
+
+  // Random ranges, a few of them past the end of RAM.
+  uint64_t x = 88172645463325252ull;
+  size_t bad = 0;
+  for (unsigned k = 0; k < 200000; ++k) {
+    x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+    uint64_t pa = x % (ram + ram / 16);
+    size_t len = 1 + (x >> 40) % 64;
+    if (osd.ram_ptr(pa, len) != lookup(r, pa, len)) ++bad;
+  }
+  CHECK_EQ(bad, 0u);
+
+  // Data written across a region boundary shows on both sides, and reading
+  // it back in one block takes the library's path.
+  const uint64_t edge = r[3].paddr - 10;
+  uint8_t in[20], out[20];
+  for (unsigned i = 0; i < 20; ++i) in[i] = 0xa0 + i;
+  osd.mem_wr_block(edge, in, 20);
+  CHECK(!memcmp(osd.ram_ptr(edge, 10), in, 10));
+  CHECK(!memcmp(osd.ram_ptr(r[3].paddr, 10), in + 10, 10));
+  osd.mem_rd_block(edge, out, 20);
+  CHECK(!memcmp(in, out, 20));
+
+  // Guest stores are visible through the view as soon as they happen.
+  Stores s(osd);
+  osd.set_inst_cb(&s, &Stores::inst);
+  osd.set_mem_cb(&s, &Stores::mem);
+  osd.run(0, 5000);
+  CHECK_EQ(s.bad, 0u);
+
+  return check_result("ram_ptr");
+}
@@ -0,0 +1,98 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Register snapshots: get_regs() and get_context() return what get_reg()
+// returns register by register, for any list, inside callbacks as well as
+// between runs, and see set_reg() at once.
+#include <vector>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain; using Qsim::X86Context;
+
+static const int CPUS = 2;
+
+// Compare every way of reading CPU c's registers.
+static size_t compare(OSDomain &osd, int c) {
+  size_t bad = 0;
+
+  X86Context ctx;
+  osd.get_context(c, ctx);
+  for (int r = 0; r < QSIM_X86_N_REGS; ++r)
+    if (ctx[r] != osd.get_reg(c, r)) ++bad;
+
+  // Out of order, with repeats.
+  static const int list[] = {
+    QSIM_X86_RIP, QSIM_X86_RAX, QSIM_X86_CS, QSIM_X86_RAX, QSIM_X86_RSP,
+    QSIM_X86_CR0, QSIM_X86_RBX, QSIM_X86_RIP
+  };
+  const int n = sizeof list / sizeof list[0];
+  uint64_t v[n];
+  osd.get_regs(c, list, n, v);
+  for (int i = 0; i < n; ++i)
+    if (v[i] != osd.get_reg(c, list[i])) ++bad;
+
+  return bad;
+}
+
+struct Checker {
+  Checker(OSDomain &osd): osd(osd), bad(0), bad_rip(0), calls(0) {}
+
+  // The program counter is the instruction's address while it runs.
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    if (++calls % 97) return;
+    bad += compare(osd, c);
+    X86Context ctx;
+    osd.get_context(c, ctx);
+    if (ctx[QSIM_X86_RIP] != va) ++bad_rip;
+  }
+
+  OSDomain &osd;
+  size_t bad, bad_rip, calls;
+};
+
+int main() {
+  OSDomain osd(CPUS, "regs=6", "synth");
+  Checker k(osd);
+  osd.set_inst_cb(&k, &Checker::inst);
+
+  for (int i = 0; i < 10; ++i)
+    for (int c = 0; c < CPUS; ++c) osd.run(c, 1000);
+
+  CHECK(k.calls >= 20000u);
+  CHECK_EQ(k.bad, 0u);
+  CHECK_EQ(k.bad_rip, 0u);
+
+  // The written registers hold the count of the instruction that wrote
+  // them, so the CPUs' register files differ.
+  X86Context c0, c1;
+  osd.get_context(0, c0);
+  osd.get_context(1, c1);
+  CHECK(c0[QSIM_X86_RIP] != c1[QSIM_X86_RIP]);
+  CHECK_EQ(c0[QSIM_X86_CS], 0x33u);
+  for (int c = 0; c < CPUS; ++c) CHECK_EQ(compare(osd, c), 0u);
+
+  osd.set_reg(1, QSIM_X86_RBX, 0x1234567890ull);
+  osd.set_reg(1, QSIM_X86_RIP, 0x8000);
+  static const int rb[] = { QSIM_X86_RBX, QSIM_X86_RIP };
+  uint64_t v[2];
+  osd.get_regs(1, rb, 2, v);
+  CHECK_EQ(v[0], 0x1234567890ull);
+  CHECK_EQ(v[1], 0x8000u);
+  osd.get_context(1, c1);
+  CHECK_EQ(c1[QSIM_X86_RBX], 0x1234567890ull);
+  CHECK_EQ(compare(osd, 1), 0u);
+
+  return check_result("regs");
+}
@@ -0,0 +1,110 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Region of interest gating. With roi=N the synthetic CPUs pass begin 1,
+// begin 2, end 2 and end 1 every N instructions, so instruction i (from 1)
+// is in region 1 when (i - 1) % 4N >= N and in region 2 when it is in
+// [2N, 3N). Events must be generated for exactly the instructions inside an
+// instrumented region, counting nesting depth.
+#include <vector>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const unsigned N = 100, CPUS = 2, INSTS = 8000;
+static const char *SPEC = "roi=100,mem=0.5,regs=2";
+
+struct Events {
+  Events(): insts(CPUS), mems(CPUS), regs(CPUS), per_inst(CPUS) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++insts[c];
+    per_inst[c].push_back(0);
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    ++mems[c];
+    if (!per_inst[c].empty()) ++per_inst[c].back();
+  }
+
+  void reg(int c, int r, uint8_t s, int t) { ++regs[c]; }
+
+  std::vector<uint64_t> insts, mems, regs;
+  std::vector<std::vector<unsigned> > per_inst;  // Accesses per instruction
+};
+
+static bool in_region(uint64_t i, int id) {
+  uint64_t p = (i - 1) % (4*N);
+  return id == 1 ? p >= N : p >= 2*N && p < 3*N;
+}
+
+static void run(OSDomain &osd, Events &e, unsigned insts) {
+  osd.set_inst_cb(&e, &Events::inst);
+  osd.set_mem_cb(&e, &Events::mem);
+  osd.set_reg_cb(&e, &Events::reg);
+  for (unsigned k = 0; k < insts / 250; ++k)
+    for (unsigned c = 0; c < CPUS; ++c) osd.run(c, 250);
+}
+
+// Gate on the given regions and compare with the ungated reference.
+static void check_gated(const Events &ref, bool r1, bool r2) {
+  OSDomain osd(CPUS, SPEC, "synth");
+  if (r1) osd.add_roi(1);
+  if (r2) osd.add_roi(2);
+  for (unsigned c = 0; c < CPUS; ++c) CHECK(!osd.in_roi(c));
+
+  Events e;
+  run(osd, e, INSTS);
+
+  for (unsigned c = 0; c < CPUS; ++c) {
+    uint64_t insts = 0, mems = 0;
+    for (uint64_t i = 1; i <= INSTS; ++i) {
+      if ((r1 && in_region(i, 1)) || (r2 && in_region(i, 2))) {
+        ++insts;
+        mems += ref.per_inst[c][i - 1];
+      }
+    }
+    CHECK_EQ(e.insts[c], insts);
+    CHECK_EQ(e.mems[c], mems);
+    CHECK_EQ(e.regs[c], 2*insts);
+
+    // INSTS is a whole number of cycles, so every region has closed.
+    CHECK(!osd.in_roi(c));
+  }
+
+  // Partway into the next cycle region 1 is open and region 2 is not.
+  for (unsigned c = 0; c < CPUS; ++c) osd.run(c, N + N/2);
+  for (unsigned c = 0; c < CPUS; ++c) CHECK_EQ(osd.in_roi(c), r1);
+}
+
+int main() {
+  // Without add_roi() the markers change nothing.
+  Events ref;
+  {
+    OSDomain osd(CPUS, SPEC, "synth");
+    run(osd, ref, INSTS);
+    for (unsigned c = 0; c < CPUS; ++c) {
+      CHECK_EQ(ref.insts[c], INSTS);
+      CHECK_EQ(ref.regs[c], 2u*INSTS);
+      CHECK(osd.in_roi(c));
+    }
+  }
+
+  check_gated(ref, true, false);    // 3/4 of the instructions
+  check_gated(ref, false, true);    // 1/4
+  check_gated(ref, true, true);     // Nested: end 2 leaves region 1 open
+
+  return check_result("roi");
+}
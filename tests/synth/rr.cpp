@@ -0,0 +1,137 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Record/replay: a replay raises every recorded interrupt at the same
+// instruction, however the runs are sliced and whatever interrupts are sent
+// meanwhile, so the event streams come out the same.
+#include <vector>
+#include <algorithm>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const char *LOG = "rr-test.log";
+
+struct Trace {
+  struct int_event { uint64_t at; uint8_t vec; };
+
+  Trace(int n): insts(n), hash(n), ints(n) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++insts[c];
+    hash[c] = (hash[c] ^ va) * 0x100000001b3ull;
+  }
+
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    hash[c] = (hash[c] ^ (va << 1 | t)) * 0x100000001b3ull;
+  }
+
+  int intr(int c, uint8_t v) {
+    int_event e = { insts[c], v };
+    ints[c].push_back(e);
+    return 0;
+  }
+
+  std::vector<uint64_t> insts, hash;
+  std::vector<std::vector<int_event> > ints;
+};
+
+static void attach(OSDomain &osd, Trace &t) {
+  osd.set_inst_cb(&t, &Trace::inst);
+  osd.set_mem_cb(&t, &Trace::mem);
+  osd.set_int_cb(&t, &Trace::intr);
+}
+
+int main() {
+  const char *spec = "mem=0.4,br=0.2,share=0.3";
+  const unsigned N = 40000;
+
+  // Record: per-CPU timer every 2500 instructions plus interrupts sent from
+  // outside, run in slices of 1000.
+  Trace rec(2);
+  {
+    OSDomain osd(2, spec, "synth");
+    attach(osd, rec);
+    osd.set_timer(2500);
+    CHECK(osd.start_record(LOG));
+    for (unsigned k = 0; k < N / 1000; ++k) {
+      if (k % 3 == 0) osd.interrupt(k % 2, 0x50 + k);
+      osd.run(0, 1000);
+      osd.run(1, 1000);
+    }
+    osd.end_record();
+  }
+
+  CHECK_EQ(rec.insts[0], N);
+  CHECK_EQ(rec.insts[1], N);
+  CHECK(rec.ints[0].size() > N / 2500);
+  CHECK(rec.ints[1].size() > N / 2500);
+
+  // Replay from the same state with other slices, another timer and other
+  // interrupts; only the logged interrupts may be raised.
+  Trace rep(2);
+  {
+    OSDomain osd(2, spec, "synth");
+    attach(osd, rep);
+    osd.set_timer(777);
+    CHECK(osd.start_replay(LOG));
+    unsigned done[2] = { 0, 0 }, slice[2] = { 1700, 333 };
+    while (done[0] < N || done[1] < N) {
+      for (int c = 0; c < 2; ++c) {
+        unsigned n = N - done[c] < slice[c] ? N - done[c] : slice[c];
+        if (!n) continue;
+        osd.interrupt(c, 0x99);
+        done[c] += osd.run(c, n);
+      }
+    }
+    CHECK(osd.end_replay());
+  }
+
+  for (int c = 0; c < 2; ++c) {
+    CHECK_EQ(rep.insts[c], rec.insts[c]);
+    CHECK_EQ(rep.hash[c], rec.hash[c]);
+    CHECK_EQ(rep.ints[c].size(), rec.ints[c].size());
+    size_t bad = 0, n = std::min(rep.ints[c].size(), rec.ints[c].size());
+    for (size_t i = 0; i < n; ++i)
+      if (rep.ints[c][i].at != rec.ints[c][i].at ||
+          rep.ints[c][i].vec != rec.ints[c][i].vec) ++bad;
+    CHECK_EQ(bad, 0u);
+  }
+
+  // Without the log the other timer puts the interrupts elsewhere.
+  Trace free_run(2);
+  {
+    OSDomain osd(2, spec, "synth");
+    attach(osd, free_run);
+    osd.set_timer(777);
+    for (unsigned k = 0; k < N / 1000; ++k) {
+      osd.run(0, 1000);
+      osd.run(1, 1000);
+    }
+  }
+  CHECK(free_run.ints[0].size() != rec.ints[0].size() ||
+        free_run.ints[0][0].at != rec.ints[0][0].at);
+
+  // A log for another number of CPUs is refused.
+  {
+    OSDomain osd(1, spec, "synth");
+    CHECK(!osd.start_replay(LOG));
+  }
+
+  remove(LOG);
+
+  return check_result("rr");
+}
@@ -0,0 +1,148 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// ParallelRunner: every CPU runs exactly one quantum per quantum, in steps,
+// with the per-CPU and quantum callbacks called once for each, and a run
+// ends where max_quanta, the quantum callback or stop() says, including
+// stop() called from OSDomain callbacks while the CPUs are running.
+#include <vector>
+#include <atomic>
+
+#include <stdint.h>
+
+#include <qsim.h>
+#include <qsim-runner.h>
+
+#include "check.h"
+
+using Qsim::OSDomain; using Qsim::ParallelRunner;
+
+static const int CPUS = 3;
+static const uint64_t QUANTUM = 1000;
+
+// A domain whose CPUs are all running, so every one of them runs from the
+// first quantum.
+struct Domain : OSDomain {
+  Domain(const char *spec = "mem=0.3"): OSDomain(CPUS, spec, "synth") {
+    run(0, 1);
+  }
+};
+
+struct Hooks {
+  Hooks(ParallelRunner &r, uint64_t last = 0):
+    r(r), insts(CPUS), per_cpu(CPUS), bad(0), quanta(0), last(last) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++insts[c];
+  }
+
+  // Called on the thread that ran CPU c, with the quantum about to end.
+  void cpu(int c, uint64_t q) {
+    if (q != r.get_quanta()) ++bad;
+    if (r.get_icount(c) != (q + 1) * QUANTUM) ++bad;
+    ++per_cpu[c];
+  }
+
+  bool quantum(uint64_t q) {
+    if (q != ++quanta) ++bad;
+    return q != last;
+  }
+
+  ParallelRunner &r;
+  std::vector<uint64_t> insts, per_cpu;
+  std::atomic<unsigned> bad;
+  uint64_t quanta, last;
+};
+
+static void test_quanta(unsigned threads) {
+  Domain osd;
+  ParallelRunner r(osd, threads);
+  Hooks h(r, 4);
+  osd.set_inst_cb(&h, &Hooks::inst);
+  r.set_quantum(QUANTUM);
+  r.set_step(300);
+  r.set_cpu_cb(&h, &Hooks::cpu);
+  r.set_quantum_cb(&h, &Hooks::quantum);
+  CHECK_EQ(r.get_threads(), threads);
+
+  // max_quanta ends the first run, the quantum callback the second.
+  CHECK_EQ(r.run(3), 3u);
+  CHECK_EQ(r.run(), 1u);
+  CHECK_EQ(r.get_quanta(), 4u);
+  CHECK_EQ(h.bad, 0u);
+  for (int c = 0; c < CPUS; ++c) {
+    CHECK_EQ(r.get_icount(c), 4 * QUANTUM);
+    CHECK_EQ(h.insts[c], 4 * QUANTUM);
+    CHECK_EQ(h.per_cpu[c], 4u);
+  }
+}
+
+// Stops the run from inside OSDomain callbacks, on whichever thread runs
+// the CPU, at CPU 1's at-th instruction or at-th begin 1 magic instruction.
+struct Stopper {
+  Stopper(ParallelRunner &r, uint64_t at): r(r), n(0), at(at) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    if (c == 1 && ++n == at) r.stop();
+  }
+
+  int magic(int c, uint64_t rax) {
+    if (c == 1 && rax == 0xb10c0001 && ++n == at) r.stop();
+    return 0;
+  }
+
+  ParallelRunner &r;
+  uint64_t n, at;
+};
+
+static void test_stop_inst(unsigned threads) {
+  Domain osd;
+  ParallelRunner r(osd, threads);
+  r.set_quantum(QUANTUM);
+  r.set_step(100);
+  Stopper s(r, 2 * QUANTUM + 10);
+  osd.set_inst_cb(&s, &Stopper::inst);
+
+  // The quantum in which stop() is called still runs to its end.
+  CHECK_EQ(r.run(), 3u);
+  for (int c = 0; c < CPUS; ++c) CHECK_EQ(r.get_icount(c), 3 * QUANTUM);
+
+  // A new run starts afresh.
+  CHECK_EQ(r.run(2), 2u);
+  CHECK_EQ(r.get_quanta(), 5u);
+  CHECK_EQ(r.get_icount(2), 5 * QUANTUM);
+}
+
+// roi=250 passes begin 1 on each CPU every 1000 instructions.
+static void test_stop_magic(unsigned threads) {
+  Domain osd("roi=250");
+  ParallelRunner r(osd, threads);
+  r.set_quantum(QUANTUM);
+  r.set_step(64);
+  Stopper s(r, 5);
+  osd.set_magic_cb(&s, &Stopper::magic);
+
+  uint64_t n = r.run(100);
+  CHECK(n >= 4 && n <= 6);
+  CHECK_EQ(s.n, n);
+  CHECK_EQ(r.get_icount(0), n * QUANTUM);
+}
+
+int main() {
+  for (unsigned t = 1; t <= CPUS; ++t) {
+    test_quanta(t);
+    test_stop_inst(t);
+    test_stop_magic(t);
+  }
+
+  return check_result("runner");
+}
@@ -0,0 +1,80 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Work stealing: with more CPUs than host threads, and a CPU count the
+// thread count does not divide, every CPU still runs exactly one quantum
+// per quantum, once, and threads that finish early take the CPUs queued
+// behind a slow one.
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+#include <stdint.h>
+
+#include <qsim.h>
+#include <qsim-runner.h>
+
+#include "check.h"
+
+using Qsim::OSDomain; using Qsim::ParallelRunner;
+
+static const uint64_t QUANTUM = 500;
+
+struct Load {
+  Load(int n): runs(n), bad(0), slow(0) {
+    for (int c = 0; c < n; ++c) runs[c].store(0);
+  }
+
+  // CPU 0 is slow: it sleeps once per quantum, holding up the thread that
+  // took it along with whatever else is in that thread's queue.
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    if (c == 0 && slow++ % QUANTUM == 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+  }
+
+  void cpu(int c, uint64_t q) {
+    if (++runs[c] != q + 1) ++bad;
+  }
+
+  std::vector<std::atomic<uint64_t> > runs;
+  std::atomic<unsigned> bad;
+  uint64_t slow;                // Instructions CPU 0 has run
+};
+
+static void check(int cpus, unsigned threads, unsigned quanta) {
+  OSDomain osd(cpus, "mem=0.3", "synth");
+  osd.run(0, 1);
+
+  ParallelRunner r(osd, threads);
+  Load l(cpus);
+  r.set_quantum(QUANTUM);
+  r.set_step(100);
+  r.set_cpu_cb(&l, &Load::cpu);
+  osd.set_inst_cb(&l, &Load::inst);
+
+  CHECK_EQ(r.get_threads(), threads);
+  CHECK_EQ(r.run(quanta), uint64_t(quanta));
+  CHECK_EQ(l.bad, 0u);
+
+  for (int c = 0; c < cpus; ++c) {
+    CHECK_EQ(r.get_icount(c), quanta * QUANTUM);
+    CHECK_EQ(l.runs[c].load(), uint64_t(quanta));
+  }
+  CHECK(r.get_steals() >= quanta);
+}
+
+int main() {
+  check(8, 3, 10);
+  check(16, 5, 5);
+  check(5, 2, 10);
+
+  return check_result("steal");
+}
@@ -0,0 +1,143 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// The synthetic backend itself: its stream keeps to the layout and mix the
+// settings ask for, stores reach guest RAM, the same seed gives the same
+// stream, and a saved state carries on exactly where it left off.
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+static const uint64_t CODE_FP = 64 << 10, SHARED_FP = 64 << 10,
+                      FOOTPRINT = 1 << 20;
+static const char *STATE = "synth-test.state";
+
+struct Stream {
+  Stream(OSDomain &osd, int n):
+    osd(osd), insts(n), mems(n), stores(n), shared(n), regs(n), hash(n),
+    bad_inst(0), bad_mem(0), bad_store(0)
+  {
+    osd.set_inst_cb(this, &Stream::inst);
+    osd.set_mem_cb(this, &Stream::mem);
+    osd.set_reg_cb(this, &Stream::reg);
+  }
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    if (va != pa || l != 4 || va < c*CODE_FP || va >= (c + 1)*CODE_FP)
+      ++bad_inst;
+    ++insts[c];
+    hash[c] = (hash[c] ^ va ^ uint64_t(t) << 60) * 0x100000001b3ull;
+  }
+
+  // Shared accesses fall in the region after the code, private ones in the
+  // CPU's own footprint after that. A store has already written the CPU's
+  // instruction count, from 0, when the callback sees it.
+  void mem(int c, uint64_t va, uint64_t pa, uint8_t s, int t) {
+    uint64_t shared_base = osd.get_n() * CODE_FP,
+             private_base = shared_base + SHARED_FP + c * FOOTPRINT;
+    if (va >= shared_base && va < shared_base + SHARED_FP) ++shared[c];
+    else if (va < private_base || va >= private_base + FOOTPRINT) ++bad_mem;
+    if (va != pa || s != 8 || va % 8) ++bad_mem;
+
+    ++mems[c];
+    if (t) {
+      ++stores[c];
+      uint64_t v;
+      osd.mem_rd(v, pa);
+      if (va >= private_base && v != insts[c] - 1) ++bad_store;
+    }
+    hash[c] = (hash[c] ^ (va << 1 | t)) * 0x100000001b3ull;
+  }
+
+  void reg(int c, int r, uint8_t s, int t) { ++regs[c]; }
+
+  OSDomain &osd;
+  std::vector<uint64_t> insts, mems, stores, shared, regs, hash;
+  unsigned bad_inst, bad_mem, bad_store;
+};
+
+static void run(OSDomain &osd, unsigned insts) {
+  for (unsigned k = 0; k < insts / 500; ++k)
+    for (int c = 0; c < osd.get_n(); ++c) osd.run(c, 500);
+}
+
+// Fractions are drawn at random, so allow 5% either way.
+static bool near(uint64_t n, uint64_t of, double f) {
+  return n > of * f * 0.95 && n < of * f * 1.05;
+}
+
+static void test_stream() {
+  OSDomain osd(2, "mem=0.4,wr=0.25,share=0.2,regs=3", "synth");
+  Stream s(osd, 2);
+  run(osd, 100000);
+
+  CHECK_EQ(s.bad_inst, 0u);
+  CHECK_EQ(s.bad_mem, 0u);
+  CHECK_EQ(s.bad_store, 0u);
+  for (int c = 0; c < 2; ++c) {
+    CHECK_EQ(s.insts[c], 100000u);
+    CHECK_EQ(osd.get_icount(c), 100000u);
+    CHECK_EQ(s.regs[c], 300000u);
+    CHECK(near(s.mems[c], s.insts[c], 0.4));
+    CHECK(near(s.stores[c], s.mems[c], 0.25));
+    CHECK(near(s.shared[c], s.mems[c], 0.2));
+  }
+  CHECK(s.hash[0] != s.hash[1]);
+}
+
+static void test_seed() {
+  OSDomain a(1, "seed=7", "synth"), b(1, "seed=7", "synth"),
+           c(1, "seed=8", "synth");
+  Stream sa(a, 1), sb(b, 1), sc(c, 1);
+  run(a, 10000); run(b, 10000); run(c, 10000);
+
+  CHECK_EQ(sa.hash[0], sb.hash[0]);
+  CHECK(sa.hash[0] != sc.hash[0]);
+}
+
+// A domain restored from a saved state produces what the original goes on
+// to produce.
+static void test_state() {
+  std::vector<uint64_t> want;
+  {
+    OSDomain osd(2, "mem=0.5,share=0.5", "synth");
+    run(osd, 5000);
+    osd.save_state(STATE);
+    Stream s(osd, 2);
+    run(osd, 5000);
+    want = s.hash;
+  }
+
+  OSDomain osd(STATE);
+  CHECK_EQ(osd.get_n(), 2);
+  Stream s(osd, 2);
+  run(osd, 5000);
+  CHECK_EQ(s.insts[0], 5000u);
+  CHECK_EQ(s.hash[0], want[0]);
+  CHECK_EQ(s.hash[1], want[1]);
+
+  remove(STATE);
+  remove((std::string(STATE) + ".cmd").c_str());
+}
+
+int main() {
+  test_stream();
+  test_seed();
+  test_state();
+
+  return check_result("synth");
+}
@@ -0,0 +1,120 @@
+/*****************************************************************************\
+* Qemu Simulation Framework (qsim)                                            *
+* Qsim is a modified version of the Qemu emulator (www.qemu.org), coupled     *
+* a C++ API, for the use of computer architecture researchers.                *
+*                                                                             *
+* This work is licensed under the terms of the GNU GPL, version 2. See the    *
+* COPYING file in the top-level directory.                                    *
+\*****************************************************************************/
+// Automatic timer: interrupts arrive every set_timer() instructions whatever
+// the slices passed to run(), per CPU or counted over the whole domain.
+#include <vector>
+
+#include <stdint.h>
+
+#include <qsim.h>
+
+#include "check.h"
+
+using Qsim::OSDomain;
+
+struct Ticks {
+  Ticks(int n): insts(n), at(n), other(0) {}
+
+  void inst(int c, uint64_t va, uint64_t pa, uint8_t l, const uint8_t *b,
+            enum inst_type t)
+  {
+    ++insts[c];
+  }
+
+  int intr(int c, uint8_t v) {
+    if (v == vec) at[c].push_back(insts[c]);
+    else ++other;
+    return 0;
+  }
+
+  std::vector<uint64_t> insts;
+  std::vector<std::vector<uint64_t> > at;   // Instructions before each tick
+  unsigned other;
+  uint8_t vec;
+};
+
+static void attach(OSDomain &osd, Ticks &t, uint8_t vec) {
+  t.vec = vec;
+  osd.set_inst_cb(&t, &Ticks::inst);
+  osd.set_int_cb(&t, &Ticks::intr);
+}
+
+// Ticks at exactly every multiple of period below insts; one that falls on
+// insts itself is still pending.
+static void check_cadence(const std::vector<uint64_t> &at, uint64_t period,
+                          uint64_t insts)
+{
+  CHECK_EQ(at.size(), (insts - 1) / period);
+  size_t bad = 0;
+  for (size_t k = 0; k < at.size(); ++k)
+    if (at[k] != (k + 1) * period) ++bad;
+  CHECK_EQ(bad, 0u);
+}
+
+// Each CPU is interrupted after every 1000 of its own instructions, though
+// the CPUs run in slices of 400 and 2500.
+static void test_per_cpu() {
+  OSDomain osd(2, "", "synth");
+  Ticks t(2);
+  attach(osd, t, 0xef);
+  osd.set_timer(1000);
+  CHECK_EQ(osd.get_timer(), 1000u);
+
+  for (unsigned k = 0; k < 50; ++k) osd.run(0, 400);
+  for (unsigned k = 0; k < 8; ++k) osd.run(1, 2500);
+
+  CHECK_EQ(osd.get_icount(0), 20000u);
+  CHECK_EQ(osd.get_icount(1), 20000u);
+  check_cadence(t.at[0], 1000, 20000);
+  check_cadence(t.at[1], 1000, 20000);
+  CHECK_EQ(t.other, 0u);
+
+  // Turning the timer off delivers what is pending and nothing more.
+  osd.set_timer(0);
+  osd.run(0, 5000); osd.run(1, 5000);
+  CHECK_EQ(t.at[0].size(), 20u);
+  CHECK_EQ(t.at[1].size(), 20u);
+}
+
+// A lone CPU gets the PIT's vector.
+static void test_uni() {
+  OSDomain osd(1, "", "synth");
+  Ticks t(1);
+  attach(osd, t, 0x30);
+  osd.set_timer(700);
+
+  for (unsigned k = 0; k < 10; ++k) osd.run(0, 1000);
+
+  check_cadence(t.at[0], 700, 10000);
+  CHECK_EQ(t.other, 0u);
+}
+
+// Domain-wide: one timer_interrupt(), to every running CPU, per 1000
+// instructions run by the two CPUs together.
+static void test_domain() {
+  OSDomain osd(2, "", "synth");
+  Ticks t(2);
+  attach(osd, t, 0xef);
+  osd.set_timer(1000, false);
+
+  for (unsigned k = 0; k < 40; ++k) { osd.run(0, 500); osd.run(1, 500); }
+
+  // Tick k follows CPU 1's k-th slice; each CPU takes it at its next one.
+  check_cadence(t.at[0], 500, 20000);
+  check_cadence(t.at[1], 500, 20000);
+  CHECK_EQ(t.other, 0u);
+}
+
+int main() {
+  test_per_cpu();
+  test_uni();
+  test_domain();
+
+  return check_result("timer");
+}